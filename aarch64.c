@@ -0,0 +1,1111 @@
+#include "charmcc.h"
+
+/*
+AArch64 backend, emitting A64 code for the AAPCS64 calling convention, as
+used by 64-bit Raspberry Pi OS.
+
+Every expression leaves its value in x0. Ints are computed in the 32-bit w
+registers, which wrap as on the other targets, and are sign-extended only
+where they meet a pointer. The most used scalar locals live in x19-x28,
+which calls preserve, and temporaries in fixed slots above the outgoing
+argument area, so sp does not move in the body.
+
+The frame, from sp up: outgoing arguments, temporaries, locals, the saved
+x19-x28, then the frame record x29 points at. Parameters passed on the
+stack are above it, in the caller's outgoing argument area.
+*/
+
+#define NUM_ARG_REGS 8
+#define FIRST_VAR_REG 19
+#define NUM_VAR_REGS 10
+#define REG_FP 29
+#define REG_LR 30
+#define REG_ZR 31
+
+// State of the function being generated, one per thread
+typedef struct FnContext FnContext;
+struct FnContext {
+    Obj *fn;
+    int depth;
+    // Temporaries live in fixed slots above the outgoing argument area
+    int temp_base;
+    int max_depth;
+    // Label at the end of the inlined call being generated, or -1
+    int inline_end;
+    // Whether a callee may be handed a pointer into the current frame
+    bool frame_escapes;
+    int labels;
+};
+
+static _Thread_local FnContext ctx;
+
+static char *xreg[] = {
+    "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10",
+    "x11", "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x19", "x20",
+    "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29", "x30", "xzr",
+};
+static char *wreg[] = {
+    "w0", "w1", "w2", "w3", "w4", "w5", "w6", "w7", "w8", "w9", "w10",
+    "w11", "w12", "w13", "w14", "w15", "w16", "w17", "w18", "w19", "w20",
+    "w21", "w22", "w23", "w24", "w25", "w26", "w27", "w28", "w29", "w30", "wzr",
+};
+
+static void gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+// Labels are numbered per function, as they are prefixed by its name.
+static int count(void) {
+    return ++ctx.labels;
+}
+
+static int align_to(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+static int max(int a, int b) {
+    return a > b ? a : b;
+}
+
+// Pointers and arrays take a whole x register, ints a w register.
+static bool is_wide(Type *type) {
+    return type->kind != TY_INT;
+}
+
+static char *reg(Type *type, int r) {
+    return is_wide(type) ? xreg[r] : wreg[r];
+}
+
+// Save x0 in the next free temporary slot.
+static void push(void) {
+    assert(ctx.depth < ctx.max_depth);
+    emit("  str   x0, [sp, #%d]\n", ctx.temp_base + 8 * ctx.depth);
+    ctx.depth++;
+}
+
+// Take the last saved temporary back into x`r`.
+static void pop(int r) {
+    ctx.depth--;
+    emit("  ldr   %s, [sp, #%d]\n", xreg[r], ctx.temp_base + 8 * ctx.depth);
+}
+
+/*
+Put an int in w`r`. A value with only one halfword different from all
+zeros or all ones is a single movz or movn, anything else takes a movk for
+the top half.
+*/
+static void gen_imm(int r, int val) {
+    unsigned v = val;
+    if (!(v >> 16) || !(v & 0xffff) || !(~v >> 16) || !(~v & 0xffff)) {
+        emit("  mov   %s, #%d\n", wreg[r], val);
+        return;
+    }
+    emit("  mov   %s, #%u\n", wreg[r], v & 0xffff);
+    emit("  movk  %s, #%u, lsl #16\n", wreg[r], v >> 16);
+}
+
+// dst = src + val. Immediates are 12 bits, optionally shifted left by 12.
+static void gen_add_imm(char *dst, char *src, int val) {
+    char *op = val < 0 ? "sub" : "add";
+    unsigned v = val < 0 ? -(unsigned)val : val;
+    assert(v < (1 << 24));
+    if (v >> 12) {
+        emit("  %s   %s, %s, #%u, lsl #12\n", op, dst, src, v >> 12);
+        src = dst;
+    }
+    if ((v & 0xfff) || src != dst) {
+        emit("  %s   %s, %s, #%u\n", op, dst, src, v & 0xfff);
+    }
+}
+
+// Can an access of `size` bytes at `disp` use the scaled immediate offset?
+static bool fits_offset(int disp, int size) {
+    return disp >= 0 && disp % size == 0 && disp / size < 4096;
+}
+
+// Register and displacement a frame variable is addressed with.
+static char *frame_base(Obj *var, int *disp) {
+    if (var->offset < 0) {
+        // passed on the stack, above the frame record
+        *disp = -var->offset;
+        return "x29";
+    }
+    *disp = ctx.fn->stack_size - var->offset;
+    return "sp";
+}
+
+static void gen_var_addr(int r, Obj *var) {
+    assert(!var->reg);
+    if (var->is_local) {
+        int disp;
+        char *base = frame_base(var, &disp);
+        gen_add_imm(xreg[r], base, disp);
+    } else {
+        emit("  adrp  %s, __global_%s\n", xreg[r], var->name);
+        emit("  add   %s, %s, :lo12:__global_%s\n", xreg[r], xreg[r], var->name);
+    }
+}
+
+// Load a variable into register `r`, using only that register. An array
+// gives the address of its first element.
+static void load_var(int r, Obj *var) {
+    char *dst = reg(var->type, r);
+    if (var->reg) {
+        emit("  mov   %s, %s\n", dst, reg(var->type, var->reg));
+    } else if (var->type->kind == TY_ARRAY) {
+        gen_var_addr(r, var);
+    } else if (var->is_local) {
+        int disp;
+        char *base = frame_base(var, &disp);
+        if (fits_offset(disp, var->type->size)) {
+            emit("  ldr   %s, [%s, #%d]\n", dst, base, disp);
+        } else {
+            gen_add_imm(xreg[r], base, disp);
+            emit("  ldr   %s, [%s]\n", dst, xreg[r]);
+        }
+    } else {
+        emit("  adrp  %s, __global_%s\n", xreg[r], var->name);
+        emit("  ldr   %s, [%s, :lo12:__global_%s]\n", dst, xreg[r], var->name);
+    }
+}
+
+// Store x0 to a scalar variable, using x16 for the address if needed.
+static void store_var(Obj *var) {
+    char *src = reg(var->type, 0);
+    if (var->reg) {
+        emit("  mov   %s, %s\n", reg(var->type, var->reg), src);
+    } else if (var->is_local) {
+        int disp;
+        char *base = frame_base(var, &disp);
+        if (fits_offset(disp, var->type->size)) {
+            emit("  str   %s, [%s, #%d]\n", src, base, disp);
+        } else {
+            gen_add_imm("x16", base, disp);
+            emit("  str   %s, [x16]\n", src);
+        }
+    } else {
+        emit("  adrp  x16, __global_%s\n", var->name);
+        emit("  str   %s, [x16, :lo12:__global_%s]\n", src, var->name);
+    }
+}
+
+// Literals and variables have no side effects and need no other register.
+static bool is_leaf(Node *node) {
+    return node->kind == ND_NUM || node->kind == ND_VAR;
+}
+
+// Put leaf `node` in register `r`, or return the one it already lives in.
+static int gen_leaf(Node *node, int r) {
+    if (node->kind == ND_VAR && node->var->reg) {
+        return node->var->reg;
+    }
+    if (node->kind == ND_NUM) {
+        gen_imm(r, node->val);
+    } else {
+        load_var(r, node->var);
+    }
+    return r;
+}
+
+// Evaluate `node` into x0, or find the register it lives in.
+static int gen_value(Node *node) {
+    if (is_leaf(node)) {
+        return gen_leaf(node, 0);
+    }
+    gen_expr(node);
+    return 0;
+}
+
+// Like gen_leaf, for an operand only read, where the zero register is 0.
+static int gen_source(Node *node, int r) {
+    if (node->kind == ND_NUM && node->val == 0) {
+        return REG_ZR;
+    }
+    return gen_leaf(node, r);
+}
+
+// Would the immediate form of add, sub or cmp take `node`?
+static bool is_add_imm(Node *node) {
+    return node->kind == ND_NUM && -4095 <= node->val && node->val <= 4095;
+}
+
+/*
+Evaluate two operands into registers *l and *r. A leaf is loaded last,
+into a register of its own, so that only an inner expression on both sides
+needs a temporary. With `imm_ok`, a small literal on the right is left for
+an immediate operand instead, and *r is set to -1.
+*/
+static void gen_operands(Node *lhs, Node *rhs, bool imm_ok, int *l, int *r) {
+    if ((imm_ok && is_add_imm(rhs)) || is_leaf(rhs)) {
+        *l = gen_value(lhs);
+        *r = imm_ok && is_add_imm(rhs) ? -1 : gen_leaf(rhs, 1);
+        return;
+    }
+    if (is_leaf(lhs)) {
+        gen_expr(rhs);
+        *r = 0;
+        *l = gen_leaf(lhs, 1);
+        return;
+    }
+    gen_expr(rhs);
+    push();
+    gen_expr(lhs);
+    pop(1);
+    *l = 0;
+    *r = 1;
+}
+
+// Most temporaries gen_operands needs for the pair.
+static int temp_depth(Node *node);
+
+static int operands_temp_depth(Node *lhs, Node *rhs) {
+    if (is_leaf(rhs)) {
+        return temp_depth(lhs);
+    }
+    if (is_leaf(lhs)) {
+        return temp_depth(rhs);
+    }
+    return max(temp_depth(rhs), 1 + temp_depth(lhs));
+}
+
+/*
+Emit `op x0, l, r`, or `op l, r` for cmp, on the operands left by
+gen_operands. The operation is as wide as a pointer operand, and an int
+meeting a pointer is sign-extended: on the right by the extended register
+form, on the left into x2.
+*/
+static void emit_op(char *op, Node *node, int l, int r) {
+    bool wide = is_wide(node->lhs->type) || is_wide(node->rhs->type);
+    char **regs = wide ? xreg : wreg;
+    if (wide && !is_wide(node->lhs->type)) {
+        emit("  sxtw  x2, %s\n", wreg[l]);
+        l = 2;
+    }
+
+    char rhs[32];
+    if (r < 0 && node->rhs->val == 0 && strcmp(op, "cmp")) {
+        // adding nothing, as address arithmetic often does
+        if (l != 0) {
+            emit("  mov   %s, %s\n", regs[0], regs[l]);
+        }
+        return;
+    }
+    if (r < 0) {
+        int val = node->rhs->val;
+        if (val < 0) {
+            // the immediate is unsigned, so use the opposite operation
+            op = !strcmp(op, "add") ? "sub" : !strcmp(op, "sub") ? "add" : "cmn";
+            val = -val;
+        }
+        snprintf(rhs, sizeof(rhs), "#%d", val);
+    } else if (wide && !is_wide(node->rhs->type)) {
+        snprintf(rhs, sizeof(rhs), "%s, sxtw", wreg[r]);
+    } else {
+        snprintf(rhs, sizeof(rhs), "%s", regs[r]);
+    }
+
+    if (!strcmp(op, "cmp") || !strcmp(op, "cmn")) {
+        emit("  %-5s %s, %s\n", op, regs[l], rhs);
+    } else {
+        emit("  %-5s %s, %s, %s\n", op, regs[0], regs[l], rhs);
+    }
+}
+
+static bool is_compare(Node *node) {
+    switch (node->kind) {
+    case ND_EQ:
+    case ND_NEQ:
+    case ND_LT:
+    case ND_LTE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Set the flags for comparison `node`, and return the condition under
+// which it holds.
+static char *gen_compare(Node *node) {
+    int l, r;
+    gen_operands(node->lhs, node->rhs, true, &l, &r);
+    emit_op("cmp", node, l, r);
+    switch (node->kind) {
+    case ND_EQ:
+        return "eq";
+    case ND_NEQ:
+        return "ne";
+    case ND_LT:
+        return "lt";
+    default:
+        return "le";
+    }
+}
+
+static char *invert(char *cond) {
+    if (!strcmp(cond, "eq")) {
+        return "ne";
+    }
+    if (!strcmp(cond, "ne")) {
+        return "eq";
+    }
+    if (!strcmp(cond, "lt")) {
+        return "ge";
+    }
+    return "gt";
+}
+
+// Set the flags for a condition, returning the one for true.
+static char *gen_condition(Node *node) {
+    if (is_compare(node)) {
+        return gen_compare(node);
+    }
+    int l = gen_value(node);
+    emit("  cmp   %s, #0\n", reg(node->type, l));
+    return "ne";
+}
+
+/*
+Branch to `fn.KIND.C` if `node` is false: a comparison is a cmp and a
+conditional branch, anything else is tested by cbz.
+*/
+static void gen_branch_false(Node *node, char *kind, int c) {
+    if (is_compare(node)) {
+        char *cond = gen_compare(node);
+        emit("  b.%s  %s.%s.%d\n", invert(cond), ctx.fn->name, kind, c);
+        return;
+    }
+    int l = gen_value(node);
+    emit("  cbz   %s, %s.%s.%d\n", reg(node->type, l), ctx.fn->name, kind, c);
+}
+
+/*
+Addressing modes: an access of `size` bytes at `base + imm`, or at
+`base + index * size` as array indexing gives, folds the addition into the
+load or store.
+*/
+typedef struct Address Address;
+struct Address {
+    Node *base;
+    Node *index;  // Int scaled by the access size, or NULL
+    int offset;
+};
+
+static void split_address(Node *addr, int size, Address *a) {
+    a->base = addr;
+    a->index = NULL;
+    a->offset = 0;
+    if (addr->kind != ND_ADD || !addr->lhs->type->base) {
+        return;
+    }
+
+    Node *rhs = addr->rhs;
+    if (rhs->kind == ND_NUM && fits_offset(rhs->val, size)) {
+        a->base = addr->lhs;
+        a->offset = rhs->val;
+    } else if (rhs->kind == ND_MUL && rhs->rhs->kind == ND_NUM && rhs->rhs->val == size) {
+        a->base = addr->lhs;
+        a->index = rhs->lhs;
+    }
+}
+
+// Print the operand for an access of `size` bytes through registers b and i.
+static void print_address(Address *a, int size, int b, int i) {
+    if (a->index) {
+        emit("[%s, %s, sxtw #%d]\n", xreg[b], wreg[i], size == 8 ? 3 : 2);
+    } else if (a->offset) {
+        emit("[%s, #%d]\n", xreg[b], a->offset);
+    } else {
+        emit("[%s]\n", xreg[b]);
+    }
+}
+
+// Evaluate the parts of an address into the registers for print_address.
+static void gen_address(Address *a, int *b, int *i) {
+    *i = 0;
+    if (a->index) {
+        gen_operands(a->base, a->index, false, b, i);
+    } else {
+        *b = gen_value(a->base);
+    }
+}
+
+static int address_temp_depth(Address *a) {
+    return a->index ? operands_temp_depth(a->base, a->index) : temp_depth(a->base);
+}
+
+static void gen_load(Node *node) {
+    if (node->type->kind == TY_ARRAY) {
+        // references to the array are pointers to the first element
+        gen_expr(node->lhs);
+        return;
+    }
+
+    int size = node->type->size;
+    Address a;
+    split_address(node->lhs, size, &a);
+    int b, i;
+    gen_address(&a, &b, &i);
+    emit("  ldr   %s, ", reg(node->type, 0));
+    print_address(&a, size, b, i);
+}
+
+static int load_temp_depth(Node *node) {
+    if (node->type->kind == TY_ARRAY) {
+        return temp_depth(node->lhs);
+    }
+    Address a;
+    split_address(node->lhs, node->type->size, &a);
+    return address_temp_depth(&a);
+}
+
+// Can the address of `*addr = ...` be put together after the value, with
+// no temporaries?
+static bool is_leaf_address(Address *a) {
+    return is_leaf(a->base) && (!a->index || is_leaf(a->index));
+}
+
+/*
+Store `*addr = value`. The value goes first if the address is made of
+leaves, and a leaf value goes last, so that only an inner expression on
+both sides needs a temporary.
+*/
+static void gen_store(Node *node) {
+    Node *lhs = node->lhs;
+    int size = lhs->type->size;
+    Address a;
+    split_address(lhs->lhs, size, &a);
+
+    if (is_leaf_address(&a)) {
+        gen_expr(node->rhs);
+        int b = gen_leaf(a.base, 1);
+        int i = a.index ? gen_leaf(a.index, 2) : 0;
+        emit("  str   %s, ", reg(lhs->type, 0));
+        print_address(&a, size, b, i);
+        return;
+    }
+
+    if (is_leaf(node->rhs)) {
+        int b, i;
+        gen_address(&a, &b, &i);
+        int v = gen_source(node->rhs, 2);
+        emit("  str   %s, ", reg(lhs->type, v));
+        print_address(&a, size, b, i);
+        emit("  mov   %s, %s\n", reg(lhs->type, 0), reg(lhs->type, v));
+        return;
+    }
+
+    gen_expr(lhs->lhs);
+    push();
+    gen_expr(node->rhs);
+    pop(1);
+    emit("  str   %s, [x1]\n", reg(lhs->type, 0));
+}
+
+static int store_temp_depth(Node *node) {
+    Address a;
+    split_address(node->lhs->lhs, node->lhs->type->size, &a);
+    if (is_leaf_address(&a)) {
+        return temp_depth(node->rhs);
+    }
+    if (is_leaf(node->rhs)) {
+        return address_temp_depth(&a);
+    }
+    return max(temp_depth(node->lhs->lhs), 1 + temp_depth(node->rhs));
+}
+
+/*
+Put call arguments where AAPCS64 wants them: the first eight in x0-x7, the
+rest in the outgoing argument area at sp.
+
+Arguments which need computing are evaluated first, in order, and all but
+the last are kept in temporaries meanwhile. Leaves are loaded straight
+into their registers at the end.
+*/
+static void gen_args(Node *args) {
+    int last = -1;
+    int i = 0;
+    for (Node *arg = args; arg; arg = arg->next, i++) {
+        if (!is_leaf(arg)) {
+            last = i;
+        }
+    }
+
+    i = 0;
+    for (Node *arg = args; arg; arg = arg->next, i++) {
+        if (is_leaf(arg)) {
+            continue;
+        }
+        gen_expr(arg);
+        if (i != last) {
+            push();
+        }
+    }
+
+    for (i = last; i >= 0; i--) {
+        Node *arg = args;
+        for (int j = 0; j < i; j++) {
+            arg = arg->next;
+        }
+        if (is_leaf(arg)) {
+            continue;
+        }
+
+        if (i != last) {
+            pop(i < NUM_ARG_REGS ? i : 16);
+        }
+        if (i >= NUM_ARG_REGS) {
+            emit("  str   %s, [sp, #%d]\n", i == last ? "x0" : "x16", 8 * (i - NUM_ARG_REGS));
+        } else if (i == last && i != 0) {
+            emit("  mov   x%d, x0\n", i);
+        }
+    }
+
+    i = 0;
+    for (Node *arg = args; arg; arg = arg->next, i++) {
+        if (!is_leaf(arg)) {
+            continue;
+        }
+        int r = i < NUM_ARG_REGS ? i : 16;
+        int src = gen_leaf(arg, r);
+        if (src != r) {
+            emit("  mov   %s, %s\n", xreg[r], xreg[src]);
+        }
+        if (i >= NUM_ARG_REGS) {
+            emit("  str   x16, [sp, #%d]\n", 8 * (i - NUM_ARG_REGS));
+        }
+    }
+}
+
+static int count_args(Node *args) {
+    int n = 0;
+    for (Node *arg = args; arg; arg = arg->next) {
+        n++;
+    }
+    return n;
+}
+
+// Bytes of stack taken by arguments past the eighth; sp stays 16-aligned.
+static int stack_args_size(Node *args) {
+    int n = count_args(args) - NUM_ARG_REGS;
+    return n > 0 ? align_to(8 * n, 16) : 0;
+}
+
+// x19-x28 in the order they are saved, returning how many.
+static int saved_var_regs(Obj *fn, int *regs) {
+    int n = 0;
+    for (int r = FIRST_VAR_REG; r < FIRST_VAR_REG + NUM_VAR_REGS; r++) {
+        if (fn->saved_regs & (1 << r)) {
+            regs[n++] = r;
+        }
+    }
+    return n;
+}
+
+// Undo the prologue, leaving x30 holding the return address.
+static void gen_epilogue(Obj *fn) {
+    int regs[NUM_VAR_REGS];
+    int n = saved_var_regs(fn, regs);
+    if (fn->stack_size) {
+        gen_add_imm("sp", "sp", fn->stack_size);
+    }
+    for (int i = n - 1 - (n % 2 == 0); i >= 0; i -= 2) {
+        if (i + 1 < n) {
+            emit("  ldp   %s, %s, [sp], #16\n", xreg[regs[i]], xreg[regs[i + 1]]);
+        } else {
+            emit("  ldr   %s, [sp], #16\n", xreg[regs[i]]);
+        }
+    }
+    if (fn->saved_regs & (1 << REG_FP)) {
+        emit("  ldp   x29, x30, [sp], #16\n");
+    }
+}
+
+/*
+Jump to the callee of `return f(...)` instead of calling it, so that it
+returns straight to our caller. A call to the function itself restarts it
+with the new arguments, which turns tail recursion into a loop.
+
+Not done if the callee might be given a pointer into the frame, or needs
+arguments on the stack.
+*/
+static bool tail_calls_self(Node *node) {
+    if (node == NULL) {
+        return false;
+    }
+
+    if (node->kind == ND_RETURN && node->lhs->kind == ND_FN_CALL) {
+        return !strcmp(node->lhs->func, ctx.fn->name);
+    }
+
+    for (Node *b = node->body; b; b = b->next) {
+        if (tail_calls_self(b)) {
+            return true;
+        }
+    }
+    return tail_calls_self(node->consequence)
+        || tail_calls_self(node->alternative)
+        || tail_calls_self(node->initialize);
+}
+
+static bool gen_tail_call(Node *node) {
+    if (node->kind != ND_FN_CALL || ctx.inline_end >= 0 || ctx.frame_escapes
+        || count_args(node->args) > NUM_ARG_REGS) {
+        return false;
+    }
+
+    gen_args(node->args);
+    if (!strcmp(node->func, ctx.fn->name)) {
+        emit("  b     %s.tail\n", ctx.fn->name);
+        return true;
+    }
+
+    gen_epilogue(ctx.fn);
+    emit("  b     %s\n", node->func);
+    return true;
+}
+
+static void gen_expr(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        gen_imm(0, node->val);
+        return;
+    case ND_NEG: {
+        int l = gen_value(node->lhs);
+        emit("  neg   w0, %s\n", wreg[l]);
+        return;
+    }
+    case ND_VAR:
+        load_var(0, node->var);
+        return;
+    case ND_ADDR:
+        if (node->lhs->kind == ND_VAR) {
+            gen_var_addr(0, node->lhs->var);
+        } else {
+            gen_expr(node->lhs->lhs);
+        }
+        return;
+    case ND_DEREF:
+        gen_load(node);
+        return;
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_VAR) {
+            gen_expr(node->rhs);
+            store_var(node->lhs->var);
+        } else if (node->lhs->kind == ND_DEREF) {
+            gen_store(node);
+        } else {
+            error_tok(node->lhs->repr, "not an lvalue");
+        }
+        return;
+    case ND_FN_CALL:
+        gen_args(node->args);
+        emit("  bl    %s\n", node->func);
+        return;
+    case ND_INLINE: {
+        // The returns inside leave their value in x0, like a call would.
+        int outer = ctx.inline_end;
+        ctx.inline_end = count();
+        for (Node *n = node->body; n; n = n->next) {
+            gen_stmt(n);
+        }
+        emit("%s.inline.end.%d:\n", ctx.fn->name, ctx.inline_end);
+        ctx.inline_end = outer;
+        return;
+    }
+    default:
+        break;
+    }
+
+    if (is_compare(node)) {
+        char *cond = gen_compare(node);
+        emit("  cset  w0, %s\n", cond);
+        return;
+    }
+
+    int l, r;
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+        gen_operands(node->lhs, node->rhs, true, &l, &r);
+        emit_op(node->kind == ND_ADD ? "add" : "sub", node, l, r);
+        return;
+    case ND_MUL:
+        gen_operands(node->lhs, node->rhs, false, &l, &r);
+        emit_op("mul", node, l, r);
+        return;
+    case ND_DIV:
+        gen_operands(node->lhs, node->rhs, false, &l, &r);
+        emit_op("sdiv", node, l, r);
+        return;
+    default:
+        break;
+    }
+
+    error_tok(node->repr, "invalid expression");
+}
+
+// `x = leaf;` for a register variable x, possibly alone in a block, or NULL.
+static Node *leaf_assign(Node *stmt) {
+    while (stmt && stmt->kind == ND_BLOCK && stmt->body && !stmt->body->next) {
+        stmt = stmt->body;
+    }
+    if (!stmt || stmt->kind != ND_EXPR_STMT) {
+        return NULL;
+    }
+
+    Node *assign = stmt->lhs;
+    if (assign->kind != ND_ASSIGN || assign->lhs->kind != ND_VAR || !assign->lhs->var->reg) {
+        return NULL;
+    }
+    return is_leaf(assign->rhs) ? assign : NULL;
+}
+
+/*
+If-conversion: `if (c) x = a; else x = b;`, for a register variable x and
+leaves a and b, is a csel with no branch to mispredict. A missing else
+keeps the old value.
+*/
+static bool gen_select(Node *node) {
+    Node *then = leaf_assign(node->consequence);
+    if (!then) {
+        return false;
+    }
+    Node *other = NULL;
+    if (node->alternative) {
+        other = leaf_assign(node->alternative);
+        if (!other || other->lhs->var != then->lhs->var) {
+            return false;
+        }
+    }
+
+    Obj *var = then->lhs->var;
+    char *cond = gen_condition(node->condition);
+    int a = gen_source(then->rhs, 1);
+    int b = other ? gen_source(other->rhs, 2) : var->reg;
+    emit("  csel  %s, %s, %s, %s\n",
+           reg(var->type, var->reg), reg(var->type, a), reg(var->type, b), cond);
+    return true;
+}
+
+static void gen_stmt(Node *node) {
+    switch (node->kind) {
+    case ND_IF: {
+        if (gen_select(node)) {
+            return;
+        }
+        int c = count();
+        gen_branch_false(node->condition, "if.else", c);
+        gen_stmt(node->consequence);
+        if (node->alternative) {
+            emit("  b     %s.if.end.%d\n", ctx.fn->name, c);
+        }
+        emit("%s.if.else.%d:\n", ctx.fn->name, c);
+        if (node->alternative) {
+            gen_stmt(node->alternative);
+            emit("%s.if.end.%d:\n", ctx.fn->name, c);
+        }
+        return;
+    }
+    case ND_LOOP: {
+        int c = count();
+        if (node->initialize) {
+            gen_stmt(node->initialize);
+        }
+        emit("%s.loop.begin.%d:\n", ctx.fn->name, c);
+        if (node->condition) {
+            gen_branch_false(node->condition, "loop.end", c);
+        }
+        gen_stmt(node->consequence);
+        if (node->increment) {
+            gen_expr(node->increment);
+        }
+        emit("  b     %s.loop.begin.%d\n", ctx.fn->name, c);
+        emit("%s.loop.end.%d:\n", ctx.fn->name, c);
+        return;
+    }
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            gen_stmt(n);
+        }
+        return;
+    case ND_RETURN:
+        if (gen_tail_call(node->lhs)) {
+            return;
+        }
+        gen_expr(node->lhs);
+        if (ctx.inline_end >= 0) {
+            emit("  b     %s.inline.end.%d\n", ctx.fn->name, ctx.inline_end);
+        } else {
+            emit("  b     %s.return\n", ctx.fn->name);
+        }
+        return;
+    case ND_EXPR_STMT:
+        gen_expr(node->lhs);
+        return;
+    default:
+        break;
+    }
+
+    // including vector loops, which this target does not ask for
+    error_tok(node->repr, "invalid statement");
+}
+
+// Index of `var` among the parameters of `fn`, or -1.
+static int param_index(Obj *fn, Obj *var) {
+    int i = 0;
+    for (Obj *param = fn->params; param; param = param->next, i++) {
+        if (param == var) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Largest outgoing argument area needed by a call in the subtree.
+static int max_stack_args(Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int size = node->kind == ND_FN_CALL ? stack_args_size(node->args) : 0;
+    Node *kids[] = {
+        node->lhs, node->rhs, node->condition, node->consequence,
+        node->alternative, node->initialize, node->increment,
+    };
+    for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+        size = max(size, max_stack_args(kids[i]));
+    }
+    for (Node *b = node->body; b; b = b->next) {
+        size = max(size, max_stack_args(b));
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        size = max(size, max_stack_args(a));
+    }
+    return size;
+}
+
+static int stmt_temp_depth(Node *node);
+
+// Most temporaries alive at once while `node` is evaluated, as gen_expr
+// and gen_args push them.
+static int temp_depth(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+        return 0;
+    case ND_NEG:
+        return temp_depth(node->lhs);
+    case ND_DEREF:
+        return load_temp_depth(node);
+    case ND_ADDR:
+        return node->lhs->kind == ND_DEREF ? temp_depth(node->lhs->lhs) : 0;
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_DEREF) {
+            return store_temp_depth(node);
+        }
+        // Any other non-variable is not an lvalue, which gen_expr() reports
+        return temp_depth(node->rhs);
+    case ND_FN_CALL: {
+        int n = 0;
+        int pushed = 0;
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            if (!is_leaf(arg)) {
+                n = max(n, pushed++ + temp_depth(arg));
+            }
+        }
+        return n;
+    }
+    case ND_INLINE: {
+        int n = 0;
+        for (Node *b = node->body; b; b = b->next) {
+            n = max(n, stmt_temp_depth(b));
+        }
+        return n;
+    }
+    default:
+        return operands_temp_depth(node->lhs, node->rhs);
+    }
+}
+
+// Most temporaries needed by any expression in a statement.
+static int stmt_temp_depth(Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        return temp_depth(node->lhs);
+    default:
+        break;
+    }
+
+    int n = max(stmt_temp_depth(node->consequence), stmt_temp_depth(node->alternative));
+    n = max(n, stmt_temp_depth(node->initialize));
+    if (node->condition) {
+        n = max(n, temp_depth(node->condition));
+    }
+    if (node->increment) {
+        n = max(n, temp_depth(node->increment));
+    }
+    for (Node *b = node->body; b; b = b->next) {
+        n = max(n, stmt_temp_depth(b));
+    }
+    return n;
+}
+
+/*
+Keep the most used scalar locals in x19-x28.
+
+A function which takes the address of a scalar local keeps all of them in
+the frame, as pointer arithmetic may walk from one slot to the next.
+*/
+static void assign_regs(Obj *fn) {
+    for (Obj *var = fn->locals; var; var = var->next) {
+        var->reg = 0;
+    }
+    for (Obj *var = fn->locals; var; var = var->next) {
+        if (var->type->kind != TY_ARRAY && addr_taken(fn->body, var)) {
+            return;
+        }
+    }
+
+    for (int reg = FIRST_VAR_REG; reg < FIRST_VAR_REG + NUM_VAR_REGS; reg++) {
+        Obj *best = NULL;
+        int best_uses = 0;
+        for (Obj *var = fn->locals; var; var = var->next) {
+            if (var->reg || var->type->kind == TY_ARRAY || param_index(fn, var) >= NUM_ARG_REGS) {
+                continue;
+            }
+            int uses = count_uses(fn->body, var);
+            if (uses > best_uses) {
+                best = var;
+                best_uses = uses;
+            }
+        }
+        if (!best) {
+            return;
+        }
+        best->reg = reg;
+        fn->saved_regs |= 1 << reg;
+    }
+}
+
+/*
+Locals left in the frame are in declaration order below the saved
+registers, so that pointer arithmetic from one to the next works as on the
+other targets. A leaf function without stack parameters needs no frame
+record.
+*/
+static void layout_frame(Obj *fn, Options *opts) {
+    fn->saved_regs = 0;
+    assign_regs(fn);
+
+    int offset = 0;
+    bool stack_params = false;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        if (var->reg) {
+            continue;
+        }
+        int i = param_index(fn, var);
+        if (i >= NUM_ARG_REGS) {
+            var->offset = -(16 + 8 * (i - NUM_ARG_REGS));
+            stack_params = true;
+            continue;
+        }
+        offset = align_to(offset + var->type->size, type_align(var->type));
+        var->offset = offset;
+    }
+
+    if (stack_params || contains(fn->body, ND_FN_CALL)) {
+        fn->saved_regs |= 1 << REG_FP | 1 << REG_LR;
+    }
+    int temps = 8 * stmt_temp_depth(fn->body);
+    fn->stack_size = align_to(max_stack_args(fn->body) + temps + offset, 16);
+
+    if (opts->stats) {
+        fprintf(stderr, "%s: frame %d bytes\n", fn->name, fn->stack_size);
+    }
+}
+
+static void emit_function(Obj *fn) {
+    ctx = (FnContext){.fn = fn, .inline_end = -1};
+
+    for (Obj *var = fn->locals; var; var = var->next) {
+        ctx.frame_escapes |= addr_taken(fn->body, var);
+    }
+
+    emit("%s:\n", fn->name);
+    if (fn->saved_regs & (1 << REG_FP)) {
+        emit("  stp   x29, x30, [sp, #-16]!\n");
+        emit("  mov   x29, sp\n");
+    }
+    int regs[NUM_VAR_REGS];
+    int n = saved_var_regs(fn, regs);
+    for (int i = 0; i < n; i += 2) {
+        if (i + 1 < n) {
+            emit("  stp   %s, %s, [sp, #-16]!\n", xreg[regs[i]], xreg[regs[i + 1]]);
+        } else {
+            emit("  str   %s, [sp, #-16]!\n", xreg[regs[i]]);
+        }
+    }
+    if (fn->stack_size) {
+        gen_add_imm("sp", "sp", -fn->stack_size);
+    }
+    ctx.temp_base = max_stack_args(fn->body);
+    ctx.max_depth = stmt_temp_depth(fn->body);
+    if (!ctx.frame_escapes && tail_calls_self(fn->body)) {
+        emit("%s.tail:\n", fn->name);
+    }
+
+    // Move passed-by-register arguments to where the parameters live
+    int i = 0;
+    for (Obj *var = fn->params; var && i < NUM_ARG_REGS; var = var->next, i++) {
+        if (var->reg) {
+            emit("  mov   %s, %s\n", reg(var->type, var->reg), reg(var->type, i));
+            continue;
+        }
+        int disp;
+        char *base = frame_base(var, &disp);
+        if (fits_offset(disp, var->type->size)) {
+            emit("  str   %s, [%s, #%d]\n", reg(var->type, i), base, disp);
+        } else {
+            gen_add_imm("x16", base, disp);
+            emit("  str   %s, [x16]\n", reg(var->type, i));
+        }
+    }
+
+    gen_stmt(fn->body);
+    assert(ctx.depth == 0);
+
+    emit("%s.return:\n", fn->name);
+    gen_epilogue(fn);
+    emit("  ret\n\n");
+}
+
+static void emit_header(Obj *prog, Options *opts) {
+    // the stack need not be executable
+    emit(".section .note.GNU-stack,\"\",%%progbits\n");
+    emit(".text\n.balign 4\n");
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function && !obj->is_static) {
+            emit(".globl %s\n", obj->name);
+        }
+    }
+    emit("\n");
+}
+
+static char *data_directive(int size) {
+    return size == 4 ? ".word" : ".xword";
+}
+
+Target target_aarch64 = {
+    .name = "aarch64",
+    .ptr_size = 8,
+    .vectors = false,
+    .layout_frame = layout_frame,
+    .data_directive = data_directive,
+    .emit_header = emit_header,
+    .emit_function = emit_function,
+    // sdiv does division, so no runtime
+};
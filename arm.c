@@ -0,0 +1,1618 @@
+#include "charmcc.h"
+
+/*
+32-bit ARM backend, emitting A32 or, with -mthumb, Thumb-2 code for the
+AAPCS calling convention.
+*/
+
+// Registers and stack slots are all a word wide.
+#define PTR_SIZE 4
+
+/*
+State of the function being generated. Functions can be generated on
+several threads at once, so each thread has its own, reset for every
+function.
+*/
+typedef struct FnContext FnContext;
+struct FnContext {
+    Obj *fn;
+    int depth;
+    // Temporaries live in fixed slots above the outgoing argument area
+    int temp_base;
+    int max_depth;
+    // Label at the end of the inlined call being generated, or -1
+    int inline_end;
+    // Whether a callee may be handed a pointer into the current frame
+    bool frame_escapes;
+    // Loads from the literal pool waiting for the next .ltorg, and where
+    // in the output the first of them was emitted
+    int pool_loads;
+    int pool_start;
+    int labels;
+};
+
+static _Thread_local FnContext ctx;
+
+static void gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+// Labels are numbered per function, as they are prefixed by its name.
+static int count(void) {
+    return ++ctx.labels;
+}
+
+// Called before emitting a load from the literal pool.
+static void use_pool(void) {
+    if (!ctx.pool_loads) {
+        ctx.pool_start = cc->out->len;
+    }
+    ctx.pool_loads++;
+}
+
+// Save a temporary in the next free slot.
+static void push(int r) {
+    assert(ctx.depth < ctx.max_depth);
+    emit("  str   r%d, [sp, #%d]\n", r, ctx.temp_base + ctx.depth * PTR_SIZE);
+    ctx.depth++;
+}
+
+// Take the last saved temporary back.
+static void pop(char *arg) {
+    ctx.depth--;
+    emit("  ldr   %s, [sp, #%d]\n", arg, ctx.temp_base + ctx.depth * PTR_SIZE);
+}
+
+static void load(Type *type, int r) {
+    if (type->kind == TY_ARRAY) {
+        // cannot load an array into a register
+        // references to the array are pointers to the first element
+        return;
+    }
+
+    emit("  ldr   r%d, [r%d]\n", r, r);
+}
+
+static void store(void) {
+    pop("r1");
+    emit("  str   r0, [r1]\n");
+}
+
+/*
+Round up `n` to the nearest multiple of `align`.
+For example, align_to(5, 8) == 8 and align_to(11, 8) == 16.
+*/
+static int align_to(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+static int max(int a, int b) {
+    return a > b ? a : b;
+}
+
+static int min(int a, int b) {
+    return a < b ? a : b;
+}
+
+static int popcount(int mask) {
+    int n = 0;
+    for (; mask; mask &= mask - 1) {
+        n++;
+    }
+    return n;
+}
+
+static unsigned rotl(unsigned val, int n) {
+    return n ? val << n | val >> (32 - n) : val;
+}
+
+/*
+Can `val` be the immediate operand of a data processing instruction?
+In A32 those are 8-bit values rotated right by an even number of bits, like
+255, 0x3fc or 0xff000000. Thumb-2 allows any rotation of a byte with its top
+bit set, or a byte repeated as in 0x00ab00ab, 0xab00ab00 or 0xabababab.
+*/
+static bool is_imm(unsigned val) {
+    if (!cc->opts.thumb) {
+        for (int rot = 0; rot < 32; rot += 2) {
+            if (rotl(val, rot) <= 0xff) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    unsigned b = val & 0xff;
+    if (val <= 0xff || val == b * 0x00010001 || val == b * 0x01010101
+        || val == (val >> 8 & 0xff) * 0x01000100) {
+        return true;
+    }
+    for (int rot = 8; rot < 32; rot++) {
+        unsigned v = rotl(val, rot);
+        if (0x80 <= v && v <= 0xff) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Thumb-2 also has add and sub with a plain 12-bit immediate.
+static bool is_add_imm(unsigned val) {
+    return is_imm(val) || (cc->opts.thumb && val <= 4095);
+}
+
+// Can `reg` be used by the 16-bit Thumb encodings?
+static bool is_low_reg(char *reg) {
+    return reg[0] == 'r' && '0' <= reg[1] && reg[1] <= '7' && reg[2] == '\0';
+}
+
+/*
+Flag-setting form of an instruction in Thumb code, where most of the 16-bit
+encodings set the flags. The flags are never live across the instructions
+these are used for.
+*/
+static char *narrow(char *op) {
+    if (!cc->opts.thumb) {
+        return op;
+    }
+    if (!strcmp(op, "mov")) return "movs";
+    if (!strcmp(op, "add")) return "adds";
+    if (!strcmp(op, "sub")) return "subs";
+    if (!strcmp(op, "neg")) return "negs";
+    assert(false);
+    return op;
+}
+
+/*
+Put `val` in a register with the cheapest sequence that can hold it:
+
+  mov   r0, #0x3fc          encodable immediate
+  mvn   r0, #0x3fc          encodable complement, here -1021
+  movw  r0, #4660           16 bits
+  movw  r0, #22136          anything else
+  movt  r0, #4660
+  ldr   r0, =0x12345678     ... or with --no-movt, from the literal pool
+                            emitted after the function, or earlier by
+                            flush_pool()
+*/
+static void gen_imm(char *reg, int val) {
+    unsigned v = val;
+    if (v <= 0xff && is_low_reg(reg)) {
+        emit("  %-5s %s, #%u\n", narrow("mov"), reg, v);
+    } else if (is_imm(v)) {
+        emit("  mov   %s, #%u\n", reg, v);
+    } else if (is_imm(~v)) {
+        emit("  mvn   %s, #%u\n", reg, ~v);
+    } else if (cc->opts.movt && v <= 0xffff) {
+        emit("  movw  %s, #%u\n", reg, v);
+    } else if (cc->opts.movt) {
+        emit("  movw  %s, #%u\n", reg, v & 0xffff);
+        emit("  movt  %s, #%u\n", reg, v >> 16);
+    } else {
+        use_pool();
+        emit("  ldr   %s, =%d\n", reg, val);
+    }
+}
+
+// dst = src + val, going through ip if val has no immediate form.
+static void gen_add_imm(char *dst, char *src, int val) {
+    unsigned v = val;
+    unsigned neg = -v;
+    if (is_add_imm(v) && (v <= neg || !is_add_imm(neg))) {
+        emit("  add   %s, %s, #%u\n", dst, src, v);
+    } else if (is_add_imm(neg)) {
+        emit("  sub   %s, %s, #%u\n", dst, src, neg);
+    } else if (val < 0) {
+        gen_imm("ip", neg);
+        emit("  sub   %s, %s, ip\n", dst, src);
+    } else {
+        gen_imm("ip", val);
+        emit("  add   %s, %s, ip\n", dst, src);
+    }
+}
+
+// Locals may be kept in the callee-saved registers r4-r10.
+#define FIRST_VAR_REG 4
+#define NUM_VAR_REGS 7
+#define REG_FP 11
+#define REG_IP 12
+#define REG_LR 14
+#define REG_PC 15
+
+static char *reg_names[] = {
+    "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+    "r8", "r9", "r10", "fp", "ip", "sp", "lr", "pc",
+};
+
+// Print a register list like `{r4, fp, lr}`.
+static void print_regs(int mask) {
+    emit("{");
+    bool first = true;
+    for (int r = 0; r < 16; r++) {
+        if (mask & (1 << r)) {
+            emit(first ? "%s" : ", %s", reg_names[r]);
+            first = false;
+        }
+    }
+    emit("}");
+}
+
+// Restore the registers saved by the prologue, except for lr if `ret` is
+// set, which goes straight into pc instead.
+static void gen_epilogue(Obj *fn, bool ret) {
+    int saved = fn->saved_regs;
+    if ((saved & (1 << REG_FP)) && !cc->opts.thumb) {
+        emit("  sub   sp, fp, #%d\n", PTR_SIZE * (popcount(saved) - 1));
+    } else if (fn->stack_size) {
+        // Thumb-2 cannot subtract from fp into sp, but sp is fixed in the body anyway
+        gen_add_imm("sp", "sp", fn->stack_size);
+    }
+
+    if (ret && (saved & (1 << REG_LR))) {
+        emit("  pop   ");
+        print_regs((saved & ~(1 << REG_LR)) | (1 << REG_PC));
+        emit("\n");
+        return;
+    }
+
+    if (saved) {
+        emit("  pop   ");
+        print_regs(saved);
+        emit("\n");
+    }
+    if (ret) {
+        emit("  bx    lr\n");
+    }
+}
+
+// Put the address of a global in a register, straight from the instruction
+// stream rather than through a literal word.
+static void gen_global_addr(char *reg, Obj *var) {
+    if (cc->opts.movt) {
+        emit("  movw  %s, #:lower16:__global_%s\n", reg, var->name);
+        emit("  movt  %s, #:upper16:__global_%s\n", reg, var->name);
+    } else {
+        use_pool();
+        emit("  ldr   %s, =__global_%s\n", reg, var->name);
+    }
+}
+
+/*
+Register and displacement a frame variable is addressed with. Locals are
+below fp and parameters passed on the stack above it. Thumb-2 only encodes
+small negative offsets, and its 16-bit loads and stores take offsets from
+sp, so Thumb code goes from sp instead, which is fixed in the body.
+*/
+static char *frame_base(Obj *var, int *disp) {
+    if (cc->opts.thumb) {
+        int saved = ctx.fn->saved_regs;
+        *disp = ctx.fn->stack_size + PTR_SIZE * (popcount(saved) - 1) - var->offset;
+        return "sp";
+    }
+    *disp = -var->offset;
+    return "fp";
+}
+
+// Compute absolute address of a node.
+// It's an error if a given node does not reside in memory.
+static void gen_addr(Node *node) {
+    switch (node->kind) {
+    case ND_VAR:
+        assert(!node->var->reg);
+        if (node->var->is_local) {
+            int disp;
+            char *base = frame_base(node->var, &disp);
+            gen_add_imm("r0", base, disp);
+        } else {
+            gen_global_addr("r0", node->var);
+        }
+        return;
+    case ND_DEREF:
+        gen_expr(node->lhs);
+        return;
+    default:
+        break;
+    }
+
+    error_tok(node->repr, "not an lvalue");
+}
+
+// Load a scalar variable into register `r`, using only that register.
+static void load_var(int r, Obj *var) {
+    char *dst = reg_names[r];
+    if (var->reg) {
+        emit("  mov   %s, %s\n", dst, reg_names[var->reg]);
+    } else if (var->is_local) {
+        int disp;
+        char *base = frame_base(var, &disp);
+        if (-4095 <= disp && disp <= 4095) {
+            emit("  ldr   %s, [%s, #%d]\n", dst, base, disp);
+        } else {
+            gen_add_imm(dst, base, disp);
+            emit("  ldr   %s, [%s]\n", dst, dst);
+        }
+    } else {
+        gen_global_addr(dst, var);
+        emit("  ldr   %s, [%s]\n", dst, dst);
+    }
+}
+
+// Can `node` be loaded straight into its argument register?
+static bool is_simple_arg(Node *node) {
+    return node->kind == ND_NUM || (node->kind == ND_VAR && node->var->type->kind != TY_ARRAY);
+}
+
+static void gen_simple_arg(int r, Node *node) {
+    if (node->kind == ND_NUM) {
+        gen_imm(reg_names[r], node->val);
+    } else {
+        load_var(r, node->var);
+    }
+}
+
+/*
+Put call arguments where AAPCS wants them: the first four in r0-r3, the rest
+in the outgoing argument area at sp.
+
+Arguments which need computing are evaluated first, in order, and all but
+the last are kept in temporaries meanwhile. The last one moves straight from
+r0 to its register, the others are popped into theirs. Literals and
+variables have no side effects and clobber nothing else, so they are loaded
+directly into their registers at the end.
+*/
+static void gen_args(Node *args) {
+    int last = -1;
+    int i = 0;
+    for (Node *arg = args; arg; arg = arg->next, i++) {
+        if (!is_simple_arg(arg)) {
+            last = i;
+        }
+    }
+
+    i = 0;
+    for (Node *arg = args; arg; arg = arg->next, i++) {
+        if (is_simple_arg(arg)) {
+            continue;
+        }
+        gen_expr(arg);
+        if (i != last) {
+            push(0);
+        }
+    }
+
+    for (i = last; i >= 0; i--) {
+        Node *arg = args;
+        for (int j = 0; j < i; j++) {
+            arg = arg->next;
+        }
+        if (is_simple_arg(arg)) {
+            continue;
+        }
+
+        if (i != last) {
+            pop(reg_names[i < 4 ? i : REG_IP]);
+        }
+        if (i >= 4) {
+            emit("  str   %s, [sp, #%d]\n", i == last ? "r0" : "ip", PTR_SIZE * (i - 4));
+        } else if (i == last && i != 0) {
+            emit("  mov   r%d, r0\n", i);
+        }
+    }
+
+    i = 0;
+    for (Node *arg = args; arg; arg = arg->next, i++) {
+        if (!is_simple_arg(arg)) {
+            continue;
+        }
+        if (i < 4) {
+            gen_simple_arg(i, arg);
+        } else {
+            gen_simple_arg(REG_IP, arg);
+            emit("  str   ip, [sp, #%d]\n", PTR_SIZE * (i - 4));
+        }
+    }
+}
+
+static int count_args(Node *args) {
+    int n = 0;
+    for (Node *arg = args; arg; arg = arg->next) {
+        n++;
+    }
+    return n;
+}
+
+// Bytes of stack taken by arguments past the fourth.
+static int stack_args_size(Node *args) {
+    int n = count_args(args) - 4;
+    return n > 0 ? align_to(PTR_SIZE * n, 8) : 0;
+}
+
+
+/*
+Jump to the callee of `return f(...)` instead of calling it, so that it
+returns straight to our caller. A call to the function itself restarts it
+with the new arguments, which turns tail recursion into a loop.
+
+Not done if the callee might be given a pointer into the frame, which is
+gone (or reused) by the time it runs. Thumb code only jumps to functions
+defined here: a plain branch cannot switch to A32 code elsewhere, which `bl`
+does through the linker.
+*/
+static bool tail_calls_self(Node *node) {
+    if (node == NULL) {
+        return false;
+    }
+
+    if (node->kind == ND_RETURN && node->lhs->kind == ND_FN_CALL) {
+        return !strcmp(node->lhs->func, ctx.fn->name);
+    }
+
+    for (Node *b = node->body; b; b = b->next) {
+        if (tail_calls_self(b)) {
+            return true;
+        }
+    }
+    return tail_calls_self(node->consequence)
+        || tail_calls_self(node->alternative)
+        || tail_calls_self(node->initialize);
+}
+
+static bool is_defined(char *name) {
+    for (Obj *obj = cc->prog; obj; obj = obj->next) {
+        if (obj->is_function && !strcmp(obj->name, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool gen_tail_call(Node *node) {
+    if (node->kind != ND_FN_CALL || ctx.inline_end >= 0 || ctx.frame_escapes || count_args(node->args) > 4) {
+        return false;
+    }
+    if (cc->opts.thumb && !is_defined(node->func)) {
+        return false;
+    }
+
+    gen_args(node->args);
+    if (!strcmp(node->func, ctx.fn->name)) {
+        emit("  b     %s.tail\n", ctx.fn->name);
+        return true;
+    }
+
+    gen_epilogue(ctx.fn, false);
+    emit("  b     %s\n", node->func);
+    return true;
+}
+
+// Set r0 to whether the flags from `cmp lhs, rhs` satisfy the comparison,
+// or from `cmp rhs, lhs` if `swapped` is set.
+static void gen_set_cond(NodeKind kind, bool swapped) {
+    char *cond;
+    char *inverse;
+    switch (kind) {
+    case ND_EQ:
+        cond = "eq";
+        inverse = "ne";
+        break;
+    case ND_NEQ:
+        cond = "ne";
+        inverse = "eq";
+        break;
+    case ND_LT:
+        cond = swapped ? "gt" : "lt";
+        inverse = swapped ? "le" : "ge";
+        break;
+    case ND_LTE:
+        cond = swapped ? "ge" : "le";
+        inverse = swapped ? "lt" : "gt";
+        break;
+    default:
+        assert(false);
+        return;
+    }
+    if (cc->opts.thumb) {
+        emit("  ite   %s\n", cond);
+    }
+    emit("  mov%s r0, #1\n", cond);
+    emit("  mov%s r0, #0\n", inverse);
+}
+
+// Apply a binary operator to r0 (lhs) and r1 (rhs).
+static void gen_binary(Node *node) {
+    switch (node->kind) {
+    case ND_ADD:
+        emit("  %-5s r0, r0, r1\n", narrow("add"));
+        return;
+    case ND_SUB:
+        emit("  %-5s r0, r0, r1\n", narrow("sub"));
+        return;
+    case ND_MUL:
+        emit(cc->opts.thumb ? "  muls  r0, r1, r0\n" : "  mul   r0, r0, r1\n");
+        return;
+    case ND_DIV:
+        emit("  bl    __div\n");
+        return;
+    case ND_EQ:
+    case ND_NEQ:
+    case ND_LT:
+    case ND_LTE:
+        emit("  cmp   r0, r1\n");
+        gen_set_cond(node->kind, false);
+        return;
+    default:
+        break;
+    }
+
+    error_tok(node->repr, "invalid expression");
+}
+
+/*
+A binary operator with a literal operand needs no temporary. Small
+constants become the immediate of the instruction itself,
+
+  x + 4     ->  add   r0, r0, #4
+  x - -4    ->  add   r0, r0, #4
+  4 - x     ->  rsb   r0, r0, #4
+  300 < x   ->  cmp   r0, #300, then movgt
+  x == -1   ->  cmn   r0, #1
+
+and other ones are materialized straight into their register.
+*/
+static void gen_const_binary(Node *node) {
+    bool swapped = node->rhs->kind != ND_NUM;
+    Node *expr = swapped ? node->rhs : node->lhs;
+    unsigned val = swapped ? node->lhs->val : node->rhs->val;
+    unsigned neg = -val;
+    // prefer the smaller immediate, add #4 over sub #0xfffffffc
+    bool pos = is_imm(val) && (val <= neg || !is_imm(neg));
+
+    gen_expr(expr);
+
+    switch (node->kind) {
+    case ND_ADD:
+        if (pos || is_imm(neg)) {
+            emit("  %-5s r0, r0, #%u\n", narrow(pos ? "add" : "sub"), pos ? val : neg);
+            return;
+        }
+        break;
+    case ND_SUB:
+        if (swapped && is_imm(val)) {
+            emit("  rsb   r0, r0, #%u\n", val);
+            return;
+        }
+        if (!swapped && (pos || is_imm(neg))) {
+            emit("  %-5s r0, r0, #%u\n", narrow(pos ? "sub" : "add"), pos ? val : neg);
+            return;
+        }
+        break;
+    case ND_EQ:
+    case ND_NEQ:
+    case ND_LT:
+    case ND_LTE:
+        if (pos || is_imm(neg)) {
+            emit("  %s   r0, #%u\n", pos ? "cmp" : "cmn", pos ? val : neg);
+            gen_set_cond(node->kind, swapped);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    bool commutes = node->kind == ND_ADD || node->kind == ND_MUL
+        || node->kind == ND_EQ || node->kind == ND_NEQ;
+    if (swapped && !commutes) {
+        emit("  mov   r1, r0\n");
+        gen_imm("r0", val);
+    } else {
+        gen_imm("r1", val);
+    }
+    gen_binary(node);
+}
+
+static void gen_expr(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        gen_imm("r0", node->val);
+        return;
+    case ND_NEG:
+        assert(node->lhs);
+        gen_expr(node->lhs);
+        emit("  %-5s r0, r0\n", narrow("neg"));
+        return;
+    case ND_VAR:
+        assert(node->type);
+        if (node->type->kind != TY_ARRAY && node->var->is_local) {
+            load_var(0, node->var);
+            return;
+        }
+        gen_addr(node);
+        load(node->type, 0);
+        return;
+    case ND_ADDR:
+        assert(node->lhs);
+        gen_addr(node->lhs);
+        return;
+    case ND_DEREF:
+        assert(node->lhs);
+        gen_expr(node->lhs);
+        assert(node->type);
+        load(node->type, 0);
+        return;
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_VAR && node->lhs->var->reg) {
+            gen_expr(node->rhs);
+            emit("  mov   r%d, r0\n", node->lhs->var->reg);
+            return;
+        }
+        gen_addr(node->lhs);
+        push(0);
+        gen_expr(node->rhs);
+        store();
+        return;
+    case ND_FN_CALL:
+        gen_args(node->args);
+        emit("  bl    %s\n", node->func);
+        return;
+    case ND_INLINE: {
+        // The returns inside leave their value in r0, like a call would.
+        int outer = ctx.inline_end;
+        ctx.inline_end = count();
+        for (Node *n = node->body; n; n = n->next) {
+            gen_stmt(n);
+        }
+        emit("%s.inline.end.%d:\n", ctx.fn->name, ctx.inline_end);
+        ctx.inline_end = outer;
+        return;
+    }
+    default:
+        break;
+    }
+
+    if (node->lhs->kind == ND_NUM || node->rhs->kind == ND_NUM) {
+        gen_const_binary(node);
+        return;
+    }
+
+    gen_expr(node->rhs);
+    push(0);
+    gen_expr(node->lhs);
+    pop("r1");
+    gen_binary(node);
+}
+
+
+/*
+NEON registers used by vectorized loops.
+Temporaries avoid q4-q7, which are callee-saved, and reductions
+accumulate in the registers above them.
+*/
+static int vec_temps[] = {0, 1, 2, 3, 8, 9, 10, 11};
+#define VEC_ACC 12
+
+// Evaluate `node` for four consecutive iterations into a q register.
+static void gen_vec_expr(Node *node, int level) {
+    int q = vec_temps[level];
+
+    if (!contains(node, ND_DEREF)) {
+        // loop-invariant, so every lane gets the same value
+        gen_expr(node);
+        emit("  vdup.32 q%d, r0\n", q);
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_DEREF:
+        // address of the element for the first of the four iterations
+        gen_expr(node->lhs);
+        emit("  vld1.32 {d%d-d%d}, [r0]\n", 2 * q, 2 * q + 1);
+        return;
+    case ND_NEG:
+        gen_vec_expr(node->lhs, level);
+        emit("  vneg.s32 q%d, q%d\n", q, q);
+        return;
+    default:
+        break;
+    }
+
+    gen_vec_expr(node->lhs, level);
+    gen_vec_expr(node->rhs, level + 1);
+    int r = vec_temps[level + 1];
+
+    switch (node->kind) {
+    case ND_ADD:
+        emit("  vadd.i32 q%d, q%d, q%d\n", q, q, r);
+        return;
+    case ND_SUB:
+        emit("  vsub.i32 q%d, q%d, q%d\n", q, q, r);
+        return;
+    case ND_MUL:
+        emit("  vmul.i32 q%d, q%d, q%d\n", q, q, r);
+        return;
+    default:
+        break;
+    }
+
+    error_tok(node->repr, "invalid vector expression");
+}
+
+static Node *vec_stmts(Node *node) {
+    return node->kind == ND_BLOCK ? node->body : node;
+}
+
+static void gen_vec_loop(Node *node) {
+    int c = count();
+
+    int acc = 0;
+    for (Node *n = vec_stmts(node->consequence); n; n = n->next) {
+        if (reduction_operand(n->lhs)) {
+            emit("  vmov.i32 q%d, #0\n", VEC_ACC + acc++);
+        }
+    }
+
+    emit("%s.vec.begin.%d:\n", ctx.fn->name, c);
+    gen_expr(node->condition);
+    emit("  cmp   r0, #0\n");
+    emit("  beq   %s.vec.end.%d\n", ctx.fn->name, c);
+
+    acc = 0;
+    for (Node *n = vec_stmts(node->consequence); n; n = n->next) {
+        Node *assign = n->lhs;
+        Node *operand = reduction_operand(assign);
+        if (operand) {
+            int q = VEC_ACC + acc++;
+            gen_vec_expr(operand, 0);
+            emit("  %s q%d, q%d, q%d\n",
+                assign->rhs->kind == ND_SUB ? "vsub.i32" : "vadd.i32",
+                q, q, vec_temps[0]);
+        } else {
+            gen_vec_expr(assign->rhs, 0);
+            gen_expr(assign->lhs->lhs);
+            emit("  vst1.32 {d%d-d%d}, [r0]\n", 2 * vec_temps[0], 2 * vec_temps[0] + 1);
+        }
+    }
+
+    gen_expr(node->increment);
+    emit("  b     %s.vec.begin.%d\n", ctx.fn->name, c);
+    emit("%s.vec.end.%d:\n", ctx.fn->name, c);
+
+    // Sum the lanes of each accumulator into its variable.
+    acc = 0;
+    for (Node *n = vec_stmts(node->consequence); n; n = n->next) {
+        if (!reduction_operand(n->lhs)) {
+            continue;
+        }
+        int d = 2 * (VEC_ACC + acc++);
+        emit("  vadd.i32 d%d, d%d, d%d\n", d, d, d + 1);
+        emit("  vpadd.i32 d%d, d%d, d%d\n", d, d, d);
+        emit("  vmov.32 r1, d%d[0]\n", d);
+        Obj *var = n->lhs->lhs->var;
+        if (var->reg) {
+            emit("  add   r%d, r%d, r1\n", var->reg, var->reg);
+            continue;
+        }
+        gen_addr(n->lhs->lhs);
+        emit("  ldr   r2, [r0]\n");
+        emit("  add   r2, r2, r1\n");
+        emit("  str   r2, [r0]\n");
+    }
+}
+
+// Parameters past the fourth are passed on the stack and stay there.
+static bool is_stack_param(Obj *fn, Obj *var) {
+    int i = 0;
+    for (Obj *param = fn->params; param; param = param->next, i++) {
+        if (param == var) {
+            return i >= 4;
+        }
+    }
+    return false;
+}
+
+// Largest outgoing argument area needed by a call in the subtree.
+static int max_stack_args(Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int size = node->kind == ND_FN_CALL ? stack_args_size(node->args) : 0;
+    Node *kids[] = {
+        node->lhs, node->rhs, node->condition, node->consequence,
+        node->alternative, node->initialize, node->increment,
+    };
+    for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+        size = max(size, max_stack_args(kids[i]));
+    }
+    for (Node *b = node->body; b; b = b->next) {
+        size = max(size, max_stack_args(b));
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        size = max(size, max_stack_args(a));
+    }
+    return size;
+}
+
+static int temp_depth(Node *node);
+static int stmt_temp_depth(Node *node);
+
+static bool is_stmt(Node *node) {
+    switch (node->kind) {
+    case ND_IF:
+    case ND_LOOP:
+    case ND_VEC_LOOP:
+    case ND_BLOCK:
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Bound for code which evaluates pieces of the subtree on their own, like
+// vector loops do with their loop-invariant operands.
+static int any_temp_depth(Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int n = is_stmt(node) ? 0 : temp_depth(node);
+    Node *kids[] = {
+        node->lhs, node->rhs, node->condition, node->consequence,
+        node->alternative, node->initialize, node->increment,
+    };
+    for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+        n = max(n, any_temp_depth(kids[i]));
+    }
+    for (Node *b = node->body; b; b = b->next) {
+        n = max(n, any_temp_depth(b));
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        n = max(n, any_temp_depth(a));
+    }
+    return n;
+}
+
+static int addr_temp_depth(Node *node) {
+    return node->kind == ND_DEREF ? temp_depth(node->lhs) : 0;
+}
+
+// Most temporaries alive at once while `node` is evaluated, as gen_expr
+// and gen_args push them.
+static int temp_depth(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+        return 0;
+    case ND_NEG:
+    case ND_DEREF:
+        return temp_depth(node->lhs);
+    case ND_ADDR:
+        return addr_temp_depth(node->lhs);
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_VAR && node->lhs->var->reg) {
+            return temp_depth(node->rhs);
+        }
+        return max(addr_temp_depth(node->lhs), 1 + temp_depth(node->rhs));
+    case ND_FN_CALL: {
+        int n = 0;
+        int pushed = 0;
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            if (!is_simple_arg(arg)) {
+                n = max(n, pushed++ + temp_depth(arg));
+            }
+        }
+        return n;
+    }
+    case ND_INLINE: {
+        int n = 0;
+        for (Node *b = node->body; b; b = b->next) {
+            n = max(n, stmt_temp_depth(b));
+        }
+        return n;
+    }
+    default:
+        if (node->rhs->kind == ND_NUM) {
+            return temp_depth(node->lhs);
+        }
+        if (node->lhs->kind == ND_NUM) {
+            return temp_depth(node->rhs);
+        }
+        return max(temp_depth(node->rhs), 1 + temp_depth(node->lhs));
+    }
+}
+
+// Most temporaries needed by any expression in a statement.
+static int stmt_temp_depth(Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        return temp_depth(node->lhs);
+    case ND_IF:
+    case ND_LOOP:
+    case ND_BLOCK: {
+        int n = max(stmt_temp_depth(node->consequence), stmt_temp_depth(node->alternative));
+        n = max(n, stmt_temp_depth(node->initialize));
+        if (node->condition) {
+            n = max(n, temp_depth(node->condition));
+        }
+        if (node->increment) {
+            n = max(n, temp_depth(node->increment));
+        }
+        for (Node *b = node->body; b; b = b->next) {
+            n = max(n, stmt_temp_depth(b));
+        }
+        return n;
+    }
+    default:
+        return any_temp_depth(node);
+    }
+}
+
+/*
+Keep the most used scalar locals in r4-r10.
+
+A function which takes the address of a scalar local keeps all of them in
+the frame, as pointer arithmetic may walk from one slot to the next.
+*/
+static void assign_regs(Obj *fn) {
+    for (Obj *var = fn->locals; var; var = var->next) {
+        var->reg = 0;
+        if (var->type->kind != TY_ARRAY && addr_taken(fn->body, var)) {
+            return;
+        }
+    }
+
+    for (int reg = FIRST_VAR_REG; reg < FIRST_VAR_REG + NUM_VAR_REGS; reg++) {
+        Obj *best = NULL;
+        int best_uses = 0;
+        for (Obj *var = fn->locals; var; var = var->next) {
+            if (var->reg || var->type->kind == TY_ARRAY || is_stack_param(fn, var)) {
+                continue;
+            }
+            int uses = count_uses(fn->body, var);
+            if (uses > best_uses) {
+                best = var;
+                best_uses = uses;
+            }
+        }
+        if (!best) {
+            return;
+        }
+        best->reg = reg;
+    }
+}
+
+/*
+Frame layout.
+
+Locals left in the frame are packed by lifetime: two of them may share
+bytes if no statement needs both. Statements are numbered in program order,
+and a local lives from the first statement mentioning it to the last, or
+through the whole of any loop mentioning it. An array whose address is used
+for anything but indexing it right away may be reached through a pointer at
+any time, so it lives throughout.
+
+Scalars are placed first, most used first, so they stay close to fp, and
+arrays go below them.
+*/
+
+typedef struct Slot Slot;
+struct Slot {
+    Obj *var;
+    int first;  // First statement using the variable
+    int last;   // Last statement using the variable
+    int start;  // Bytes below the saved registers
+    int uses;
+};
+
+typedef struct Lifetimes Lifetimes;
+struct Lifetimes {
+    Slot *slots;
+    int nslots;
+    int pos; // Current statement
+};
+
+static void mention(Obj *var, bool escapes, Lifetimes *lt) {
+    for (int i = 0; i < lt->nslots; i++) {
+        Slot *s = &lt->slots[i];
+        if (s->var != var) {
+            continue;
+        }
+        if (escapes) {
+            s->first = 0;
+            s->last = INT_MAX;
+        }
+        s->first = s->first < 0 ? lt->pos : min(s->first, lt->pos);
+        s->last = max(s->last, lt->pos);
+    }
+}
+
+static void scan_stmt(Node *node, Lifetimes *lt);
+
+// `access` is set if the address computed by `node` is only dereferenced.
+static void scan_expr(Node *node, bool access, Lifetimes *lt) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_VAR:
+        mention(node->var, node->var->type->kind == TY_ARRAY && !access, lt);
+        return;
+    case ND_DEREF:
+        scan_expr(node->lhs, node->type->kind != TY_ARRAY || access, lt);
+        return;
+    case ND_ADD:
+    case ND_SUB:
+        scan_expr(node->lhs, access && node->lhs->type->base, lt);
+        scan_expr(node->rhs, false, lt);
+        return;
+    case ND_ADDR:
+        if (node->lhs->kind == ND_DEREF) {
+            scan_expr(node->lhs->lhs, false, lt);
+        } else {
+            mention(node->lhs->var, true, lt);
+        }
+        return;
+    default:
+        break;
+    }
+
+    // Anything else, including inlined bodies, counts as one statement.
+    scan_expr(node->lhs, false, lt);
+    scan_expr(node->rhs, false, lt);
+    scan_expr(node->condition, false, lt);
+    scan_expr(node->consequence, false, lt);
+    scan_expr(node->alternative, false, lt);
+    scan_expr(node->initialize, false, lt);
+    scan_expr(node->increment, false, lt);
+    for (Node *b = node->body; b; b = b->next) {
+        scan_expr(b, false, lt);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        scan_expr(a, false, lt);
+    }
+}
+
+static void scan_loop(Node *node, Lifetimes *lt) {
+    if (node->initialize) {
+        scan_stmt(node->initialize, lt);
+    }
+
+    int begin = ++lt->pos;
+    scan_expr(node->condition, false, lt);
+    scan_stmt(node->consequence, lt);
+    lt->pos++;
+    scan_expr(node->increment, false, lt);
+    int end = lt->pos;
+
+    // A value may be carried around to the next iteration.
+    for (int i = 0; i < lt->nslots; i++) {
+        Slot *s = &lt->slots[i];
+        if (s->first >= 0 && s->first <= end && begin <= s->last) {
+            s->first = min(s->first, begin);
+            s->last = max(s->last, end);
+        }
+    }
+}
+
+static void scan_stmt(Node *node, Lifetimes *lt) {
+    switch (node->kind) {
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            scan_stmt(n, lt);
+        }
+        return;
+    case ND_IF:
+        lt->pos++;
+        scan_expr(node->condition, false, lt);
+        scan_stmt(node->consequence, lt);
+        if (node->alternative) {
+            scan_stmt(node->alternative, lt);
+        }
+        return;
+    case ND_LOOP:
+    case ND_VEC_LOOP:
+        scan_loop(node, lt);
+        return;
+    default:
+        lt->pos++;
+        scan_expr(node->lhs, false, lt);
+        return;
+    }
+}
+
+static int compare_slots(const void *a, const void *b) {
+    const Slot *x = a;
+    const Slot *y = b;
+    bool x_array = x->var->type->kind == TY_ARRAY;
+    bool y_array = y->var->type->kind == TY_ARRAY;
+    if (x_array != y_array) {
+        return x_array - y_array;
+    }
+    if (x_array) {
+        return x->var->type->size - y->var->type->size;
+    }
+    return y->uses - x->uses;
+}
+
+// Bytes used by the locals of `fn` which live in the frame, after giving
+// each an offset at least `base` below fp.
+static int pack_locals(Obj *fn, int base) {
+    Lifetimes lt = {};
+    for (Obj *var = fn->locals; var; var = var->next) {
+        lt.nslots++;
+    }
+    lt.slots = calloc(lt.nslots + 1, sizeof(Slot));
+
+    lt.nslots = 0;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        int uses = count_uses(fn->body, var);
+        if (var->reg || !uses || is_stack_param(fn, var)) {
+            continue;
+        }
+        Slot *s = &lt.slots[lt.nslots++];
+        s->var = var;
+        s->uses = uses;
+        s->first = -1;
+        s->last = -1;
+    }
+
+    // Parameters are stored by the prologue.
+    for (Obj *param = fn->params; param; param = param->next) {
+        mention(param, false, &lt);
+    }
+    scan_stmt(fn->body, &lt);
+
+    qsort(lt.slots, lt.nslots, sizeof(Slot), compare_slots);
+
+    int size = 0;
+    for (int i = 0; i < lt.nslots; i++) {
+        Slot *s = &lt.slots[i];
+        int len = s->var->type->size;
+
+        // Lowest start that does not clash with anything placed and live at the same time
+        s->start = 0;
+        for (int j = 0; j < i; j++) {
+            Slot *t = &lt.slots[j];
+            bool live = s->first <= t->last && t->first <= s->last;
+            bool overlap = s->start < t->start + t->var->type->size && t->start < s->start + len;
+            if (live && overlap) {
+                s->start = align_to(t->start + t->var->type->size, type_align(s->var->type));
+                j = -1;
+            }
+        }
+
+        s->var->offset = base + s->start + len;
+        size = max(size, s->start + len);
+    }
+
+    free(lt.slots);
+    return size;
+}
+
+/*
+Lay out the frame of a function.
+
+The prologue pushes the registers the function uses, its frame pointer only
+if some local lives in the frame, and the link register only if it makes
+calls. fp points at the last saved register, with locals below the saved
+ones. Parameters passed on the stack are right above the saved registers.
+
+sp stays put in the body. The outgoing argument area is at the very bottom
+of the frame, right below the slots for temporaries, and both are addressed
+from sp, so a function with all its locals in registers needs no fp. An odd
+number of saved registers is padded with ip to keep sp 8-byte aligned.
+*/
+static void layout_frame(Obj *fn, Options *opts) {
+    assign_regs(fn);
+
+    int saved = 0;
+    int locals_size = 0;
+    bool uses_frame = false;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        if (var->reg) {
+            saved |= 1 << var->reg;
+        } else if (count_uses(fn->body, var)) {
+            if (!is_stack_param(fn, var)) {
+                locals_size += var->type->size;
+            }
+            uses_frame = true;
+        }
+    }
+
+    int unpacked_size = locals_size;
+    if (uses_frame) {
+        saved |= 1 << REG_FP;
+    }
+    if (contains(fn->body, ND_FN_CALL) || contains(fn->body, ND_DIV)) {
+        saved |= 1 << REG_LR;
+    }
+    if (popcount(saved) % 2) {
+        saved |= 1 << REG_IP;
+    }
+    fn->saved_regs = saved;
+
+    int base = PTR_SIZE * (popcount(saved) - 1);
+    for (Obj *var = fn->locals; var; var = var->next) {
+        var->offset = 0;
+    }
+
+    bool escapes = false;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        escapes |= var->type->kind != TY_ARRAY && addr_taken(fn->body, var);
+    }
+
+    if (escapes) {
+        // Keep locals in declaration order, pointer arithmetic may rely on it.
+        int lvar_offset = base;
+        for (Obj *var = fn->locals; var; var = var->next) {
+            if (var->reg || !count_uses(fn->body, var) || is_stack_param(fn, var)) {
+                continue;
+            }
+            lvar_offset += var->type->size;
+            var->offset = lvar_offset;
+        }
+    } else {
+        locals_size = pack_locals(fn, base);
+    }
+
+    int i = 0;
+    for (Obj *param = fn->params; param; param = param->next, i++) {
+        if (i >= 4) {
+            param->offset = -PTR_SIZE * (i - 3);
+        }
+    }
+    int rest = PTR_SIZE * stmt_temp_depth(fn->body) + max_stack_args(fn->body);
+    int unpacked = align_to(unpacked_size + rest, 8);
+    fn->stack_size = align_to(locals_size + rest, 8);
+
+    if (opts->stats) {
+        fprintf(stderr, "%s: frame %d -> %d bytes\n", fn->name, unpacked, fn->stack_size);
+    }
+}
+
+#define MAX_CODE_SIZE (1 << 16)
+
+/*
+Upper bound on the bytes of code generated for `node`, generous enough that
+no instruction sequence it is charged for can be longer. Used to tell
+whether a short branch can reach past it.
+*/
+static int code_size_bound(Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int n = 0;
+    switch (node->kind) {
+    case ND_VEC_LOOP:
+    case ND_INLINE:
+        return MAX_CODE_SIZE;
+    case ND_NUM:
+        return 8;
+    case ND_VAR:
+        return 16;
+    case ND_FN_CALL:
+        for (Node *a = node->args; a; a = a->next) {
+            n = min(n + code_size_bound(a) + 12, MAX_CODE_SIZE);
+        }
+        return n + 4;
+    case ND_BLOCK:
+        for (Node *b = node->body; b; b = b->next) {
+            n = min(n + code_size_bound(b), MAX_CODE_SIZE);
+        }
+        return n;
+    default:
+        // the epilogue of a tail call, or pushing and popping a temporary
+        // and turning flags into a value, or an address and a store
+        n = 28;
+        break;
+    }
+
+    Node *kids[] = {
+        node->lhs, node->rhs, node->condition, node->consequence,
+        node->alternative, node->initialize, node->increment,
+    };
+    for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+        n += code_size_bound(kids[i]);
+    }
+    return min(n, MAX_CODE_SIZE);
+}
+
+// Branch to `label` if r0 is zero. Thumb code has cbz for a forward branch
+// over at most 126 bytes, which needs no compare, unless a literal pool
+// waiting to be placed might land in between.
+static void gen_branch_zero(char *label, int c, Node *skipped, Node *more) {
+    if (cc->opts.thumb && !ctx.pool_loads && code_size_bound(skipped) + code_size_bound(more) + 4 <= 126) {
+        emit("  cbz   r0, %s.%s.%d\n", ctx.fn->name, label, c);
+        return;
+    }
+    emit("  cmp   r0, #0\n");
+    emit("  beq   %s.%s.%d\n", ctx.fn->name, label, c);
+}
+
+// Bytes of code emitted since `start` in the output, at most four for each
+// instruction line.
+static int code_since(int start) {
+    int n = 0;
+    for (char *p = cc->out->data + start; p < cc->out->data + cc->out->len; p++) {
+        if ((p == cc->out->data || p[-1] == '\n') && p[0] == ' ' && p[1] == ' ') {
+            n += 4;
+        }
+    }
+    return n;
+}
+
+/*
+Place the pending literal pool here, behind a branch, if it might be out of
+reach of its first load by the end of `next`. A32 loads reach 4095 bytes
+ahead, and 16-bit Thumb ones only 1020. Both the code of `next` and the
+words it adds to the pool count against that, as do the words already
+waiting.
+*/
+static void flush_pool(Node *next) {
+    if (!ctx.pool_loads) {
+        return;
+    }
+    int range = cc->opts.thumb ? 1020 : 4095;
+    int ahead = code_size_bound(next);
+    if (code_since(ctx.pool_start) + 2 * ahead + PTR_SIZE * ctx.pool_loads + 16 <= range) {
+        return;
+    }
+
+    int c = count();
+    emit("  b     %s.pool.%d\n", ctx.fn->name, c);
+    emit(".ltorg\n");
+    emit("%s.pool.%d:\n", ctx.fn->name, c);
+    ctx.pool_loads = 0;
+}
+
+static void gen_stmt(Node *node) {
+    flush_pool(node);
+
+    switch (node->kind) {
+    case ND_IF: {
+        int c = count();
+        gen_expr(node->condition);
+        gen_branch_zero("if.else", c, node->consequence, NULL);
+        gen_stmt(node->consequence);
+        emit("  b     %s.if.end.%d\n", ctx.fn->name, c);
+        emit("%s.if.else.%d:\n", ctx.fn->name, c);
+        if (node->alternative) {
+            gen_stmt(node->alternative);
+        }
+        emit("%s.if.end.%d:\n", ctx.fn->name, c);
+        return;
+    }
+    case ND_LOOP: {
+        int c = count();
+        if (node->initialize) {
+            gen_stmt(node->initialize);
+        }
+        emit("%s.loop.begin.%d:\n", ctx.fn->name, c);
+        if (node->condition) {
+            gen_expr(node->condition);
+            gen_branch_zero("loop.end", c, node->consequence, node->increment);
+        }
+        gen_stmt(node->consequence);
+        if (node->increment) {
+            gen_expr(node->increment);
+        }
+        emit("  b     %s.loop.begin.%d\n", ctx.fn->name, c);
+        emit("%s.loop.end.%d:\n", ctx.fn->name, c);
+        return;
+    }
+    case ND_VEC_LOOP:
+        gen_vec_loop(node);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            gen_stmt(n);
+        }
+        return;
+    case ND_RETURN:
+        if (gen_tail_call(node->lhs)) {
+            return;
+        }
+        gen_expr(node->lhs);
+        if (ctx.inline_end >= 0) {
+            emit("  b     %s.inline.end.%d\n", ctx.fn->name, ctx.inline_end);
+        } else {
+            emit("  b     %s.return\n", ctx.fn->name);
+        }
+        return;
+    case ND_EXPR_STMT:
+        gen_expr(node->lhs);
+        return;
+    default:
+        break;
+    }
+
+    error_tok(node->repr, "invalid statement");
+}
+
+/*
+Generate a subroutine for integer division.
+
+Inputs:
+  r0 : dividend
+  r1 : divisor
+
+Outputs:
+  r0 : quotient
+  r1 : remainder
+
+@PERF:
+  Check divisor for powers of two and use shifts instead.
+
+References:
+  https://www.virag.si/2010/02/simple-division-algorithm-for-arm-assembler/
+  http://www.tofla.iconbar.com/tofla/arm/arm02/index.htm
+*/
+static void gen_div(void) {
+    if (cc->opts.thumb) {
+        emit(".thumb_func\n");
+    }
+    emit("__div:\n"
+        "  push  {fp, lr}\n"
+        "  add   fp, sp, #4\n");
+    emit(
+        // check for divide by zero
+        // @TODO: jump to some sort of panic routine
+        "  cmp   r1, #0\n"
+        "  beq   __div_end\n"
+        "  push  {r0, r1}\n"
+        // variables
+        "  mov   r0, #0\n"         // quotient
+        "  pop   {r1, r2}\n"       // dividend / remainder, divisor
+        "  mov   r3, #1\n"         // bit field
+        "__div_shift:\n"
+        // shift divisor left until it exceeds dividend
+        // the bit field will be shifted by one less
+        "  cmp   r2, r1\n"
+        "%s"
+        "  lslls r2, r2, #1\n"
+        "  lslls r3, r3, #1\n"
+        "  bls   __div_shift\n"
+        "__div_sub:\n"
+        // cmp sets the carry flag if r1 - r2 is positive, which is weird
+        "  cmp   r1, r2\n"
+        // subtract divisor from the remainder if it was smaller
+        // this also sets the carry flag since the result is positive
+        "%s"
+        "  subcs r1, r1, r2\n"
+        // add bit field to the quotient if the divisor was smaller
+        "  addcs r0, r0, r3\n"
+        // shift bit field right, setting the carry flag if it underflows
+        "  lsrs  r3, r3, #1\n"
+        // shift divisor right if bit field has not underflowed
+        "%s"
+        "  lsrcc r2, r2, #1\n"
+        // loop if bit field has not underflowed
+        "  bcc   __div_sub\n",
+        // Thumb needs the conditional instructions in it blocks
+        cc->opts.thumb ? "  itt   ls\n" : "",
+        cc->opts.thumb ? "  itt   cs\n" : "",
+        cc->opts.thumb ? "  it    cc\n" : "");
+    emit(
+        "__div_end:\n"
+        "%s"
+        "  pop   {fp, pc}\n",
+        // Thumb-2 cannot subtract from fp into sp, and sp is back anyway
+        cc->opts.thumb ? "" : "  sub   sp, fp, #4\n");
+}
+
+static void emit_function(Obj *fn) {
+    ctx = (FnContext){.fn = fn, .inline_end = -1};
+
+    for (Obj *var = fn->locals; var; var = var->next) {
+        ctx.frame_escapes |= addr_taken(fn->body, var);
+    }
+
+    if (cc->opts.thumb) {
+        emit(".thumb_func\n");
+    }
+    emit("%s:\n", fn->name);
+    int saved = fn->saved_regs;
+    if (saved) {
+        emit("  push  ");
+        print_regs(saved);
+        emit("\n");
+    }
+    if (saved & (1 << REG_FP)) {
+        emit("  add   fp, sp, #%d\n", PTR_SIZE * (popcount(saved) - 1));
+    }
+    if (fn->stack_size) {
+        gen_add_imm("sp", "sp", -fn->stack_size);
+    }
+    ctx.temp_base = max_stack_args(fn->body);
+    ctx.max_depth = stmt_temp_depth(fn->body);
+    if (!ctx.frame_escapes && tail_calls_self(fn->body)) {
+        emit("%s.tail:\n", fn->name);
+    }
+
+    // Move passed-by-register arguments to where the parameters live
+    int i = 0;
+    for (Obj *var = fn->params; var && i < 4; var = var->next, i++) {
+        if (var->reg) {
+            emit("  mov   r%d, r%d\n", var->reg, i);
+        } else if (var->offset) {
+            int disp;
+            char *base = frame_base(var, &disp);
+            if (-4095 <= disp && disp <= 4095) {
+                emit("  str   r%d, [%s, #%d]\n", i, base, disp);
+            } else {
+                gen_add_imm("ip", base, disp);
+                emit("  str   r%d, [ip]\n", i);
+            }
+        }
+    }
+
+    gen_stmt(fn->body);
+    assert(ctx.depth == 0);
+
+    emit("%s.return:\n", fn->name);
+    gen_epilogue(fn, true);
+    if (ctx.pool_loads) {
+        emit(".ltorg\n");
+    }
+    emit("\n");
+}
+
+// Like contains() on a function's body, or on the one its kept code came from
+static bool fn_contains(Obj *fn, NodeKind kind) {
+    if (fn->fragment) {
+        return fn->fragment->kinds & (1 << kind);
+    }
+    return contains(fn->body, kind);
+}
+
+static void emit_header(Obj *prog, Options *opts) {
+    emit(".text\n.balign 4\n");
+    if (opts->thumb) {
+        emit(".syntax unified\n.thumb\n");
+    }
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function && fn_contains(obj, ND_VEC_LOOP)) {
+            emit(".fpu neon\n");
+            break;
+        }
+    }
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function && !obj->is_static) {
+            emit(".global %s\n", obj->name);
+        }
+    }
+    emit("\n");
+}
+
+static void emit_runtime(Obj *prog) {
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function && fn_contains(obj, ND_DIV)) {
+            gen_div();
+            return;
+        }
+    }
+}
+
+static char *data_directive(int size) {
+    assert(size == 4);
+    return ".word";
+}
+
+Target target_arm = {
+    .name = "arm",
+    .ptr_size = PTR_SIZE,
+    .vectors = true,
+    .layout_frame = layout_frame,
+    .data_directive = data_directive,
+    .emit_header = emit_header,
+    .emit_function = emit_function,
+    .emit_runtime = emit_runtime,
+};
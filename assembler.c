@@ -0,0 +1,1151 @@
+#include "charmcc.h"
+#include <elf.h>
+#include <stdint.h>
+
+/*
+Integrated assembler for the A32 code the ARM backend emits, writing an
+ELF32 relocatable object instead of going through an external `as`.
+
+Lines are encoded into their section as they are read. Branches and loads
+which refer to labels are recorded as fixups and patched at the end, and
+references which stay symbolic become REL relocations with the addend in
+the instruction, the way GNU as leaves them: branches to local labels,
+static functions included, are resolved, while calls and jumps to global
+or undefined functions keep R_ARM_CALL and R_ARM_JUMP24 relocations, and
+literal pool words against a local label go through its section.
+
+Only the instructions and directives the backend uses are understood.
+*/
+
+#define SYMBOL_BUCKETS 4096
+
+enum { SEC_TEXT, SEC_DATA, SEC_BSS, NUM_SECTIONS };
+
+typedef struct Symbol Symbol;
+struct Symbol {
+    Symbol *next;   // In the same hash bucket
+    char *name;
+    int section;    // SEC_*, or -1 while undefined
+    int value;
+    bool global;
+    int index;      // In .symtab
+};
+
+typedef struct Reloc Reloc;
+struct Reloc {
+    int offset;
+    int type;       // R_ARM_*
+    Symbol *sym;    // NULL for the section symbol of `section`
+    int section;
+};
+
+typedef struct Section Section;
+struct Section {
+    char *name;
+    uint8_t *data;  // NULL for .bss, which only has a size
+    int size;
+    int cap;
+    Reloc *relocs;
+    int nrelocs;
+    int reloc_cap;
+};
+
+typedef enum {
+    FIX_BRANCH, // b and b<cond>: imm24, R_ARM_JUMP24
+    FIX_CALL,   // bl: imm24, R_ARM_CALL
+    FIX_MOVW,   // movw #:lower16:sym
+    FIX_MOVT,   // movt #:upper16:sym
+} FixupKind;
+
+typedef struct Fixup Fixup;
+struct Fixup {
+    FixupKind kind;
+    int offset;     // In .text
+    Symbol *sym;
+};
+
+// `ldr rd, =value` waiting for the next literal pool
+typedef struct Literal Literal;
+struct Literal {
+    int load;       // Offset of the ldr in .text
+    Symbol *sym;    // Or NULL for a constant
+    int value;
+};
+
+typedef struct Assembler Assembler;
+struct Assembler {
+    Section sections[NUM_SECTIONS];
+    int current;
+
+    Symbol *buckets[SYMBOL_BUCKETS];
+    Symbol **symbols; // In order of appearance, mapping symbols included
+    int nsymbols;
+    int symbol_cap;
+
+    Fixup *fixups;
+    int nfixups;
+    int fixup_cap;
+
+    Literal *literals;
+    int nliterals;
+    int literal_cap;
+
+    char mapping;   // Kind of the last mapping symbol in .text, or 0
+    char *line;     // Being assembled, for errors
+};
+
+static void asm_error(Assembler *as, char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    error("assembler: %s: %s", msg, as->line);
+}
+
+// Make room for one more element in a growable array.
+static void *reserve(void *array, int n, int *cap, size_t size) {
+    if (n < *cap) {
+        return array;
+    }
+    *cap = *cap ? 2 * *cap : 16;
+    array = realloc(array, *cap * size);
+    if (!array) {
+        error("out of memory");
+    }
+    return array;
+}
+
+/*-------------
+== Sections ==
+-------------*/
+
+static void emit_bytes(Section *sec, void *bytes, int n) {
+    if (sec->data) {
+        while (sec->size + n > sec->cap) {
+            sec->cap *= 2;
+            sec->data = realloc(sec->data, sec->cap);
+        }
+        if (bytes) {
+            memcpy(sec->data + sec->size, bytes, n);
+        } else {
+            memset(sec->data + sec->size, 0, n);
+        }
+    }
+    sec->size += n;
+}
+
+static void emit_word(Section *sec, uint32_t word) {
+    uint8_t bytes[4] = {word, word >> 8, word >> 16, word >> 24};
+    emit_bytes(sec, bytes, 4);
+}
+
+static uint32_t read_word(Section *sec, int offset) {
+    uint8_t *p = sec->data + offset;
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void write_word(Section *sec, int offset, uint32_t word) {
+    uint8_t *p = sec->data + offset;
+    p[0] = word;
+    p[1] = word >> 8;
+    p[2] = word >> 16;
+    p[3] = word >> 24;
+}
+
+static void add_reloc(Section *sec, int offset, int type, Symbol *sym, int section) {
+    sec->relocs = reserve(sec->relocs, sec->nrelocs, &sec->reloc_cap, sizeof(Reloc));
+    sec->relocs[sec->nrelocs++] = (Reloc){offset, type, sym, section};
+}
+
+/*------------
+== Symbols ==
+------------*/
+
+static unsigned hash(char *s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+static void add_symbol(Assembler *as, Symbol *sym) {
+    as->symbols = reserve(as->symbols, as->nsymbols, &as->symbol_cap, sizeof(Symbol *));
+    as->symbols[as->nsymbols++] = sym;
+}
+
+// Returns the symbol called `name`, creating it undefined if need be.
+static Symbol *intern(Assembler *as, char *name) {
+    unsigned b = hash(name) % SYMBOL_BUCKETS;
+    for (Symbol *sym = as->buckets[b]; sym; sym = sym->next) {
+        if (!strcmp(sym->name, name)) {
+            return sym;
+        }
+    }
+
+    Symbol *sym = calloc(1, sizeof(Symbol));
+    sym->name = strdup(name);
+    sym->section = -1;
+    sym->next = as->buckets[b];
+    as->buckets[b] = sym;
+    add_symbol(as, sym);
+    return sym;
+}
+
+static void define_label(Assembler *as, char *name) {
+    Symbol *sym = intern(as, name);
+    if (sym->section >= 0) {
+        asm_error(as, "%s is already defined", name);
+    }
+    sym->section = as->current;
+    sym->value = as->sections[as->current].size;
+}
+
+/*
+Mapping symbols mark where .text switches between A32 code ($a) and data
+($d), as the ARM ELF ABI asks, so disassemblers and linkers can tell them
+apart. They are not looked up, so they stay out of the hash table.
+*/
+static void set_mapping(Assembler *as, char kind) {
+    if (as->mapping == kind) {
+        return;
+    }
+    as->mapping = kind;
+
+    Symbol *sym = calloc(1, sizeof(Symbol));
+    sym->name = strdup(kind == 'a' ? "$a" : "$d");
+    sym->section = SEC_TEXT;
+    sym->value = as->sections[SEC_TEXT].size;
+    add_symbol(as, sym);
+}
+
+/*------------
+== Operands ==
+------------*/
+
+static char *trim(char *s) {
+    while (isspace(*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace(end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+// Split operands at the commas outside brackets and braces.
+static int split_operands(char *s, char **ops, int max_ops) {
+    int n = 0;
+    int depth = 0;
+    char *start = s;
+    for (;; s++) {
+        if (*s == '[' || *s == '{') {
+            depth++;
+        } else if (*s == ']' || *s == '}') {
+            depth--;
+        } else if ((*s == ',' && depth == 0) || *s == '\0') {
+            bool last = *s == '\0';
+            *s = '\0';
+            if (n == max_ops) {
+                return -1;
+            }
+            ops[n++] = trim(start);
+            start = s + 1;
+            if (last) {
+                return n;
+            }
+        }
+    }
+}
+
+static int parse_reg(Assembler *as, char *s) {
+    static char *aliases[] = {"fp", "ip", "sp", "lr", "pc"};
+    for (int i = 0; i < 5; i++) {
+        if (!strcmp(s, aliases[i])) {
+            return 11 + i;
+        }
+    }
+    if (s[0] == 'r' && isdigit(s[1])) {
+        char *end;
+        long r = strtol(s + 1, &end, 10);
+        if (*end == '\0' && r < 16) {
+            return r;
+        }
+    }
+    asm_error(as, "expected a register, got '%s'", s);
+    return 0;
+}
+
+// A NEON register "dN" or "qN", as the number of its first d register.
+static int parse_vreg(Assembler *as, char *s, char kind) {
+    if (s[0] == kind && isdigit(s[1])) {
+        char *end;
+        long r = strtol(s + 1, &end, 10);
+        if (*end == '\0' && r < (kind == 'q' ? 16 : 32)) {
+            return kind == 'q' ? 2 * r : r;
+        }
+    }
+    asm_error(as, "expected a %c register, got '%s'", kind, s);
+    return 0;
+}
+
+static int parse_num(Assembler *as, char *s) {
+    char *end;
+    long val = strtol(s, &end, 0);
+    if (end == s || *end != '\0') {
+        asm_error(as, "expected a number, got '%s'", s);
+    }
+    return val;
+}
+
+static int parse_imm(Assembler *as, char *s) {
+    if (*s != '#') {
+        asm_error(as, "expected an immediate, got '%s'", s);
+    }
+    return parse_num(as, s + 1);
+}
+
+// Register list for push and pop.
+static uint32_t parse_reglist(Assembler *as, char *s) {
+    int len = strlen(s);
+    if (s[0] != '{' || s[len - 1] != '}') {
+        asm_error(as, "expected a register list");
+    }
+    s[len - 1] = '\0';
+
+    char *regs[16];
+    int n = split_operands(s + 1, regs, 16);
+    uint32_t mask = 0;
+    for (int i = 0; i < n; i++) {
+        mask |= 1 << parse_reg(as, regs[i]);
+    }
+    return mask;
+}
+
+/*
+Encode a data-processing immediate: an 8-bit value rotated right by an
+even amount. Like GNU as, this picks the smallest rotation. Returns -1 if
+`val` has no encoding.
+*/
+static int encode_imm(uint32_t val) {
+    for (int i = 0; i < 32; i += 2) {
+        uint32_t a = i ? (val << i) | (val >> (32 - i)) : val;
+        if (a <= 0xff) {
+            return a | (i << 7);
+        }
+    }
+    return -1;
+}
+
+/*---------------
+== Instructions ==
+---------------*/
+
+static char *conds[] = {
+    "eq", "ne", "cs", "cc", "mi", "pl", "vs", "vc",
+    "hi", "ls", "ge", "lt", "gt", "le", "al",
+};
+#define COND_AL 14
+
+// Longer names first, so that "bl" is tried before "b".
+static char *bases[] = {
+    "push", "movw", "movt", "pop", "mov", "mvn", "add", "sub", "rsb", "cmp",
+    "cmn", "mul", "neg", "ldr", "str", "lsl", "lsr", "asr", "bx", "bl", "b",
+};
+
+static bool sets_flags_always(char *base) {
+    return !strcmp(base, "cmp") || !strcmp(base, "cmn");
+}
+
+static bool may_set_flags(char *base) {
+    static char *ops[] = {"mov", "mvn", "add", "sub", "rsb", "mul", "neg", "lsl", "lsr", "asr"};
+    for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+        if (!strcmp(base, ops[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Split a mnemonic like "lslls" or "lsrs" into base, condition and S flag.
+static bool split_mnemonic(char *m, char **base, int *cond, bool *s) {
+    for (int i = 0; i < sizeof(bases) / sizeof(*bases); i++) {
+        int len = strlen(bases[i]);
+        if (strncmp(m, bases[i], len)) {
+            continue;
+        }
+        char *rest = m + len;
+        *base = bases[i];
+        *s = false;
+        if (*rest == 's' && may_set_flags(bases[i])) {
+            *s = true;
+            rest++;
+        }
+        if (*rest == '\0') {
+            *cond = COND_AL;
+            return true;
+        }
+        for (int c = 0; c < sizeof(conds) / sizeof(*conds); c++) {
+            if (!strcmp(rest, conds[c])) {
+                *cond = c;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+enum {
+    OP_SUB = 2, OP_RSB = 3, OP_ADD = 4, OP_CMP = 10, OP_CMN = 11, OP_MOV = 13, OP_MVN = 15,
+};
+
+static uint32_t data_processing(int cond, int op, bool s, int rn, int rd) {
+    return (uint32_t)cond << 28 | op << 21 | s << 20 | rn << 16 | rd << 12;
+}
+
+/*
+The flexible second operand: a register, or an immediate. An immediate
+with no encoding is tried negated or inverted with the opposite operation,
+as GNU as does.
+*/
+static uint32_t operand2(Assembler *as, int *op, char *s) {
+    if (*s != '#') {
+        return parse_reg(as, s);
+    }
+
+    uint32_t val = parse_imm(as, s);
+    int enc = encode_imm(val);
+    if (enc >= 0) {
+        return 1 << 25 | enc;
+    }
+
+    int alt = -1;
+    uint32_t alt_val = -val;
+    switch (*op) {
+    case OP_ADD: alt = OP_SUB; break;
+    case OP_SUB: alt = OP_ADD; break;
+    case OP_CMP: alt = OP_CMN; break;
+    case OP_CMN: alt = OP_CMP; break;
+    case OP_MOV: alt = OP_MVN; alt_val = ~val; break;
+    case OP_MVN: alt = OP_MOV; alt_val = ~val; break;
+    }
+    enc = encode_imm(alt_val);
+    if (alt < 0 || enc < 0) {
+        asm_error(as, "invalid constant %#x", val);
+    }
+    *op = alt;
+    return 1 << 25 | enc;
+}
+
+static void need_operands(Assembler *as, int n, int expected) {
+    if (n != expected) {
+        asm_error(as, "expected %d operands", expected);
+    }
+}
+
+static void emit_insn(Assembler *as, uint32_t word) {
+    emit_word(&as->sections[SEC_TEXT], word);
+}
+
+static void add_fixup(Assembler *as, FixupKind kind, Symbol *sym) {
+    as->fixups = reserve(as->fixups, as->nfixups, &as->fixup_cap, sizeof(Fixup));
+    as->fixups[as->nfixups++] = (Fixup){kind, as->sections[SEC_TEXT].size, sym};
+}
+
+// ldr and str with an immediate offset, pre-indexed (with ! for
+// writeback) or post-indexed.
+static uint32_t memory_operand(Assembler *as, char **ops, int n) {
+    char *s = ops[1];
+    int len = strlen(s);
+    bool writeback = s[len - 1] == '!';
+    if (writeback) {
+        s[--len] = '\0';
+    }
+    if (s[0] != '[' || s[len - 1] != ']') {
+        asm_error(as, "expected a memory operand");
+    }
+    s[len - 1] = '\0';
+
+    char *parts[2];
+    int nparts = split_operands(s + 1, parts, 2);
+    if (nparts < 1) {
+        asm_error(as, "expected a memory operand");
+    }
+    int rn = parse_reg(as, parts[0]);
+    int offset = nparts == 2 ? parse_imm(as, parts[1]) : 0;
+    bool pre = true;
+    if (n == 3) {
+        if (nparts == 2 || writeback) {
+            asm_error(as, "invalid post-indexed operand");
+        }
+        offset = parse_imm(as, ops[2]);
+        pre = false;
+    }
+
+    bool up = offset >= 0;
+    unsigned mag = up ? offset : -offset;
+    if (mag > 4095) {
+        asm_error(as, "offset out of range");
+    }
+    return pre << 24 | up << 23 | writeback << 21 | rn << 16 | mag;
+}
+
+static void assemble_literal_load(Assembler *as, int cond, int rd, char *value) {
+    as->literals = reserve(as->literals, as->nliterals, &as->literal_cap, sizeof(Literal));
+    Literal *lit = &as->literals[as->nliterals++];
+    lit->load = as->sections[SEC_TEXT].size;
+    lit->sym = NULL;
+    lit->value = 0;
+    if (isdigit(*value) || *value == '-') {
+        lit->value = parse_num(as, value);
+    } else {
+        lit->sym = intern(as, value);
+    }
+    // ldr rd, [pc, #offset], patched when the pool is placed
+    emit_insn(as, (uint32_t)cond << 28 | 0x059f0000 | rd << 12);
+}
+
+static void assemble_arm(Assembler *as, char *m, char **ops, int n) {
+    char *base;
+    int cond;
+    bool s;
+    if (!split_mnemonic(m, &base, &cond, &s)) {
+        asm_error(as, "unknown instruction");
+    }
+    if (sets_flags_always(base)) {
+        s = true;
+    }
+
+    if (!strcmp(base, "b") || !strcmp(base, "bl")) {
+        need_operands(as, n, 1);
+        bool call = !strcmp(base, "bl") && cond == COND_AL;
+        add_fixup(as, call ? FIX_CALL : FIX_BRANCH, intern(as, ops[0]));
+        emit_insn(as, (uint32_t)cond << 28 | (!strcmp(base, "bl") ? 0x0b000000 : 0x0a000000));
+        return;
+    }
+    if (!strcmp(base, "bx")) {
+        need_operands(as, n, 1);
+        emit_insn(as, (uint32_t)cond << 28 | 0x012fff10 | parse_reg(as, ops[0]));
+        return;
+    }
+
+    if (!strcmp(base, "push") || !strcmp(base, "pop")) {
+        need_operands(as, n, 1);
+        uint32_t mask = parse_reglist(as, ops[0]);
+        bool push = !strcmp(base, "push");
+        if (mask && !(mask & (mask - 1))) {
+            // a single register is str rd, [sp, #-4]! or ldr rd, [sp], #4
+            int r = __builtin_ctz(mask);
+            emit_insn(as, (uint32_t)cond << 28 | (push ? 0x052d0004 : 0x049d0004) | r << 12);
+            return;
+        }
+        emit_insn(as, (uint32_t)cond << 28 | (push ? 0x092d0000 : 0x08bd0000) | mask);
+        return;
+    }
+
+    if (!strcmp(base, "ldr") || !strcmp(base, "str")) {
+        if (n < 2) {
+            need_operands(as, n, 2);
+        }
+        int rd = parse_reg(as, ops[0]);
+        if (ops[1][0] == '=') {
+            if (n != 2 || !strcmp(base, "str")) {
+                asm_error(as, "invalid literal load");
+            }
+            assemble_literal_load(as, cond, rd, ops[1] + 1);
+            return;
+        }
+        if (n > 3) {
+            need_operands(as, n, 3);
+        }
+        uint32_t load = !strcmp(base, "ldr") << 20;
+        emit_insn(as, (uint32_t)cond << 28 | 0x04000000 | load | rd << 12 | memory_operand(as, ops, n));
+        return;
+    }
+
+    if (!strcmp(base, "movw") || !strcmp(base, "movt")) {
+        need_operands(as, n, 2);
+        int rd = parse_reg(as, ops[0]);
+        bool top = !strcmp(base, "movt");
+        char *prefix = top ? "#:upper16:" : "#:lower16:";
+        uint32_t imm = 0;
+        if (!strncmp(ops[1], prefix, strlen(prefix))) {
+            add_fixup(as, top ? FIX_MOVT : FIX_MOVW, intern(as, ops[1] + strlen(prefix)));
+        } else {
+            imm = parse_imm(as, ops[1]);
+            if (imm > 0xffff) {
+                asm_error(as, "constant out of range");
+            }
+        }
+        emit_insn(as, (uint32_t)cond << 28 | (top ? 0x03400000 : 0x03000000)
+                  | (imm >> 12) << 16 | rd << 12 | (imm & 0xfff));
+        return;
+    }
+
+    if (!strcmp(base, "mul")) {
+        need_operands(as, n, 3);
+        int rd = parse_reg(as, ops[0]);
+        int rm = parse_reg(as, ops[1]);
+        int rs = parse_reg(as, ops[2]);
+        emit_insn(as, (uint32_t)cond << 28 | s << 20 | rd << 16 | rs << 8 | 0x90 | rm);
+        return;
+    }
+
+    if (!strcmp(base, "lsl") || !strcmp(base, "lsr") || !strcmp(base, "asr")) {
+        // mov rd, rm, <shift> #n
+        need_operands(as, n, 3);
+        int type = !strcmp(base, "lsl") ? 0 : !strcmp(base, "lsr") ? 1 : 2;
+        int amount = parse_imm(as, ops[2]);
+        if (amount < 0 || amount > 32 || (type == 0 && amount == 32)) {
+            asm_error(as, "shift out of range");
+        }
+        emit_insn(as, data_processing(cond, OP_MOV, s, 0, parse_reg(as, ops[0]))
+                  | (amount & 31) << 7 | type << 5 | parse_reg(as, ops[1]));
+        return;
+    }
+
+    if (!strcmp(base, "neg")) {
+        need_operands(as, n, 2);
+        emit_insn(as, data_processing(cond, OP_RSB, s, parse_reg(as, ops[1]), parse_reg(as, ops[0]))
+                  | 1 << 25);
+        return;
+    }
+
+    int op;
+    if (!strcmp(base, "mov") || !strcmp(base, "mvn")) {
+        need_operands(as, n, 2);
+        op = !strcmp(base, "mov") ? OP_MOV : OP_MVN;
+        uint32_t op2 = operand2(as, &op, ops[1]);
+        emit_insn(as, data_processing(cond, op, s, 0, parse_reg(as, ops[0])) | op2);
+        return;
+    }
+    if (!strcmp(base, "cmp") || !strcmp(base, "cmn")) {
+        need_operands(as, n, 2);
+        op = !strcmp(base, "cmp") ? OP_CMP : OP_CMN;
+        uint32_t op2 = operand2(as, &op, ops[1]);
+        emit_insn(as, data_processing(cond, op, true, parse_reg(as, ops[0]), 0) | op2);
+        return;
+    }
+
+    // add, sub and rsb, with the destination repeated if it is omitted
+    op = !strcmp(base, "add") ? OP_ADD : !strcmp(base, "sub") ? OP_SUB : OP_RSB;
+    if (n == 2) {
+        ops[2] = ops[1];
+        ops[1] = ops[0];
+        n = 3;
+    }
+    need_operands(as, n, 3);
+    uint32_t op2 = operand2(as, &op, ops[2]);
+    emit_insn(as, data_processing(cond, op, s, parse_reg(as, ops[1]), parse_reg(as, ops[0])) | op2);
+}
+
+/*
+NEON instructions for the vectorized loops. Register fields split the
+number of a d register into four low bits and a high bit.
+*/
+static uint32_t vd(int d) {
+    return (d & 15) << 12 | (d >> 4) << 22;
+}
+
+static uint32_t vn(int d) {
+    return (d & 15) << 16 | (d >> 4) << 7;
+}
+
+static uint32_t vm(int d) {
+    return (d & 15) | (d >> 4) << 5;
+}
+
+static bool assemble_neon(Assembler *as, char *m, char **ops, int n) {
+    static struct {
+        char *name;
+        uint32_t base;
+    } three_regs[] = {
+        {"vadd.i32", 0xf2200800},
+        {"vsub.i32", 0xf3200800},
+        {"vmul.i32", 0xf2200910},
+        {"vpadd.i32", 0xf2200b10},
+    };
+
+    for (int i = 0; i < sizeof(three_regs) / sizeof(*three_regs); i++) {
+        if (strcmp(m, three_regs[i].name)) {
+            continue;
+        }
+        need_operands(as, n, 3);
+        char kind = ops[0][0];
+        if (kind == 'd' && strcmp(m, "vpadd.i32") && strcmp(m, "vadd.i32")) {
+            asm_error(as, "expected q registers");
+        }
+        uint32_t q = kind == 'q' ? 1 << 6 : 0;
+        emit_insn(as, three_regs[i].base | q | vd(parse_vreg(as, ops[0], kind))
+                  | vn(parse_vreg(as, ops[1], kind)) | vm(parse_vreg(as, ops[2], kind)));
+        return true;
+    }
+
+    if (!strcmp(m, "vneg.s32")) {
+        need_operands(as, n, 2);
+        emit_insn(as, 0xf3b903c0 | vd(parse_vreg(as, ops[0], 'q')) | vm(parse_vreg(as, ops[1], 'q')));
+        return true;
+    }
+
+    if (!strcmp(m, "vld1.32") || !strcmp(m, "vst1.32")) {
+        // {dA-dB}, [rn]
+        need_operands(as, n, 2);
+        char *list = ops[0];
+        int len = strlen(list);
+        char *dash = strchr(list, '-');
+        if (list[0] != '{' || list[len - 1] != '}' || !dash) {
+            asm_error(as, "expected a d register range");
+        }
+        list[len - 1] = '\0';
+        *dash = '\0';
+        int first = parse_vreg(as, trim(list + 1), 'd');
+        int count = parse_vreg(as, trim(dash + 1), 'd') - first + 1;
+        static int types[] = {0x7, 0xa, 0x6, 0x2};
+        if (count < 1 || count > 4) {
+            asm_error(as, "too many registers");
+        }
+
+        char *addr = ops[1];
+        len = strlen(addr);
+        if (addr[0] != '[' || addr[len - 1] != ']') {
+            asm_error(as, "expected a memory operand");
+        }
+        addr[len - 1] = '\0';
+        int rn = parse_reg(as, trim(addr + 1));
+
+        uint32_t load = !strcmp(m, "vld1.32") ? 1 << 21 : 0;
+        emit_insn(as, 0xf4000000 | load | vd(first) | rn << 16 | types[count - 1] << 8 | 2 << 6 | 0xf);
+        return true;
+    }
+
+    if (!strcmp(m, "vdup.32")) {
+        need_operands(as, n, 2);
+        int d = parse_vreg(as, ops[0], 'q');
+        emit_insn(as, 0xeea00b10 | (d & 15) << 16 | (d >> 4) << 7 | parse_reg(as, ops[1]) << 12);
+        return true;
+    }
+
+    if (!strcmp(m, "vmov.i32")) {
+        // an 8-bit value in one byte of each lane
+        need_operands(as, n, 2);
+        uint32_t val = parse_imm(as, ops[1]);
+        int byte = 0;
+        while (byte < 3 && (val & ~(0xffu << (8 * byte)))) {
+            byte++;
+        }
+        if (val & ~(0xffu << (8 * byte))) {
+            asm_error(as, "invalid constant %#x", val);
+        }
+        uint32_t imm = val >> (8 * byte);
+        emit_insn(as, 0xf2800050 | vd(parse_vreg(as, ops[0], 'q')) | (imm >> 7) << 24
+                  | ((imm >> 4) & 7) << 16 | (2 * byte) << 8 | (imm & 15));
+        return true;
+    }
+
+    if (!strcmp(m, "vmov.32")) {
+        // rt, dN[x]
+        need_operands(as, n, 2);
+        char *lane = strchr(ops[1], '[');
+        if (!lane) {
+            asm_error(as, "expected a scalar");
+        }
+        *lane = '\0';
+        int x = parse_num(as, strtok(lane + 1, "]"));
+        int d = parse_vreg(as, ops[1], 'd');
+        if (x < 0 || x > 1) {
+            asm_error(as, "lane out of range");
+        }
+        emit_insn(as, 0xee100b10 | x << 21 | vn(d) | parse_reg(as, ops[0]) << 12);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+Place the pending `ldr =` values after the code so far, each value once,
+and point the loads at them.
+*/
+static void place_literals(Assembler *as) {
+    if (!as->nliterals) {
+        return;
+    }
+    Section *text = &as->sections[SEC_TEXT];
+    set_mapping(as, 'd');
+
+    int *slots = calloc(as->nliterals, sizeof(int));
+    for (int i = 0; i < as->nliterals; i++) {
+        Literal *lit = &as->literals[i];
+        slots[i] = -1;
+        for (int j = 0; j < i; j++) {
+            if (as->literals[j].sym == lit->sym && as->literals[j].value == lit->value) {
+                slots[i] = slots[j];
+                break;
+            }
+        }
+        if (slots[i] < 0) {
+            slots[i] = text->size;
+            if (lit->sym) {
+                // the symbol's offset is added once it is known
+                add_reloc(text, slots[i], R_ARM_ABS32, lit->sym, 0);
+            }
+            emit_word(text, lit->value);
+        }
+
+        int offset = slots[i] - (lit->load + 8);
+        if (offset > 4095) {
+            error("assembler: literal pool out of range");
+        }
+        write_word(text, lit->load, read_word(text, lit->load) | 1 << 23 | offset);
+    }
+    free(slots);
+    as->nliterals = 0;
+}
+
+/*-----------
+== Driver ==
+-----------*/
+
+static void switch_section(Assembler *as, int section) {
+    if (as->current == SEC_TEXT && section != SEC_TEXT) {
+        place_literals(as);
+    }
+    as->current = section;
+}
+
+static void assemble_directive(Assembler *as, char *name, char *args) {
+    Section *sec = &as->sections[as->current];
+
+    if (!strcmp(name, ".text")) {
+        switch_section(as, SEC_TEXT);
+    } else if (!strcmp(name, ".data")) {
+        switch_section(as, SEC_DATA);
+    } else if (!strcmp(name, ".bss")) {
+        switch_section(as, SEC_BSS);
+    } else if (!strcmp(name, ".global") || !strcmp(name, ".globl")) {
+        intern(as, args)->global = true;
+    } else if (!strcmp(name, ".balign")) {
+        int align = parse_num(as, args);
+        if (align <= 0 || (align & (align - 1))) {
+            asm_error(as, "alignment is not a power of two");
+        }
+        emit_bytes(sec, NULL, (align - sec->size % align) % align);
+    } else if (!strcmp(name, ".word")) {
+        if (as->current == SEC_BSS) {
+            asm_error(as, "data in .bss");
+        }
+        if (as->current == SEC_TEXT) {
+            set_mapping(as, 'd');
+        }
+        emit_word(sec, parse_num(as, args));
+    } else if (!strcmp(name, ".space")) {
+        emit_bytes(sec, NULL, parse_num(as, args));
+    } else if (!strcmp(name, ".ltorg")) {
+        place_literals(as);
+    } else if (!strcmp(name, ".fpu")) {
+        // nothing to record without build attributes
+    } else {
+        asm_error(as, "unsupported directive");
+    }
+}
+
+static void assemble_line(Assembler *as, char *line) {
+    as->line = line;
+    char *s = trim(line);
+    if (*s == '\0') {
+        return;
+    }
+
+    int len = strlen(s);
+    if (s[len - 1] == ':') {
+        s[len - 1] = '\0';
+        define_label(as, s);
+        return;
+    }
+
+    char *args = s;
+    while (*args && !isspace(*args)) {
+        args++;
+    }
+    if (*args) {
+        *args++ = '\0';
+    }
+    args = trim(args);
+
+    if (*s == '.') {
+        assemble_directive(as, s, args);
+        return;
+    }
+
+    if (as->current != SEC_TEXT) {
+        asm_error(as, "instruction outside .text");
+    }
+    set_mapping(as, 'a');
+
+    char *ops[4];
+    int n = *args ? split_operands(args, ops, 4) : 0;
+    if (n < 0) {
+        asm_error(as, "too many operands");
+    }
+    if (!assemble_neon(as, s, ops, n)) {
+        assemble_arm(as, s, ops, n);
+    }
+}
+
+// Patch or relocate the references recorded while assembling.
+static void resolve_fixups(Assembler *as) {
+    Section *text = &as->sections[SEC_TEXT];
+    for (int i = 0; i < as->nfixups; i++) {
+        Fixup *fix = &as->fixups[i];
+        Symbol *sym = fix->sym;
+        uint32_t word = read_word(text, fix->offset);
+
+        if (fix->kind == FIX_BRANCH || fix->kind == FIX_CALL) {
+            int disp;
+            if (sym->section == SEC_TEXT && !sym->global) {
+                disp = sym->value - (fix->offset + 8);
+            } else {
+                disp = -8;
+                add_reloc(text, fix->offset, fix->kind == FIX_CALL ? R_ARM_CALL : R_ARM_JUMP24, sym, 0);
+            }
+            write_word(text, fix->offset, word | ((disp >> 2) & 0xffffff));
+            continue;
+        }
+
+        // movw and movt keep the symbol, as their addends are only 16 bits
+        add_reloc(text, fix->offset, fix->kind == FIX_MOVW ? R_ARM_MOVW_ABS_NC : R_ARM_MOVT_ABS, sym, 0);
+    }
+
+    // Literal words against local labels refer to their section instead.
+    for (int i = 0; i < text->nrelocs; i++) {
+        Reloc *rel = &text->relocs[i];
+        if (rel->type == R_ARM_ABS32 && rel->sym->section >= 0 && !rel->sym->global) {
+            write_word(text, rel->offset, read_word(text, rel->offset) + rel->sym->value);
+            rel->section = rel->sym->section;
+            rel->sym = NULL;
+        }
+    }
+
+    for (int i = 0; i < as->nsymbols; i++) {
+        Symbol *sym = as->symbols[i];
+        if (sym->section < 0 && !sym->global) {
+            // referenced but never defined: an external function
+            sym->global = true;
+        }
+    }
+}
+
+/*-------------------
+== ELF Object File ==
+-------------------*/
+
+static int buf_append(Buffer *buf, void *bytes, int n) {
+    while (buf->len + n > buf->cap) {
+        buf->cap = buf->cap ? 2 * buf->cap : 256;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    int offset = buf->len;
+    if (bytes) {
+        memcpy(buf->data + offset, bytes, n);
+    } else {
+        memset(buf->data + offset, 0, n);
+    }
+    buf->len += n;
+    return offset;
+}
+
+static void buf_align(Buffer *buf, int align) {
+    buf_append(buf, NULL, (align - buf->len % align) % align);
+}
+
+static int add_string(Buffer *strtab, char *s) {
+    return buf_append(strtab, s, strlen(s) + 1);
+}
+
+/*
+Section headers, in order: the null section, .text, .data, .bss, then
+.rel.text if there are relocations, .symtab, .strtab and .shstrtab.
+*/
+static void write_object(Assembler *as, Buffer *buf) {
+    Buffer file = {};
+    Buffer strtab = {};
+    Buffer shstrtab = {};
+    Buffer symtab = {};
+    Buffer rel = {};
+    add_string(&strtab, "");
+    add_string(&shstrtab, "");
+
+    Elf32_Shdr shdrs[8] = {};
+    int nshdrs = 1;
+    int section_index[NUM_SECTIONS];
+
+    buf_append(&file, NULL, sizeof(Elf32_Ehdr));
+    Elf32_Word flags[] = {SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC | SHF_WRITE, SHF_ALLOC | SHF_WRITE};
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        Section *sec = &as->sections[i];
+        Elf32_Shdr *sh = &shdrs[nshdrs];
+        section_index[i] = nshdrs++;
+        sh->sh_name = add_string(&shstrtab, sec->name);
+        sh->sh_type = sec->data ? SHT_PROGBITS : SHT_NOBITS;
+        sh->sh_flags = flags[i];
+        sh->sh_addralign = 4;
+        buf_align(&file, 4);
+        sh->sh_offset = file.len;
+        sh->sh_size = sec->size;
+        if (sec->data) {
+            buf_append(&file, sec->data, sec->size);
+        }
+    }
+
+    // Locals first: the null symbol, sections, then labels.
+    Elf32_Sym null_sym = {};
+    buf_append(&symtab, &null_sym, sizeof(null_sym));
+    int nsyms = 1;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        Elf32_Sym sym = {.st_info = ELF32_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = section_index[i]};
+        buf_append(&symtab, &sym, sizeof(sym));
+        nsyms++;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < as->nsymbols; i++) {
+            Symbol *s = as->symbols[i];
+            if (s->global != pass) {
+                continue;
+            }
+            Elf32_Sym sym = {
+                .st_name = add_string(&strtab, s->name),
+                .st_value = s->value,
+                .st_info = ELF32_ST_INFO(s->global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE),
+                .st_shndx = s->section < 0 ? SHN_UNDEF : section_index[s->section],
+            };
+            buf_append(&symtab, &sym, sizeof(sym));
+            s->index = nsyms++;
+        }
+        if (pass == 0) {
+            shdrs[0].sh_info = nsyms; // first global, moved to .symtab below
+        }
+    }
+    int first_global = shdrs[0].sh_info;
+    shdrs[0].sh_info = 0;
+
+    Section *text = &as->sections[SEC_TEXT];
+    for (int i = 0; i < text->nrelocs; i++) {
+        Reloc *r = &text->relocs[i];
+        int sym = r->sym ? r->sym->index : 1 + r->section;
+        Elf32_Rel entry = {.r_offset = r->offset, .r_info = ELF32_R_INFO(sym, r->type)};
+        buf_append(&rel, &entry, sizeof(entry));
+    }
+
+    int symtab_index = nshdrs + (text->nrelocs > 0);
+    if (text->nrelocs) {
+        Elf32_Shdr *sh = &shdrs[nshdrs++];
+        sh->sh_name = add_string(&shstrtab, ".rel.text");
+        sh->sh_type = SHT_REL;
+        sh->sh_flags = SHF_INFO_LINK;
+        buf_align(&file, 4);
+        sh->sh_offset = buf_append(&file, rel.data, rel.len);
+        sh->sh_size = rel.len;
+        sh->sh_link = symtab_index;
+        sh->sh_info = section_index[SEC_TEXT];
+        sh->sh_addralign = 4;
+        sh->sh_entsize = sizeof(Elf32_Rel);
+    }
+
+    Elf32_Shdr *sh = &shdrs[nshdrs++];
+    sh->sh_name = add_string(&shstrtab, ".symtab");
+    sh->sh_type = SHT_SYMTAB;
+    buf_align(&file, 4);
+    sh->sh_offset = buf_append(&file, symtab.data, symtab.len);
+    sh->sh_size = symtab.len;
+    sh->sh_link = symtab_index + 1;
+    sh->sh_info = first_global;
+    sh->sh_addralign = 4;
+    sh->sh_entsize = sizeof(Elf32_Sym);
+
+    sh = &shdrs[nshdrs++];
+    sh->sh_name = add_string(&shstrtab, ".strtab");
+    sh->sh_type = SHT_STRTAB;
+    sh->sh_offset = buf_append(&file, strtab.data, strtab.len);
+    sh->sh_size = strtab.len;
+    sh->sh_addralign = 1;
+
+    sh = &shdrs[nshdrs++];
+    sh->sh_name = add_string(&shstrtab, ".shstrtab");
+    sh->sh_type = SHT_STRTAB;
+    sh->sh_offset = buf_append(&file, shstrtab.data, shstrtab.len);
+    sh->sh_size = shstrtab.len;
+    sh->sh_addralign = 1;
+
+    buf_align(&file, 4);
+    int shoff = buf_append(&file, shdrs, nshdrs * sizeof(Elf32_Shdr));
+
+    Elf32_Ehdr *eh = (Elf32_Ehdr *)file.data;
+    memcpy(eh->e_ident, ELFMAG, SELFMAG);
+    eh->e_ident[EI_CLASS] = ELFCLASS32;
+    eh->e_ident[EI_DATA] = ELFDATA2LSB;
+    eh->e_ident[EI_VERSION] = EV_CURRENT;
+    eh->e_type = ET_REL;
+    eh->e_machine = EM_ARM;
+    eh->e_version = EV_CURRENT;
+    eh->e_flags = EF_ARM_EABI_VER5;
+    eh->e_ehsize = sizeof(Elf32_Ehdr);
+    eh->e_shoff = shoff;
+    eh->e_shentsize = sizeof(Elf32_Shdr);
+    eh->e_shnum = nshdrs;
+    eh->e_shstrndx = nshdrs - 1;
+
+    buf_append(buf, file.data, file.len);
+    free(file.data);
+    free(strtab.data);
+    free(shstrtab.data);
+    free(symtab.data);
+    free(rel.data);
+}
+
+static void free_assembler(Assembler *as) {
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        free(as->sections[i].data);
+        free(as->sections[i].relocs);
+    }
+    for (int i = 0; i < as->nsymbols; i++) {
+        free(as->symbols[i]->name);
+        free(as->symbols[i]);
+    }
+    free(as->symbols);
+    free(as->fixups);
+    free(as->literals);
+}
+
+// Assemble the A32 assembly `text` into an object file appended to `buf`.
+void assemble(char *text, Buffer *buf) {
+    Assembler as = {};
+    char *names[] = {".text", ".data", ".bss"};
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        as.sections[i].name = names[i];
+        if (i != SEC_BSS) {
+            as.sections[i].cap = 256;
+            as.sections[i].data = calloc(1, as.sections[i].cap);
+        }
+    }
+    as.current = SEC_TEXT;
+
+    for (char *line = text; *line;) {
+        char *end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        assemble_line(&as, line);
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+    as.line = "";
+    switch_section(&as, SEC_TEXT);
+    place_literals(&as);
+    resolve_fixups(&as);
+    write_object(&as, buf);
+    free_assembler(&as);
+}
@@ -0,0 +1,615 @@
+#define _POSIX_C_SOURCE 200809L
+#include "charmcc.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+AST files: a parsed and type-checked program saved by --save-ast, which
+later compilations map and pick up from instead of lexing and parsing.
+
+The file is a header followed by five sections, each an array:
+
+    strings  NUL-terminated names, the source text and the target name
+    tokens   TokenRec, pointing into the source text
+    types    TypeRec
+    objs     ObjRec
+    nodes    NodeRec
+
+Records hold int32 fields, and refer to each other and to strings by
+index into their section (a string by its byte offset), with NONE for a
+null pointer. A node record has room for the four fields its kind uses
+at most, listed in node_fields[]. Loading maps the file and turns each
+record into the structure the compiler works on in one pass over the
+section. Names, function names and the tokens' source text are used where
+they lie in the mapping, which stays until the compilation ends.
+
+Every index is checked against its section, so a damaged file fails
+cleanly, but nothing checks that the graph is shaped like one the parser
+would build.
+*/
+
+#define AST_MAGIC "charmAST"
+#define AST_VERSION 1
+#define NONE -1
+
+typedef struct {
+    char magic[8];
+    int32_t version;
+    int32_t target;    // string naming the target the types were laid out for
+    int32_t source;    // string holding the program text
+    int32_t prog;      // obj of the first global
+    int32_t nstrings;  // bytes of strings, padded to 4
+    int32_t ntokens;
+    int32_t ntypes;
+    int32_t nobjs;
+    int32_t nnodes;
+} AstHeader;
+
+typedef struct {
+    int32_t kind, val, loc, len;
+} TokenRec;
+
+typedef struct {
+    int32_t kind, size, name, base, array_len, return_type, params, next;
+} TypeRec;
+
+enum { OBJ_LOCAL = 1, OBJ_FUNCTION = 2, OBJ_STATIC = 4 };
+
+typedef struct {
+    int32_t next, name, type, flags, offset, reg, init;
+    int32_t params, body, locals, stack_size, saved_regs;
+} ObjRec;
+
+// The fields of a Node beyond kind, next, type and repr
+enum {
+    F_LHS = 1 << 0,
+    F_RHS = 1 << 1,
+    F_CONDITION = 1 << 2,
+    F_CONSEQUENCE = 1 << 3,
+    F_ALTERNATIVE = 1 << 4,
+    F_INITIALIZE = 1 << 5,
+    F_INCREMENT = 1 << 6,
+    F_FUNC = 1 << 7,
+    F_ARGS = 1 << 8,
+    F_BODY = 1 << 9,
+    F_VAR = 1 << 10,
+    F_VAL = 1 << 11,
+    F_END = 1 << 12,
+};
+
+// The fields each kind of node has, at most 4, which fill the slots in order
+static int node_fields[] = {
+    [ND_ADD] = F_LHS | F_RHS,
+    [ND_SUB] = F_LHS | F_RHS,
+    [ND_MUL] = F_LHS | F_RHS,
+    [ND_DIV] = F_LHS | F_RHS,
+    [ND_NEG] = F_LHS,
+    [ND_ADDR] = F_LHS,
+    [ND_DEREF] = F_LHS,
+    [ND_EQ] = F_LHS | F_RHS,
+    [ND_NEQ] = F_LHS | F_RHS,
+    [ND_LT] = F_LHS | F_RHS,
+    [ND_LTE] = F_LHS | F_RHS,
+    [ND_NUM] = F_VAL,
+    [ND_ASSIGN] = F_LHS | F_RHS,
+    [ND_IF] = F_CONDITION | F_CONSEQUENCE | F_ALTERNATIVE,
+    [ND_LOOP] = F_CONDITION | F_CONSEQUENCE | F_INITIALIZE | F_INCREMENT,
+    [ND_VEC_LOOP] = F_CONDITION | F_CONSEQUENCE | F_INITIALIZE | F_INCREMENT,
+    [ND_RETURN] = F_LHS,
+    [ND_BLOCK] = F_BODY,
+    [ND_EXPR_STMT] = F_LHS,
+    [ND_VAR] = F_VAR,
+    [ND_FN_CALL] = F_FUNC | F_ARGS,
+    [ND_INLINE] = F_FUNC | F_ARGS | F_BODY,
+};
+
+typedef struct {
+    int32_t kind, next, type, repr;
+    int32_t slots[4];
+} NodeRec;
+
+/*----------
+== Saving ==
+----------*/
+
+enum { K_TOKEN, K_TYPE, K_OBJ, K_NODE, NKINDS };
+
+// Pointer or string to index, by open addressing.
+typedef struct {
+    uintptr_t *keys;
+    int32_t *vals;
+    int cap;
+    int len;
+} IndexMap;
+
+// Objects of one kind in index order.
+typedef struct {
+    void **items;
+    int len;
+    int cap;
+} Pending;
+
+typedef struct {
+    IndexMap ptrs;
+    IndexMap strs;
+    Buffer strings;
+    Pending pending[NKINDS];
+    int source_len;
+} Saver;
+
+static uint32_t hash_ptr(uintptr_t p) {
+    return (p >> 4) * 2654435761u;
+}
+
+static uint32_t hash_str(char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t ptr_key_hash(uintptr_t key, Saver *s) {
+    return hash_ptr(key);
+}
+
+// String keys are offsets into the string section.
+static uint32_t str_key_hash(uintptr_t key, Saver *s) {
+    return hash_str(s->strings.data + key);
+}
+
+// The slot of `key` in `m`, or the empty slot where it would go.
+static int map_slot(IndexMap *m, uint32_t h, bool (*same)(uintptr_t, void *, Saver *), void *key, Saver *s) {
+    for (int i = h & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+        if (m->vals[i] == NONE || same(m->keys[i], key, s)) {
+            return i;
+        }
+    }
+}
+
+static void map_grow(IndexMap *m, uint32_t (*hash)(uintptr_t, Saver *), Saver *s) {
+    IndexMap old = *m;
+    m->cap = old.cap ? old.cap * 2 : 1024;
+    m->keys = calloc(m->cap, sizeof(uintptr_t));
+    m->vals = malloc(m->cap * sizeof(int32_t));
+    memset(m->vals, 0xff, m->cap * sizeof(int32_t));
+    for (int i = 0; i < old.cap; i++) {
+        if (old.vals[i] != NONE) {
+            int j = hash(old.keys[i], s) & (m->cap - 1);
+            while (m->vals[j] != NONE) {
+                j = (j + 1) & (m->cap - 1);
+            }
+            m->keys[j] = old.keys[i];
+            m->vals[j] = old.vals[i];
+        }
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+static bool same_ptr(uintptr_t key, void *p, Saver *s) {
+    return key == (uintptr_t)p;
+}
+
+static bool same_str(uintptr_t key, void *str, Saver *s) {
+    return !strcmp(s->strings.data + key, str);
+}
+
+static void append(Buffer *buf, void *data, int len) {
+    if (buf->cap < buf->len + len) {
+        buf->cap = (buf->len + len) * 2;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+// Index of the string `str`, added to the section the first time.
+static int32_t string_ref(Saver *s, char *str) {
+    if (!str) {
+        return NONE;
+    }
+    if (s->strs.len * 2 >= s->strs.cap) {
+        map_grow(&s->strs, str_key_hash, s);
+    }
+    int i = map_slot(&s->strs, hash_str(str), same_str, str, s);
+    if (s->strs.vals[i] == NONE) {
+        s->strs.keys[i] = s->strings.len;
+        s->strs.vals[i] = s->strings.len;
+        s->strs.len++;
+        append(&s->strings, str, strlen(str) + 1);
+    }
+    return s->strs.vals[i];
+}
+
+// Index of `p` among the objects of `kind`, queued to be written the first time.
+static int32_t ref(Saver *s, int kind, void *p) {
+    if (!p) {
+        return NONE;
+    }
+    if (s->ptrs.len * 2 >= s->ptrs.cap) {
+        map_grow(&s->ptrs, ptr_key_hash, s);
+    }
+    int i = map_slot(&s->ptrs, hash_ptr((uintptr_t)p), same_ptr, p, s);
+    if (s->ptrs.vals[i] == NONE) {
+        Pending *q = &s->pending[kind];
+        if (q->len == q->cap) {
+            q->cap = q->cap ? q->cap * 2 : 256;
+            q->items = realloc(q->items, q->cap * sizeof(void *));
+        }
+        s->ptrs.keys[i] = (uintptr_t)p;
+        s->ptrs.vals[i] = q->len;
+        s->ptrs.len++;
+        q->items[q->len++] = p;
+    }
+    return s->ptrs.vals[i];
+}
+
+static TokenRec token_rec(Saver *s, Token *tok) {
+    int loc = tok->loc - cc->input;
+    if (loc < 0 || loc + tok->len > s->source_len) {
+        error("cannot save a token outside the source");
+    }
+    return (TokenRec){tok->kind, tok->val, loc, tok->len};
+}
+
+static TypeRec type_rec(Saver *s, Type *t) {
+    return (TypeRec){
+        .kind = t->kind,
+        .size = t->size,
+        .name = ref(s, K_TOKEN, t->name),
+        .base = ref(s, K_TYPE, t->base),
+        .array_len = t->array_len,
+        .return_type = ref(s, K_TYPE, t->return_type),
+        .params = ref(s, K_TYPE, t->params),
+        .next = ref(s, K_TYPE, t->next),
+    };
+}
+
+static ObjRec obj_rec(Saver *s, Obj *obj) {
+    return (ObjRec){
+        .next = ref(s, K_OBJ, obj->next),
+        .name = string_ref(s, obj->name),
+        .type = ref(s, K_TYPE, obj->type),
+        .flags = (obj->is_local ? OBJ_LOCAL : 0) | (obj->is_function ? OBJ_FUNCTION : 0) |
+                 (obj->is_static ? OBJ_STATIC : 0),
+        .offset = obj->offset,
+        .reg = obj->reg,
+        .init = obj->init,
+        .params = ref(s, K_OBJ, obj->params),
+        .body = ref(s, K_NODE, obj->body),
+        .locals = ref(s, K_OBJ, obj->locals),
+        .stack_size = obj->stack_size,
+        .saved_regs = obj->saved_regs,
+    };
+}
+
+static int32_t save_field(Saver *s, Node *node, int field) {
+    switch (field) {
+    case F_LHS: return ref(s, K_NODE, node->lhs);
+    case F_RHS: return ref(s, K_NODE, node->rhs);
+    case F_CONDITION: return ref(s, K_NODE, node->condition);
+    case F_CONSEQUENCE: return ref(s, K_NODE, node->consequence);
+    case F_ALTERNATIVE: return ref(s, K_NODE, node->alternative);
+    case F_INITIALIZE: return ref(s, K_NODE, node->initialize);
+    case F_INCREMENT: return ref(s, K_NODE, node->increment);
+    case F_FUNC: return string_ref(s, node->func);
+    case F_ARGS: return ref(s, K_NODE, node->args);
+    case F_BODY: return ref(s, K_NODE, node->body);
+    case F_VAR: return ref(s, K_OBJ, node->var);
+    }
+    return node->val;
+}
+
+static bool has_field(Node *node, int field) {
+    switch (field) {
+    case F_LHS: return node->lhs;
+    case F_RHS: return node->rhs;
+    case F_CONDITION: return node->condition;
+    case F_CONSEQUENCE: return node->consequence;
+    case F_ALTERNATIVE: return node->alternative;
+    case F_INITIALIZE: return node->initialize;
+    case F_INCREMENT: return node->increment;
+    case F_FUNC: return node->func;
+    case F_ARGS: return node->args;
+    case F_BODY: return node->body;
+    case F_VAR: return node->var;
+    }
+    return node->val;
+}
+
+static NodeRec node_rec(Saver *s, Node *node) {
+    NodeRec r = {
+        .kind = node->kind,
+        .next = ref(s, K_NODE, node->next),
+        .type = ref(s, K_TYPE, node->type),
+        .repr = ref(s, K_TOKEN, node->repr),
+    };
+    int n = 0;
+    for (int f = 1; f < F_END; f <<= 1) {
+        if (node_fields[node->kind] & f) {
+            r.slots[n++] = save_field(s, node, f);
+        } else if (has_field(node, f)) {
+            error_tok(node->repr, "cannot save this kind of node with that field");
+        }
+    }
+    return r;
+}
+
+/*
+Appends `prog` as an AST file to `out`. Objects are numbered as they are
+first reached and written in that order, each record possibly reaching
+more, until every queue is drained, so that long lists do not recurse.
+*/
+void save_ast(Obj *prog, Buffer *out) {
+    Saver s = {.source_len = strlen(cc->input)};
+    AstHeader h = {.magic = AST_MAGIC, .version = AST_VERSION};
+    h.source = string_ref(&s, cc->input);
+    h.target = string_ref(&s, cc->target->name);
+    h.prog = ref(&s, K_OBJ, prog);
+
+    Buffer recs[NKINDS] = {};
+    int done[NKINDS] = {};
+    for (bool more = true; more;) {
+        more = false;
+        for (int k = 0; k < NKINDS; k++) {
+            for (; done[k] < s.pending[k].len; done[k]++) {
+                void *p = s.pending[k].items[done[k]];
+                more = true;
+                if (k == K_TOKEN) {
+                    TokenRec r = token_rec(&s, p);
+                    append(&recs[k], &r, sizeof(r));
+                } else if (k == K_TYPE) {
+                    TypeRec r = type_rec(&s, p);
+                    append(&recs[k], &r, sizeof(r));
+                } else if (k == K_OBJ) {
+                    ObjRec r = obj_rec(&s, p);
+                    append(&recs[k], &r, sizeof(r));
+                } else {
+                    NodeRec r = node_rec(&s, p);
+                    append(&recs[k], &r, sizeof(r));
+                }
+            }
+        }
+    }
+
+    while (s.strings.len % 4) {
+        append(&s.strings, "", 1);
+    }
+    h.nstrings = s.strings.len;
+    h.ntokens = s.pending[K_TOKEN].len;
+    h.ntypes = s.pending[K_TYPE].len;
+    h.nobjs = s.pending[K_OBJ].len;
+    h.nnodes = s.pending[K_NODE].len;
+
+    append(out, &h, sizeof(h));
+    append(out, s.strings.data, s.strings.len);
+    for (int k = 0; k < NKINDS; k++) {
+        if (recs[k].len) {
+            append(out, recs[k].data, recs[k].len);
+        }
+        free(recs[k].data);
+        free(s.pending[k].items);
+    }
+    free(s.strings.data);
+    free(s.ptrs.keys);
+    free(s.ptrs.vals);
+    free(s.strs.keys);
+    free(s.strs.vals);
+}
+
+/*-----------
+== Loading ==
+-----------*/
+
+typedef struct {
+    AstHeader *h;
+    char *strings;
+    int source_len;
+    Token *tokens;
+    Type *types;
+    Obj *objs;
+    Node *nodes;
+} Loader;
+
+static void corrupt(void) {
+    error("corrupt AST file");
+}
+
+// The item that index `i` refers to in an array of `n`, or NULL for NONE.
+static void *item(void *base, int size, int32_t i, int32_t n) {
+    if (i == NONE) {
+        return NULL;
+    }
+    if (i < 0 || i >= n) {
+        corrupt();
+    }
+    return (char *)base + (size_t)i * size;
+}
+
+static char *string_at(Loader *l, int32_t i) {
+    return item(l->strings, 1, i, l->h->nstrings);
+}
+
+static Token *token_at(Loader *l, int32_t i) {
+    return item(l->tokens, sizeof(Token), i, l->h->ntokens);
+}
+
+static Type *type_at(Loader *l, int32_t i) {
+    return item(l->types, sizeof(Type), i, l->h->ntypes);
+}
+
+static Obj *obj_at(Loader *l, int32_t i) {
+    return item(l->objs, sizeof(Obj), i, l->h->nobjs);
+}
+
+static Node *node_at(Loader *l, int32_t i) {
+    return item(l->nodes, sizeof(Node), i, l->h->nnodes);
+}
+
+static void load_field(Loader *l, Node *node, int field, int32_t val) {
+    switch (field) {
+    case F_LHS: node->lhs = node_at(l, val); return;
+    case F_RHS: node->rhs = node_at(l, val); return;
+    case F_CONDITION: node->condition = node_at(l, val); return;
+    case F_CONSEQUENCE: node->consequence = node_at(l, val); return;
+    case F_ALTERNATIVE: node->alternative = node_at(l, val); return;
+    case F_INITIALIZE: node->initialize = node_at(l, val); return;
+    case F_INCREMENT: node->increment = node_at(l, val); return;
+    case F_FUNC: node->func = string_at(l, val); return;
+    case F_ARGS: node->args = node_at(l, val); return;
+    case F_BODY: node->body = node_at(l, val); return;
+    case F_VAR: node->var = obj_at(l, val); return;
+    }
+    node->val = val;
+}
+
+static void load_records(Loader *l, char *p) {
+    char *source = l->strings + l->h->source;
+
+    TokenRec *tr = (TokenRec *)p;
+    for (int i = 0; i < l->h->ntokens; i++, tr++) {
+        if (tr->kind < TK_IDENT || tr->kind > TK_EOF || tr->loc < 0 || tr->len < 0 ||
+            tr->loc > l->source_len - tr->len) {
+            corrupt();
+        }
+        l->tokens[i] = (Token){.kind = tr->kind, .val = tr->val, .loc = source + tr->loc, .len = tr->len};
+        // A loaded token lasts as long as the AST, like a kept one
+        l->tokens[i].kept = &l->tokens[i];
+    }
+
+    TypeRec *ty = (TypeRec *)tr;
+    for (int i = 0; i < l->h->ntypes; i++, ty++) {
+        if (ty->kind < TY_INT || ty->kind > TY_FUNC) {
+            corrupt();
+        }
+        l->types[i] = (Type){
+            .kind = ty->kind,
+            .size = ty->size,
+            .name = token_at(l, ty->name),
+            .base = type_at(l, ty->base),
+            .array_len = ty->array_len,
+            .return_type = type_at(l, ty->return_type),
+            .params = type_at(l, ty->params),
+            .next = type_at(l, ty->next),
+        };
+    }
+
+    ObjRec *ob = (ObjRec *)ty;
+    for (int i = 0; i < l->h->nobjs; i++, ob++) {
+        l->objs[i] = (Obj){
+            .next = obj_at(l, ob->next),
+            .name = string_at(l, ob->name),
+            .type = type_at(l, ob->type),
+            .is_local = ob->flags & OBJ_LOCAL,
+            .is_function = ob->flags & OBJ_FUNCTION,
+            .is_static = ob->flags & OBJ_STATIC,
+            .offset = ob->offset,
+            .reg = ob->reg,
+            .init = ob->init,
+            .params = obj_at(l, ob->params),
+            .body = node_at(l, ob->body),
+            .locals = obj_at(l, ob->locals),
+            .stack_size = ob->stack_size,
+            .saved_regs = ob->saved_regs,
+        };
+        if (!l->objs[i].name || !l->objs[i].type) {
+            corrupt();
+        }
+    }
+
+    NodeRec *nr = (NodeRec *)ob;
+    for (int i = 0; i < l->h->nnodes; i++, nr++) {
+        if (nr->kind < ND_ADD || nr->kind > ND_INLINE) {
+            corrupt();
+        }
+        Node *node = &l->nodes[i];
+        *node = (Node){
+            .kind = nr->kind,
+            .next = node_at(l, nr->next),
+            .type = type_at(l, nr->type),
+            .repr = token_at(l, nr->repr),
+        };
+        int n = 0;
+        for (int f = 1; f < F_END; f <<= 1) {
+            if (node_fields[node->kind] & f) {
+                load_field(l, node, f, nr->slots[n++]);
+            }
+        }
+    }
+}
+
+/*
+Maps the AST file at `path` and returns its program. The mapping is kept
+in cc->ast_map for the names and source text to stay valid.
+*/
+Obj *load_ast(char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        error("cannot read AST file");
+    }
+    if (st.st_size < sizeof(AstHeader) || st.st_size > INT_MAX) {
+        close(fd);
+        corrupt();
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("cannot map AST file");
+    }
+    cc->ast_map = map;
+    cc->ast_size = st.st_size;
+
+    AstHeader *h = (AstHeader *)map;
+    if (memcmp(h->magic, AST_MAGIC, sizeof(h->magic))) {
+        error("not an AST file");
+    }
+    if (h->version != AST_VERSION) {
+        error("AST file version %d, expected %d", h->version, AST_VERSION);
+    }
+    if (h->nstrings <= 0 || h->nstrings % 4 || h->ntokens < 0 || h->ntypes < 0 ||
+        h->nobjs < 0 || h->nnodes < 0) {
+        corrupt();
+    }
+    long size = sizeof(AstHeader) + (long)h->nstrings + (long)h->ntokens * sizeof(TokenRec) +
+                (long)h->ntypes * sizeof(TypeRec) + (long)h->nobjs * sizeof(ObjRec) +
+                (long)h->nnodes * sizeof(NodeRec);
+    if (size != st.st_size) {
+        corrupt();
+    }
+
+    Loader l = {.h = h, .strings = map + sizeof(AstHeader)};
+    // Every string ends within the section
+    if (l.strings[h->nstrings - 1] != '\0') {
+        corrupt();
+    }
+    char *target = string_at(&l, h->target);
+    char *source = string_at(&l, h->source);
+    if (!target || !source) {
+        corrupt();
+    }
+    if (strcmp(target, cc->target->name)) {
+        error("AST file is for --target=%s", target);
+    }
+    cc->input = source;
+    l.source_len = strlen(source);
+
+    l.tokens = allocate(cc->mm, sizeof(Token) * h->ntokens);
+    l.types = allocate(cc->mm, sizeof(Type) * h->ntypes);
+    l.objs = allocate(cc->mm, sizeof(Obj) * h->nobjs);
+    l.nodes = allocate(cc->mm, sizeof(Node) * h->nnodes);
+    load_records(&l, l.strings + h->nstrings);
+
+    Obj *prog = obj_at(&l, h->prog);
+    if (!prog) {
+        corrupt();
+    }
+    return prog;
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+# Measure code generation throughput on a large synthetic program:
+# many independent functions with loops, arrays, calls and arithmetic.
+FUNCS=${FUNCS:-600}
+
+src=""
+for ((i = 0; i < FUNCS; i++)); do
+    src+="int f$i(int a, int b) { int s; int k; int x[8]; s=0; for (k=0; k<8; k=k+1) { x[k] = a*k + b - $i; s = s + x[k]/3; } if (s < $i) s = s - a; else s = s + b; return s; } "
+done
+src+="int main() { return f0(1, 2); }"
+
+./charmcc $FLAGS --stats -o /dev/null "$src" 2>&1 >/dev/null | grep '^codegen:'
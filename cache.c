@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+#include "charmcc.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+The compilation cache: results stored under --cache=DIR, named by the
+SHA-256 of everything that decides them (the compiler build, the options
+that change the output and the source), so that compiling the same thing
+again reads the result back instead.
+
+An entry is DIR/K/KEY, where K is the first digit of KEY. Entries are
+written to a temporary file and renamed into place, so processes and
+threads sharing DIR only ever see whole entries. A hit bumps the entry's
+modification time, and after a store the oldest entries of its K
+directory are removed until it is back under a 16th of --cache-size.
+
+Nothing here fails a compilation: a cache that cannot be read or written
+just misses.
+*/
+
+// Hash of the compiler's sources, set by the Makefile
+#ifndef CHARMCC_BUILD_ID
+#define CHARMCC_BUILD_ID "unknown"
+#endif
+
+#define NSUBDIRS 16
+
+/*----------
+== SHA-256 ==
+----------*/
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void sha256_init(Sha256 *s) {
+    *s = (Sha256){.h = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    }};
+}
+
+static void sha256_block(Sha256 *s, uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_update(Sha256 *s, void *data, size_t len) {
+    uint8_t *p = data;
+    s->len += len;
+    while (len > 0) {
+        size_t n = 64 - s->fill < len ? 64 - s->fill : len;
+        memcpy(s->block + s->fill, p, n);
+        s->fill += n;
+        p += n;
+        len -= n;
+        if (s->fill == 64) {
+            sha256_block(s, s->block);
+            s->fill = 0;
+        }
+    }
+}
+
+// Finishes the hash into the 32 bytes at `digest`.
+void sha256_final(Sha256 *s, uint8_t *digest) {
+    uint64_t bits = s->len * 8;
+    static uint8_t pad[64] = {0x80};
+    sha256_update(s, pad, 1);
+    sha256_update(s, pad + 1, (56 - s->fill + 64) % 64);
+    uint8_t len[8];
+    for (int i = 0; i < 8; i++) {
+        len[i] = bits >> (56 - 8*i);
+    }
+    sha256_update(s, len, 8);
+
+    for (int i = 0; i < 32; i++) {
+        digest[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+/*-----------
+== Entries ==
+-----------*/
+
+/*
+The key of compiling `source` with `opts`, which check_options() has
+settled. --stats and -j are left out as they do not change the result.
+*/
+void cache_key(Options *opts, char *source, char *key) {
+    char desc[256];
+    int len = snprintf(desc, sizeof(desc),
+        "charmcc cache 1\n%s\n%s debug=%d unroll=%d vectorize=%d inline=%d movt=%d thumb=%d object=%d ast=%d\n",
+        CHARMCC_BUILD_ID, cc->target->name, opts->debug, opts->unroll, opts->vectorize,
+        opts->inline_limit, opts->movt, opts->thumb, opts->object, opts->save_ast);
+
+    Sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, desc, len);
+    sha256_update(&s, source, strlen(source));
+    uint8_t digest[32];
+    sha256_final(&s, digest);
+    for (int i = 0; i < 32; i++) {
+        sprintf(key + 2*i, "%02x", digest[i]);
+    }
+}
+
+static char *entry_path(char *dir, char *key, char *suffix) {
+    int len = snprintf(NULL, 0, "%s/%c/%s%s", dir, key[0], key, suffix);
+    char *path = malloc(len + 1);
+    snprintf(path, len + 1, "%s/%c/%s%s", dir, key[0], key, suffix);
+    return path;
+}
+
+// Appends the stored result for `key` to `out`, if there is one.
+bool cache_load(Options *opts, char *key, Buffer *out) {
+    char *path = entry_path(opts->cache, key, "");
+    int fd = open(path, O_RDONLY);
+    free(path);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        cc->cache_stats.misses++;
+        return false;
+    }
+
+    int need = out->len + st.st_size + 1;
+    if (out->cap < need) {
+        out->cap = need;
+        out->data = realloc(out->data, out->cap);
+    }
+    int done = 0;
+    while (done < st.st_size) {
+        ssize_t n = read(fd, out->data + out->len + done, st.st_size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (done != st.st_size) {
+        close(fd);
+        cc->cache_stats.misses++;
+        return false;
+    }
+
+    // Mark it recently used
+    futimens(fd, NULL);
+    close(fd);
+    out->len += done;
+    cc->cache_stats.hits++;
+    return true;
+}
+
+typedef struct {
+    char *name;
+    off_t size;
+    struct timespec used;
+} Entry;
+
+static int by_use(const void *a, const void *b) {
+    const Entry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    if (x->used.tv_nsec != y->used.tv_nsec) {
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+Removes the least recently used entries of `subdir` down to 90% of
+`limit`, but never `key`, which was just stored.
+*/
+static void evict(char *subdir, char *key, long limit) {
+    DIR *d = opendir(subdir);
+    if (!d) {
+        return;
+    }
+    int fd = dirfd(d);
+
+    Entry *entries = NULL;
+    int n = 0, cap = 0;
+    long total = 0;
+    for (struct dirent *de; (de = readdir(d));) {
+        // Skips ., .. and the temporary files of stores in progress
+        struct stat st;
+        if (strchr(de->d_name, '.') || fstatat(fd, de->d_name, &st, 0) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, sizeof(Entry) * cap);
+        }
+        entries[n++] = (Entry){strdup(de->d_name), st.st_size, st.st_mtim};
+        total += st.st_size;
+    }
+
+    if (total > limit) {
+        qsort(entries, n, sizeof(Entry), by_use);
+        for (int i = 0; i < n && total > limit / 10 * 9; i++) {
+            if (strcmp(entries[i].name, key) && !unlinkat(fd, entries[i].name, 0)) {
+                total -= entries[i].size;
+                cc->cache_stats.evictions++;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+    closedir(d);
+}
+
+// Stores `len` bytes at `data` as the result for `key`.
+void cache_store(Options *opts, char *key, char *data, int len) {
+    char *subdir = entry_path(opts->cache, key, "");
+    *strrchr(subdir, '/') = '\0';
+    if ((mkdir(opts->cache, 0777) && errno != EEXIST) ||
+        (mkdir(subdir, 0777) && errno != EEXIST)) {
+        free(subdir);
+        return;
+    }
+
+    char *tmp = entry_path(opts->cache, key, ".tmp.XXXXXX");
+    int fd = mkstemp(tmp);
+    bool ok = fd >= 0;
+    for (int done = 0; ok && done < len;) {
+        ssize_t n = write(fd, data + done, len - done);
+        ok = n > 0;
+        done += n;
+    }
+    if (fd >= 0 && close(fd)) {
+        ok = false;
+    }
+
+    char *path = entry_path(opts->cache, key, "");
+    if (ok && !rename(tmp, path)) {
+        evict(subdir, key, opts->cache_size / NSUBDIRS);
+    } else if (fd >= 0) {
+        unlink(tmp);
+    }
+    free(path);
+    free(tmp);
+    free(subdir);
+}
@@ -1,13 +1,17 @@
 #define _POSIX_C_SOURCE 200809L
+#include "libcharmcc.h"
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define PTR_SIZE 4
 #define DEBUG_ALLOCS 0
 
 /*---------
@@ -29,15 +33,20 @@ struct Token {
     int val;    // If kind is TK_NUM, the value is stored here
     char *loc;  // Token location in input
     int len;    // Token length
+    Token *kept; // Copy made by keep_token(), or itself if it is one
 };
 
+void raise_error(char *msg);
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
-Token *tokenize(char *input);
+void start_lexer(char *input);
+Token *next_item(void);
+Token *item_end(void);
+Token *keep_token(Token *tok);
 void free_tokens(Token *tok);
 
 /*---------------------
@@ -45,15 +54,19 @@ void free_tokens(Token *tok);
 ---------------------*/
 
 typedef struct MemManager MemManager;
+typedef struct Chunk Chunk;
 struct MemManager {
     MemManager *next;
     MemManager *tail;
     void *obj;
+    Chunk *chunks; // allocate()'s arena, current chunk first
+    Chunk *spare;  // chunks kept by reset_memmanager()
 };
 
 MemManager *new_memmanager();
 void register_obj(MemManager *mm, void *obj);
 void *allocate(MemManager *mm, size_t size);
+void reset_memmanager(MemManager *mm);
 void cleanup(MemManager *mm);
 
 /*----------
@@ -77,16 +90,19 @@ typedef enum {
     ND_ASSIGN, // =
     ND_IF,     // if
     ND_LOOP,   // for, while
+    ND_VEC_LOOP, // for, four int elements at a time
     ND_RETURN, // return
 
     ND_BLOCK,
     ND_EXPR_STMT,
     ND_VAR,
     ND_FN_CALL,
+    ND_INLINE, // call replaced by the callee's body
 } NodeKind;
 
 typedef struct Type Type;
 typedef struct Node Node;
+typedef struct Fragment Fragment;
 
 // Variable or function
 typedef struct Obj Obj;
@@ -96,15 +112,21 @@ struct Obj {
     Type *type;
     bool is_local;
     bool is_function;
+    bool is_static; // Not visible outside the translation unit
 
     // Variable
     int offset; // Offset from frame pointer
+    int reg;    // Callee-saved register holding a local, or 0 if it lives in the frame
+    int init;   // Initial value of a global
 
     // Function
     Obj *params;
     Node *body;
     Obj *locals;
     int stack_size;
+    int saved_regs; // Registers pushed by the prologue, one bit each
+    Fragment *fragment; // Code kept from an earlier compilation, if reused
+    bool inlined;       // inline_calls() has run on the body
 };
 
 struct Node {
@@ -116,23 +138,28 @@ struct Node {
     Node *lhs;
     Node *rhs;
 
-    // Only if kind == ND_IF || ND_LOOP
+    // Only if kind == ND_IF || ND_LOOP || ND_VEC_LOOP
     Node *condition;
     Node *consequence;
     Node *alternative;
     Node *initialize;
     Node *increment;
 
-    // Only if kind == ND_FN_CALL
+    // Only if kind == ND_FN_CALL || ND_INLINE
     char *func;
     Node *args;
 
-    Node *body; // Only if kind == ND_BLOCK
+    Node *body; // Only if kind == ND_BLOCK || ND_INLINE
     Obj *var;   // Only if kind == ND_VAR
     int val;    // Only if kind == ND_NUM
 };
 
-Obj *parse(Token *tok, MemManager *mm);
+Node *new_node(NodeKind kind, Token *repr, MemManager *mm);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *repr, MemManager *mm);
+Node *new_unary(NodeKind kind, Node *expr, Token *repr, MemManager *mm);
+Node *new_var(Obj *var, Token *repr, MemManager *mm);
+Node *new_num(int val, Token *repr, MemManager *mm);
+Obj *parse(char *input, MemManager *mm);
 
 /*----------
 Type Checker
@@ -172,12 +199,184 @@ Type *copy_type(Type *type, MemManager *mm);
 Type *pointer_to(Type *base, MemManager *mm);
 Type *func_type(Type *return_type, MemManager *mm);
 Type *array_of(Type *base, int size, MemManager *mm);
+int type_align(Type *type);
 void add_type(Node *node, MemManager *mm);
 
+/*-------------
+== Optimizer ==
+-------------*/
+
+typedef struct Induction Induction;
+struct Induction {
+    Obj *var;      // Induction variable
+    int step;      // Added to var by the loop increment
+    Node *bound;   // Loop-invariant side of the condition
+    NodeKind cmp;  // ND_LT or ND_LTE
+    bool upward;   // var < bound, rather than bound < var
+
+    bool has_start;
+    int start;     // Value assigned by the loop initializer
+};
+
+Node *copy_node(Node *node, MemManager *mm);
+int count_nodes(Node *node);
+bool eval_const(Node *node, int *val);
+bool assigns_var(Node *node, Obj *var);
+bool addr_taken(Node *node, Obj *var);
+bool same_expr(Node *a, Node *b);
+Node *new_expr_stmt(Node *expr, Token *repr, MemManager *mm);
+Node *offset_var(Obj *var, long delta, Token *repr, MemManager *mm);
+void replace_with_block(Node *node, Node *stmts);
+Obj *new_local(Obj *fn, char *name, Type *type, MemManager *mm);
+bool is_var(Node *node, Obj *var);
+int count_uses(Node *node, Obj *var);
+bool contains(Node *node, NodeKind kind);
+bool is_invariant(Node *node, Node *loop, Obj *fn);
+bool find_induction(Node *loop, Obj *fn, Induction *ind);
+long trip_count(Induction *ind);
+Node *steps_remain(Induction *ind, int ahead, Node **no_wrap, Token *repr, MemManager *mm);
+Obj *optimize(Obj *prog, Options *opts, MemManager *mm);
+
+Node *reduction_operand(Node *assign);
+void vectorize_loops(Obj *fn, Options *opts, MemManager *mm);
+void unroll_loops(Obj *fn, Options *opts, MemManager *mm);
+void eliminate_common_subexprs(Obj *fn, Options *opts, MemManager *mm);
+void optimize_locals(Obj *fn, Options *opts, MemManager *mm);
+void eliminate_dead_code(Obj *fn, Options *opts, MemManager *mm);
+void inline_calls(Obj *fn, Obj *prog, Options *opts, MemManager *mm);
+Obj *remove_unreachable(Obj *prog, Options *opts, MemManager *mm);
+
 /*------------
 == Code Gen ==
 ------------*/
 
-void codegen(Obj *prog);
+/*
+A backend. codegen() lays out the globals and goes through the functions,
+and the target decides everything about the machine: frame layout,
+calling convention, and which instructions and directives to emit.
+*/
+typedef struct Target Target;
+struct Target {
+    char *name;   // --target=NAME
+    int ptr_size;
+    bool vectors; // Can run the four-lane loops made by the vectorizer
+
+    // Give the locals of `fn` their offsets and size its frame
+    void (*layout_frame)(Obj *fn, Options *opts);
+    // Directive for an initialized global of `size` bytes
+    char *(*data_directive)(int size);
+    // Text section directives before the first function
+    void (*emit_header)(Obj *prog, Options *opts);
+    void (*emit_function)(Obj *fn);
+    // Support routines the generated code calls, or NULL
+    void (*emit_runtime)(Obj *prog);
+};
+
+extern Target target_arm;
+extern Target target_x86_64;
+extern Target target_aarch64;
+
+Target *find_target(char *name);
+void emit(char *fmt, ...);
+void codegen(Obj *prog, Options *opts, Buffer *buf);
+
+void debug_ast(Obj *prog, Buffer *buf);
+
+/*-------------
+== Assembler ==
+-------------*/
+
+void assemble(char *text, Buffer *buf);
+
+/*-------------
+== AST files ==
+-------------*/
+
+void save_ast(Obj *prog, Buffer *out);
+Obj *load_ast(char *path);
+
+/*---------
+== Cache ==
+---------*/
+
+typedef struct Sha256 Sha256;
+struct Sha256 {
+    uint32_t h[8];
+    uint8_t block[64];
+    int fill;         // bytes in `block`
+    uint64_t len;     // bytes hashed so far
+};
+
+void sha256_init(Sha256 *s);
+void sha256_update(Sha256 *s, void *data, size_t len);
+void sha256_final(Sha256 *s, uint8_t *digest);
+
+void cache_key(Options *opts, char *source, char *key);
+bool cache_load(Options *opts, char *key, Buffer *out);
+void cache_store(Options *opts, char *key, char *data, int len);
+
+/*-----------------
+== Incremental ==
+-----------------*/
+
+// The code of a function, kept by an incremental compilation for the next
+struct Fragment {
+    Fragment *next;
+    char *name;
+    uint8_t key[32];  // Hash of the function and everything its code depends on
+    char *code;       // What emit_function() emitted
+    int len;
+    int kinds;        // Node kinds in the optimized body, one bit each
+    char **uses;      // Globals and functions the optimized body refers to
+    int nuses;
+    bool committed;   // Part of cc->fragments rather than of this compilation only
+};
+
+typedef struct Plan Plan;
+
+void plan_reuse(char *input, Options *opts);
+bool reuse_function(Obj *fn);
+void keep_fragment(Obj *fn, char *code, int len);
+void commit_fragments(Obj *prog, Options *opts);
+void drop_plan(Obj *prog);
+void free_fragments(Fragment *frag);
+
+/*------------
+== Compiler ==
+------------*/
+
+/*
+Everything one compilation works on. The compiler running on a thread is
+`cc`, set by charmcc_compile() for the length of the compilation.
+*/
+struct Compiler {
+    Options opts;
+    Target *target;
+    jmp_buf *on_error; // Where error() goes, or NULL to exit
+    char *error;       // Message of the last failure
+    CacheStats cache_stats;
+
+    // Lexer
+    char *input;
+    char *lex_pos;   // Where the next item starts
+    Token *window;   // Tokens of the item being parsed
+    Token *spare;    // Tokens to reuse for the next item
+    void *ast_map;   // AST file the program was loaded from
+    size_t ast_size;
+
+    // Parser
+    MemManager *mm;
+    Obj *locals;     // Of the function being parsed
+    Obj *globals;
+
+    // Incremental compilation
+    Fragment *fragments; // Kept by the last compilation
+    Plan *plan;          // Which functions this one reuses
+
+    // Code generation
+    Obj *prog;
+    Buffer *out;     // What emit() appends to
+    Buffer asm_text; // Assembly on its way to the assembler
+};
 
-void debug_ast(Obj *prog);
+extern _Thread_local Compiler *cc;
@@ -1,405 +1,377 @@
 #include "charmcc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
-static int depth;
-static Obj *current_fn;
-
-static void gen_expr(Node *node);
+/*
+Target-independent part of code generation.
 
-static int count(void) {
-    static int i = 1;
-    return i++;
-}
+Each backend is a Target in its own file. The driver lays out the frames,
+emits the globals with the target's data directives, then the functions.
+Everything goes into one buffer in memory, which the caller writes out.
 
-static void push(int r) {
-    printf("  push  {r%d}\n", r);
-    depth++;
-}
+Functions are independent once their frames are laid out, so with -j they
+are generated by a pool of threads, each function into a buffer of its
+own. The buffers are joined in source order, so the output is the same
+whatever the number of threads or the order they finish in.
+*/
 
-static void pop(char *arg) {
-    printf("  pop   {%s}\n", arg);
-    depth--;
-}
+static Target *targets[] = {&target_arm, &target_x86_64, &target_aarch64};
 
-static void load(Type *type, int r) {
-    if (type->kind == TY_ARRAY) {
-        // cannot load an array into a register
-        // references to the array are pointers to the first element
-        return;
+// Returns NULL if there is no target called `name`.
+Target *find_target(char *name) {
+    for (int i = 0; i < sizeof(targets) / sizeof(*targets); i++) {
+        if (!strcmp(targets[i]->name, name)) {
+            return targets[i];
+        }
     }
-
-    printf("  ldr   r%d, [r%d]\n", r, r);
-}
-
-static void store(void) {
-    pop("r1");
-    printf("  str   r0, [r1]\n");
+    return NULL;
 }
 
-/*
-Round up `n` to the nearest multiple of `align`.
-For example, align_to(5, 8) == 8 and align_to(11, 8) == 16.
-*/
-static int align_to(int n, int align) {
-    return (n + align - 1) / align * align;
-}
+/*-----------
+== Output ==
+-----------*/
 
-// Check if the AST contains a node of kind.
-// Returns 1 if found, 0 otherwise.
-static int contains(Node *node, NodeKind kind) {
-    if (node == NULL) {
-        return 0;
+static void reserve_output(int n) {
+    Buffer *out = cc->out;
+    if (out->len + n < out->cap) {
+        return;
     }
-
-    if (node->kind == kind) {
-        return 1;
+    while (out->len + n >= out->cap) {
+        out->cap = out->cap ? 2 * out->cap : 1 << 16;
     }
+    out->data = realloc(out->data, out->cap);
+    if (!out->data) {
+        error("out of memory");
+    }
+}
 
-    return contains(node->lhs, kind)
-        || contains(node->rhs, kind)
-        || contains(node->body, kind)
-        || contains(node->next, kind)
-        || contains(node->condition, kind)
-        || contains(node->consequence, kind)
-        || contains(node->alternative, kind)
-        || contains(node->initialize, kind)
-        || contains(node->increment, kind);
+static void append(char *s, int n) {
+    Buffer *out = cc->out;
+    reserve_output(n);
+    memcpy(out->data + out->len, s, n);
+    out->len += n;
 }
 
-// Compute absolute address of a node.
-// It's an error if a given node does not reside in memory.
-static void gen_addr(Node *node) {
-    switch (node->kind) {
-    case ND_VAR:
-        if (node->var->is_local) {
-            printf("  sub   r0, fp, #%d\n", node->var->offset);
-        } else {
-            printf("  ldr   r0, __addr_%s\n", node->var->name);
-        }
-        return;
-    case ND_DEREF:
-        gen_expr(node->lhs);
-        return;
-    default:
-        break;
+// Write the digits of `val` backwards, ending at `end`.
+static char *format_number(char *end, long val) {
+    unsigned long mag = val < 0 ? -(unsigned long)val : val;
+    do {
+        *--end = '0' + mag % 10;
+        mag /= 10;
+    } while (mag);
+    if (val < 0) {
+        *--end = '-';
     }
-
-    error_tok(node->repr, "not an lvalue");
+    return end;
 }
 
-static void gen_expr(Node *node) {
-    switch (node->kind) {
-    case ND_NUM:
-        printf("  mov   r0, #%d\n", node->val);
-        return;
-    case ND_NEG:
-        assert(node->lhs);
-        gen_expr(node->lhs);
-        printf("  neg   r0, r0\n");
-        return;
-    case ND_VAR:
-        gen_addr(node);
-        assert(node->type);
-        load(node->type, 0);
-        return;
-    case ND_ADDR:
-        assert(node->lhs);
-        gen_addr(node->lhs);
-        return;
-    case ND_DEREF:
-        assert(node->lhs);
-        gen_expr(node->lhs);
-        assert(node->type);
-        load(node->type, 0);
-        return;
-    case ND_ASSIGN:
-        gen_addr(node->lhs);
-        push(0);
-        gen_expr(node->rhs);
-        store();
-        return;
-    case ND_FN_CALL: {
-        int nargs = 0;
-        for (Node *arg = node->args; arg; arg = arg->next) {
-            gen_expr(arg);
-            push(0);
-            nargs++;
+/*
+Append to the output, printf style. Only what the backends use is
+understood: %s, %d, %u and %%, with a width and '-' to pad strings. Numbers
+are formatted by hand, which is much cheaper than stdio for every line.
+*/
+void emit(char *fmt, ...) {
+    Buffer *out = cc->out;
+    va_list ap;
+    va_start(ap, fmt);
+    for (char *p = fmt; *p;) {
+        char *pct = strchr(p, '%');
+        if (!pct) {
+            append(p, strlen(p));
+            break;
         }
+        append(p, pct - p);
+        p = pct + 1;
 
-        assert(nargs <= 4);
-        char reg[3] = {'r', '_', '\0'};
-        for (int i = nargs - 1; i >= 0; i--) {
-            reg[1] = '0' + i;
-            pop(reg);
+        bool left = *p == '-';
+        if (left) {
+            p++;
+        }
+        int width = 0;
+        while (isdigit(*p)) {
+            width = width * 10 + *p++ - '0';
         }
 
-        printf("  bl    %s\n", node->func);
-        return;
-    }
-    default:
-        break;
-    }
-
-    gen_expr(node->rhs);
-    push(0);
-    gen_expr(node->lhs);
-    pop("r1");
-
-    switch (node->kind) {
-    case ND_ADD:
-        printf("  add   r0, r0, r1\n");
-        return;
-    case ND_SUB:
-        printf("  sub   r0, r0, r1\n");
-        return;
-    case ND_MUL:
-        printf("  mul   r0, r0, r1\n");
-        return;
-    case ND_DIV:
-        printf("  bl    __div\n");
-        return;
-    case ND_EQ:
-    case ND_NEQ:
-    case ND_LT:
-    case ND_LTE:
-        printf("  cmp   r0, r1\n"); // carry set if rhs - lhs is positive
-        switch (node->kind) {
-        case ND_EQ:
-            printf(
-                "  moveq r0, #1\n"
-                "  movne r0, #0\n");
+        char digits[24];
+        char *end = digits + sizeof(digits);
+        char *str;
+        switch (*p++) {
+        case 's':
+            str = va_arg(ap, char *);
+            end = str + strlen(str);
             break;
-        case ND_NEQ:
-            printf(
-                "  movne r0, #1\n"
-                "  moveq r0, #0\n");
+        case 'd':
+            str = format_number(end, va_arg(ap, int));
             break;
-        case ND_LT:
-            printf(
-                "  movlt r0, #1\n"
-                "  movge r0, #0\n");
+        case 'u':
+            str = format_number(end, va_arg(ap, unsigned));
             break;
-        case ND_LTE:
-            printf(
-                "  movle r0, #1\n"
-                "  movgt r0, #0\n");
+        case '%':
+            str = "%";
+            end = str + 1;
             break;
         default:
-            break;
+            error("emit: unsupported conversion in \"%s\"", fmt);
+        }
+
+        int len = end - str;
+        int pad = width > len ? width - len : 0;
+        reserve_output(pad);
+        if (!left) {
+            memset(out->data + out->len, ' ', pad);
+            out->len += pad;
+        }
+        append(str, len);
+        if (left) {
+            memset(out->data + out->len, ' ', pad);
+            out->len += pad;
         }
-        return;
-    default:
-        break;
     }
+    va_end(ap);
 
-    error_tok(node->repr, "invalid expression");
+    reserve_output(1);
+    out->data[out->len] = '\0';
 }
 
-static int assign_offsets(Obj *prog) {
-    int global_vars = 0;
-    for (Obj *obj = prog; obj; obj = obj->next) {
-        if (!obj->is_function) {
-            global_vars++;
-            continue;
+// Instruction lines are indented; directives and labels are not.
+static int count_instructions(Buffer *buf) {
+    int n = 0;
+    for (char *p = buf->data; p && *p;) {
+        if (p[0] == ' ' && p[1] == ' ' && p[2] != '.') {
+            n++;
         }
-
-        Obj *fn = obj;
-        int lvar_offset = PTR_SIZE;
-        for (Obj *var = fn->locals; var; var = var->next) {
-            lvar_offset += var->type->size;
-            var->offset = lvar_offset;
+        p = strchr(p, '\n');
+        if (p) {
+            p++;
         }
-        fn->stack_size = align_to(lvar_offset, 16);
     }
-    return global_vars;
+    return n;
 }
 
-static void gen_stmt(Node *node) {
-    switch (node->kind) {
-    case ND_IF: {
-        int c = count();
-        gen_expr(node->condition);
-        printf("  cmp   r0, #0\n");
-        printf("  beq   %s.if.else.%d\n", current_fn->name, c);
-        gen_stmt(node->consequence);
-        printf("  b     %s.if.end.%d\n", current_fn->name, c);
-        printf("%s.if.else.%d:\n", current_fn->name, c);
-        if (node->alternative) {
-            gen_stmt(node->alternative);
-        }
-        printf("%s.if.end.%d:\n", current_fn->name, c);
-        return;
+/*
+Lay out the globals. Zero-initialized ones take no room in the object file
+and go to .bss, the others to .data. Each group puts scalars first, so the
+ones used together tend to share cache lines, then arrays from the smallest.
+*/
+static int compare_globals(const void *a, const void *b) {
+    Obj *x = *(Obj **)a;
+    Obj *y = *(Obj **)b;
+    bool x_array = x->type->kind == TY_ARRAY;
+    bool y_array = y->type->kind == TY_ARRAY;
+    if (x_array != y_array) {
+        return x_array - y_array;
     }
-    case ND_LOOP: {
-        int c = count();
-        if (node->initialize) {
-            gen_stmt(node->initialize);
+    return x->type->size - y->type->size;
+}
+
+static void emit_section(char *name, Obj **vars, int nvars, bool zero) {
+    bool first = true;
+    for (int i = 0; i < nvars; i++) {
+        Obj *var = vars[i];
+        if ((var->init == 0) != zero) {
+            continue;
         }
-        printf("%s.loop.begin.%d:\n", current_fn->name, c);
-        if (node->condition) {
-            gen_expr(node->condition);
-            printf("  cmp   r0, #0\n");
-            printf("  beq   %s.loop.end.%d\n", current_fn->name, c);
+        if (first) {
+            emit("%s\n", name);
+            first = false;
         }
-        gen_stmt(node->consequence);
-        if (node->increment) {
-            gen_expr(node->increment);
+        emit(".balign %d\n", type_align(var->type));
+        emit("__global_%s:\n", var->name);
+        if (zero) {
+            emit("  .space %d\n", var->type->size);
+        } else {
+            emit("  %s %d\n", cc->target->data_directive(var->type->size), var->init);
         }
-        printf("  b     %s.loop.begin.%d\n", current_fn->name, c);
-        printf("%s.loop.end.%d:\n", current_fn->name, c);
-        return;
     }
-    case ND_BLOCK:
-        for (Node *n = node->body; n; n = n->next) {
-            gen_stmt(n);
+    if (!first) {
+        emit("\n");
+    }
+}
+
+static void emit_data(Obj *prog, int global_vars) {
+    Obj **vars = calloc(global_vars, sizeof(Obj *));
+    int n = 0;
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (!obj->is_function) {
+            vars[n++] = obj;
         }
-        return;
-    case ND_RETURN:
-        gen_expr(node->lhs);
-        printf("  b     %s.return\n", current_fn->name);
-        return;
-    case ND_EXPR_STMT:
-        gen_expr(node->lhs);
-        return;
-    default:
-        break;
     }
+    qsort(vars, n, sizeof(Obj *), compare_globals);
 
-    error_tok(node->repr, "invalid statement");
+    emit_section(".data", vars, n, false);
+    emit_section(".bss", vars, n, true);
+    free(vars);
 }
 
-/*
-Generate a subroutine for integer division.
-
-Inputs:
-  r0 : dividend
-  r1 : divisor
+/*------------------------
+== Parallel Generation ==
+------------------------*/
 
-Outputs:
-  r0 : quotient
-  r1 : remainder
+// Emits `fn`, or the code an incremental compilation kept for it.
+static void gen_function(Obj *fn) {
+    if (fn->fragment) {
+        append(fn->fragment->code, fn->fragment->len);
+        reserve_output(1);
+        cc->out->data[cc->out->len] = '\0';
+        return;
+    }
+    int start = cc->out->len;
+    cc->target->emit_function(fn);
+    if (cc->plan) {
+        keep_fragment(fn, cc->out->data + start, cc->out->len - start);
+    }
+}
 
-@PERF:
-  Check divisor for powers of two and use shifts instead.
+typedef struct Worklist Worklist;
+struct Worklist {
+    Compiler *cc;
+    Obj **fns;
+    Buffer *bufs;  // One per function
+    char **errors; // One per function, set if it failed
+    int nfns;
+    atomic_int next;
+    atomic_bool failed;
+};
 
-References:
-  https://www.virag.si/2010/02/simple-division-algorithm-for-arm-assembler/
-  http://www.tofla.iconbar.com/tofla/arm/arm02/index.htm
+/*
+A worker runs on a copy of the compiler, so that emit() goes to the
+buffer of its function and an error stops only the worker. Functions are
+handed out in order and those already started are finished, so the first
+error in source order is the same whatever the scheduling.
 */
-static void gen_div(void) {
-    printf("__div:\n"
-        "  push  {fp, lr}\n"
-        "  add   fp, sp, #4\n");
-    printf(
-        // check for divide by zero
-        // @TODO: jump to some sort of panic routine
-        "  cmp   r1, #0\n"
-        "  beq   __div_end\n"
-        "  push  {r0, r1}\n"
-        // variables
-        "  mov   r0, #0\n"         // quotient
-        "  pop   {r1, r2}\n"       // dividend / remainder, divisor
-        "  mov   r3, #1\n"         // bit field
-        "__div_shift:\n"
-        // shift divisor left until it exceeds dividend
-        // the bit field will be shifted by one less
-        "  cmp   r2, r1\n"
-        "  lslls r2, r2, #1\n"
-        "  lslls r3, r3, #1\n"
-        "  bls   __div_shift\n"
-        "__div_sub:\n"
-        // cmp sets the carry flag if r1 - r2 is positive, which is weird
-        "  cmp   r1, r2\n"
-        // subtract divisor from the remainder if it was smaller
-        // this also sets the carry flag since the result is positive
-        "  subcs r1, r1, r2\n"
-        // add bit field to the quotient if the divisor was smaller
-        "  addcs r0, r0, r3\n"
-        // shift bit field right, setting the carry flag if it underflows
-        "  lsrs  r3, r3, #1\n"
-        // shift divisor right if bit field has not underflowed
-        "  lsrcc r2, r2, #1\n"
-        // loop if bit field has not underflowed
-        "  bcc   __div_sub\n");
-    printf(
-        "__div_end:\n"
-        "  sub   sp, fp, #4\n"
-        "  pop   {fp, pc}\n");
-}
-
-int gen_fn(Obj *fn) {
-    current_fn = fn;
-
-    printf(
-        "%s:\n"
-        "  push  {fp, lr}\n"
-        "  add   fp, sp, #4\n"
-        "  sub   sp, sp, #%d\n",
-        fn->name,
-        fn->stack_size);
-
-    if (fn->params) {
-        // Save passed-by-register arguments to stack
-        // str   r0, [fp, #-8]
-        int i = 0;
-        for (Obj *var = fn->params; var; var = var->next) {
-            assert(i < 4);
-            printf("  str   r%d, [fp, #-%d]\n", i++, var->offset);
+static void *gen_functions(void *arg) {
+    Worklist *wl = arg;
+    Compiler *worker = malloc(sizeof(Compiler));
+    *worker = *wl->cc;
+    jmp_buf on_error;
+    worker->on_error = &on_error;
+    worker->error = NULL;
+
+    Compiler *outer = cc;
+    cc = worker;
+    volatile int i = 0;
+    if (setjmp(on_error)) {
+        wl->errors[i] = worker->error;
+        atomic_store(&wl->failed, true);
+    } else {
+        while (!atomic_load(&wl->failed)) {
+            i = atomic_fetch_add(&wl->next, 1);
+            if (i >= wl->nfns) {
+                break;
+            }
+            worker->out = &wl->bufs[i];
+            gen_function(wl->fns[i]);
         }
     }
-
-    gen_stmt(fn->body);
-    assert(depth == 0);
-
-    printf(
-        "%s.return:\n"
-        "  sub   sp, fp, #4\n"
-        "  pop   {fp, pc}\n\n",
-        fn->name);
-    
-    return contains(fn->body, ND_DIV);
+    cc = outer;
+    free(worker);
+    return NULL;
 }
 
-void codegen(Obj *prog) {
-    int contains_div = 0;
-    int global_vars = assign_offsets(prog);
+static void emit_functions(Obj *prog, int jobs) {
+    int nfns = 0;
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        nfns += obj->is_function;
+    }
 
-    if (global_vars) {
-        printf(".data\n.balign 4\n\n");
+    if (jobs <= 1 || nfns <= 1) {
         for (Obj *obj = prog; obj; obj = obj->next) {
-            if (!obj->is_function) {
-                printf("__global_%s:\n", obj->name);
-                printf("  .word 0\n");
+            if (obj->is_function) {
+                gen_function(obj);
             }
         }
-        printf("\n");
+        return;
     }
 
-    printf(".text\n.balign 4\n");
+    Worklist wl = {
+        .cc = cc,
+        .fns = calloc(nfns, sizeof(Obj *)),
+        .bufs = calloc(nfns, sizeof(Buffer)),
+        .errors = calloc(nfns, sizeof(char *)),
+        .nfns = nfns,
+    };
+    int n = 0;
     for (Obj *obj = prog; obj; obj = obj->next) {
         if (obj->is_function) {
-            printf(".global %s\n", obj->name);
+            wl.fns[n++] = obj;
         }
     }
-    printf("\n");
-    for (Obj *obj = prog; obj; obj = obj->next) {
-        if (obj->is_function) {
-            contains_div += gen_fn(obj);
+
+    // The calling thread is one of the workers.
+    if (jobs > nfns) {
+        jobs = nfns;
+    }
+    pthread_t *threads = calloc(jobs - 1, sizeof(pthread_t));
+    int started = 0;
+    while (started < jobs - 1 && !pthread_create(&threads[started], NULL, gen_functions, &wl)) {
+        started++;
+    }
+    gen_functions(&wl);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    char *error = NULL;
+    for (int i = 0; i < nfns; i++) {
+        if (!error) {
+            error = wl.errors[i];
+            append(wl.bufs[i].data, wl.bufs[i].len);
+        } else {
+            free(wl.errors[i]);
         }
+        free(wl.bufs[i].data);
     }
+    free(threads);
+    free(wl.fns);
+    free(wl.bufs);
+    free(wl.errors);
 
-    if (contains_div) {
-        gen_div();
+    if (error) {
+        raise_error(error);
     }
+    reserve_output(1);
+    cc->out->data[cc->out->len] = '\0';
+}
 
-    if (global_vars) {
-        if (contains_div) {
-            printf("\n");
-        }
-        for (Obj *obj = prog; obj; obj = obj->next) {
-            if (!obj->is_function) {
-                printf("__addr_%s: .word __global_%s\n", obj->name, obj->name);
+void codegen(Obj *prog, Options *opts, Buffer *buf) {
+    cc->prog = prog;
+    cc->out = buf;
+    reserve_output(1);
+    buf->data[buf->len] = '\0';
+
+    int global_vars = 0;
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function) {
+            if (!obj->fragment) {
+                cc->target->layout_frame(obj, opts);
             }
+        } else {
+            global_vars++;
         }
-        printf("\n");
+    }
+
+    // Only the emission is timed for --stats.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (global_vars) {
+        emit_data(prog, global_vars);
+    }
+
+    cc->target->emit_header(prog, opts);
+    emit_functions(prog, opts->jobs);
+    if (cc->target->emit_runtime) {
+        cc->target->emit_runtime(prog);
+    }
+    cc->out = NULL;
+
+    if (opts->stats) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        int n = count_instructions(buf);
+        fprintf(stderr, "codegen: %d instructions in %.1f ms, %.0f per second\n",
+                n, secs * 1e3, secs > 0 ? n / secs : 0);
     }
 }
@@ -0,0 +1,190 @@
+#define _POSIX_C_SOURCE 200809L
+#include "charmcc.h"
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+Library entry points. A compilation runs with `cc` pointing at its
+Compiler, where the lexer, parser and code generator keep their state,
+and with a jump back here for error() to take, so that a failure frees
+what the compilation allocated and comes back as a return value.
+*/
+
+_Thread_local Compiler *cc;
+
+void charmcc_default_options(Options *opts) {
+    *opts = (Options){
+        .unroll = -1,
+        .vectorize = true,
+        .inline_limit = 32,
+        .movt = true,
+        .jobs = 1,
+        .cache_size = 256L << 20,
+    };
+}
+
+Compiler *charmcc_new(Options *opts) {
+    Compiler *compiler = calloc(1, sizeof(Compiler));
+    compiler->opts = *opts;
+    compiler->mm = new_memmanager();
+    return compiler;
+}
+
+char *charmcc_error(Compiler *compiler) {
+    return compiler->error;
+}
+
+CacheStats charmcc_cache_stats(Compiler *compiler) {
+    return compiler->cache_stats;
+}
+
+void charmcc_free(Compiler *compiler) {
+    free(compiler->error);
+    free_fragments(compiler->fragments);
+    cleanup(compiler->mm);
+    free(compiler);
+}
+
+static void check_options(Options *opts) {
+    cc->target = opts->target ? find_target(opts->target) : &target_arm;
+    if (!cc->target) {
+        error("unknown target %s", opts->target);
+    }
+    if (opts->thumb && cc->target != &target_arm) {
+        error("-mthumb needs --target=arm");
+    }
+    if (opts->object && (cc->target != &target_arm || opts->thumb)) {
+        error("-c only assembles A32 code");
+    }
+    if (opts->jobs < 1) {
+        error("invalid number of jobs %d", opts->jobs);
+    }
+    if (opts->save_ast && (opts->debug || opts->object)) {
+        error("--save-ast cannot be used with --debug or -c");
+    }
+    if (opts->cache && opts->cache_size < 0) {
+        error("invalid cache size %ld", opts->cache_size);
+    }
+    if (!cc->target->vectors) {
+        opts->vectorize = false;
+    }
+}
+
+/*
+Free what the compilation allocated, whether or not it got to the end.
+The arena stays with the Compiler for the next compilation.
+*/
+static void release(Compiler *compiler) {
+    drop_plan(compiler->prog);
+    free_tokens(compiler->window);
+    free_tokens(compiler->spare);
+    reset_memmanager(compiler->mm);
+    free(compiler->asm_text.data);
+    if (compiler->ast_map) {
+        munmap(compiler->ast_map, compiler->ast_size);
+    }
+    compiler->window = NULL;
+    compiler->spare = NULL;
+    compiler->ast_map = NULL;
+    compiler->input = NULL;
+    compiler->asm_text = (Buffer){};
+    compiler->locals = NULL;
+    compiler->globals = NULL;
+    compiler->prog = NULL;
+    compiler->out = NULL;
+    compiler->on_error = NULL;
+}
+
+// Compiles `source`, or if it is NULL the AST file at `path`.
+static void run(Options *opts, char *source, char *path, Buffer *out) {
+    check_options(opts);
+
+    // An AST file's result is not looked up, as it may come from another build.
+    char key[65];
+    bool cached = opts->cache && source;
+    if (cached) {
+        cache_key(opts, source, key);
+        if (cache_load(opts, key, out)) {
+            return;
+        }
+    }
+    int start = out->len;
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    Obj *prog;
+    if (source) {
+        if (opts->incremental && !opts->debug && !opts->save_ast) {
+            plan_reuse(source, opts);
+        }
+        prog = parse(source, cc->mm);
+    } else {
+        prog = load_ast(path);
+    }
+    if (opts->stats) {
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        fprintf(stderr, "%s: %.1f ms\n", source ? "parse" : "load", ms);
+    }
+
+    if (opts->save_ast) {
+        save_ast(prog, out);
+    } else {
+        prog = optimize(prog, opts, cc->mm);
+        if (opts->debug) {
+            debug_ast(prog, out);
+        } else if (opts->object) {
+            // Kept by the Compiler, so that release() frees it if codegen fails
+            codegen(prog, opts, &cc->asm_text);
+            assemble(cc->asm_text.data, out);
+        } else {
+            codegen(prog, opts, out);
+        }
+        commit_fragments(prog, opts);
+    }
+
+    if (cached) {
+        cache_store(opts, key, out->data + start, out->len - start);
+    }
+}
+
+static int compile(Compiler *compiler, char *source, char *path, Buffer *out) {
+    Compiler *outer = cc;
+    cc = compiler;
+    free(compiler->error);
+    compiler->error = NULL;
+
+    // The options of one compilation do not carry over to the next.
+    Options opts = compiler->opts;
+    int len = out->len;
+    jmp_buf on_error;
+    compiler->on_error = &on_error;
+
+    int status = 0;
+    if (setjmp(on_error)) {
+        out->len = len;
+        status = -1;
+    } else {
+        run(&opts, source, path, out);
+    }
+
+    if (out->data) {
+        // Binary output leaves the terminator off
+        if (out->len == out->cap) {
+            out->data = realloc(out->data, ++out->cap);
+        }
+        out->data[out->len] = '\0';
+    }
+    release(compiler);
+    cc = outer;
+    return status;
+}
+
+int charmcc_compile(Compiler *compiler, char *source, Buffer *out) {
+    return compile(compiler, source, NULL, out);
+}
+
+int charmcc_compile_ast(Compiler *compiler, char *path, Buffer *out) {
+    return compile(compiler, NULL, path, out);
+}
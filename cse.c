@@ -0,0 +1,426 @@
+#include "charmcc.h"
+
+/*
+Common subexpression elimination.
+
+Expressions are numbered by structure while walking the function in the
+order codegen evaluates them, so an expression is available wherever an
+identical one was computed on every path before it. Control flow is
+structured, which makes that the dominator tree walk:
+
+- statements in a block dominate the ones after them
+- an `if` condition dominates both branches, which dominate nothing after the `if`
+- a loop condition dominates the body, and the body dominates the increment
+
+Values from before a loop stay available inside it only if nothing in the
+loop changes them.
+
+The occurrence that is evaluated first is rewritten to also save its value in
+a fresh local, `(t = x[i][j])`, and later ones just read `t`.
+
+A value is forgotten when something it reads may change: assigning a variable
+kills expressions reading it, and a store through a pointer or a call kills
+every expression that loads from memory or reads a variable whose address
+escaped.
+
+Constant subexpressions, such as those left behind by unrolling, are folded.
+*/
+
+typedef struct Value Value;
+struct Value {
+    Node *expr;  // Unmodified copy of the expression
+    Node *first; // Occurrence evaluated first, rewritten on reuse
+    Obj *temp;   // Local holding the value, once it has been reused
+    bool memory; // Depends on memory which stores or calls may change
+};
+
+// Set of available values, copied at branches
+typedef struct Avail Avail;
+struct Avail {
+    Avail *next;
+    Value *val;
+};
+
+typedef struct Cse Cse;
+struct Cse {
+    Obj *fn;
+    MemManager *mm;
+    Avail *avail; // Values available at the current point
+    int reused;
+    int folded;
+};
+
+static void cse_stmt(Node *node, Cse *cse);
+static void cse_expr(Node *node, Cse *cse);
+
+// Loads from `var` can be changed by stores through pointers and by calls.
+static bool is_escaped(Obj *var, Cse *cse) {
+    return !var->is_local || addr_taken(cse->fn->body, var);
+}
+
+static bool is_pure(Node *node) {
+    if (node == NULL) {
+        return true;
+    }
+
+    switch (node->kind) {
+    case ND_ASSIGN:
+    case ND_FN_CALL:
+    case ND_INLINE:
+        return false;
+    default:
+        return is_pure(node->lhs) && is_pure(node->rhs);
+    }
+}
+
+static bool reads_var(Node *node, Obj *var) {
+    if (node == NULL) {
+        return false;
+    }
+    if (node->kind == ND_VAR) {
+        return node->var == var;
+    }
+    return reads_var(node->lhs, var) || reads_var(node->rhs, var);
+}
+
+static bool reads_memory(Node *node, Cse *cse) {
+    if (node == NULL) {
+        return false;
+    }
+
+    switch (node->kind) {
+    case ND_VAR:
+        return node->var->type->kind != TY_ARRAY && is_escaped(node->var, cse);
+    case ND_DEREF:
+        if (node->type->kind != TY_ARRAY) {
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return reads_memory(node->lhs, cse) || reads_memory(node->rhs, cse);
+}
+
+// Is it worth keeping the value of `node` in a local to reuse it?
+static bool is_candidate(Node *node) {
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_NEG:
+    case ND_EQ:
+    case ND_NEQ:
+    case ND_LT:
+    case ND_LTE:
+    case ND_DEREF:
+        return is_pure(node) && count_nodes(node) >= 3;
+    default:
+        return false;
+    }
+}
+
+// Like same_expr, but also matches commuted operands.
+static bool same_value(Node *a, Node *b) {
+    if (a->kind != b->kind) {
+        return false;
+    }
+
+    switch (a->kind) {
+    case ND_ADD:
+    case ND_MUL:
+    case ND_EQ:
+    case ND_NEQ:
+        if (same_value(a->lhs, b->rhs) && same_value(a->rhs, b->lhs)) {
+            return true;
+        }
+        // fallthrough
+    case ND_SUB:
+    case ND_DIV:
+    case ND_LT:
+    case ND_LTE:
+        return same_value(a->lhs, b->lhs) && same_value(a->rhs, b->rhs);
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+        return same_value(a->lhs, b->lhs);
+    default:
+        return same_expr(a, b);
+    }
+}
+
+static Value *find_value(Node *node, Cse *cse) {
+    for (Avail *a = cse->avail; a; a = a->next) {
+        if (same_value(a->val->expr, node)) {
+            return a->val;
+        }
+    }
+    return NULL;
+}
+
+static Avail *copy_avail(Avail *list, MemManager *mm) {
+    Avail head = {};
+    Avail *cur = &head;
+    for (Avail *a = list; a; a = a->next) {
+        cur = cur->next = allocate(mm, sizeof(Avail));
+        cur->val = a->val;
+    }
+    return head.next;
+}
+
+static void kill_memory(Cse *cse) {
+    Avail **a = &cse->avail;
+    while (*a) {
+        if ((*a)->val->memory) {
+            *a = (*a)->next;
+        } else {
+            a = &(*a)->next;
+        }
+    }
+}
+
+static void kill_var(Obj *var, Cse *cse) {
+    Avail **a = &cse->avail;
+    while (*a) {
+        if (reads_var((*a)->val->expr, var)) {
+            *a = (*a)->next;
+        } else {
+            a = &(*a)->next;
+        }
+    }
+}
+
+// Forget values which a store to `lhs` may change.
+static void kill_store(Node *lhs, Cse *cse) {
+    if (lhs->kind == ND_VAR) {
+        kill_var(lhs->var, cse);
+        if (!is_escaped(lhs->var, cse)) {
+            return;
+        }
+    }
+    kill_memory(cse);
+}
+
+// Forget values which anything in the subtree may change.
+static void kill_subtree(Node *node, Cse *cse) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->kind == ND_ASSIGN) {
+        kill_store(node->lhs, cse);
+    } else if (node->kind == ND_FN_CALL) {
+        kill_memory(cse);
+    }
+
+    kill_subtree(node->lhs, cse);
+    kill_subtree(node->rhs, cse);
+    kill_subtree(node->condition, cse);
+    kill_subtree(node->consequence, cse);
+    kill_subtree(node->alternative, cse);
+    kill_subtree(node->initialize, cse);
+    kill_subtree(node->increment, cse);
+    for (Node *b = node->body; b; b = b->next) {
+        kill_subtree(b, cse);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        kill_subtree(a, cse);
+    }
+}
+
+static Obj *new_temp(Type *type, Cse *cse) {
+    // An array-valued expression is its address, so keep a pointer to it.
+    if (type->kind == TY_ARRAY) {
+        type = pointer_to(type->base, cse->mm);
+    }
+
+    char *name = allocate(cse->mm, 16);
+    snprintf(name, 16, "__cse%d", cse->reused);
+    return new_local(cse->fn, name, type, cse->mm);
+}
+
+// Rewrite the first occurrence to `(temp = expr)` and a later one to `temp`.
+static void reuse(Value *v, Node *node, Cse *cse) {
+    if (!v->temp) {
+        Node *first = v->first;
+        v->temp = new_temp(first->type, cse);
+        Node *next = first->next;
+
+        Node *expr = allocate(cse->mm, sizeof(Node));
+        *expr = *first;
+        expr->next = NULL;
+
+        *first = (Node){};
+        first->kind = ND_ASSIGN;
+        first->next = next;
+        first->repr = expr->repr;
+        first->type = v->temp->type;
+        first->lhs = new_var(v->temp, expr->repr, cse->mm);
+        first->lhs->type = v->temp->type;
+        first->rhs = expr;
+    }
+
+    *node = (Node){
+        .kind = ND_VAR,
+        .next = node->next,
+        .repr = node->repr,
+        .type = v->temp->type,
+        .var = v->temp,
+    };
+    cse->reused++;
+}
+
+static void cse_expr(Node *node, Cse *cse) {
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+        return;
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_DEREF) {
+            cse_expr(node->lhs->lhs, cse);
+        }
+        cse_expr(node->rhs, cse);
+        kill_store(node->lhs, cse);
+        return;
+    case ND_ADDR:
+        if (node->lhs->kind == ND_DEREF) {
+            cse_expr(node->lhs->lhs, cse);
+        }
+        return;
+    case ND_FN_CALL:
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            cse_expr(arg, cse);
+        }
+        kill_memory(cse);
+        return;
+    case ND_INLINE: {
+        // Returns leave from the middle, so nothing computed inside survives.
+        Avail *before = cse->avail;
+        cse->avail = copy_avail(before, cse->mm);
+        for (Node *n = node->body; n; n = n->next) {
+            cse_stmt(n, cse);
+        }
+        cse->avail = before;
+        kill_subtree(node, cse);
+        return;
+    }
+    default:
+        break;
+    }
+
+    int val;
+    if (eval_const(node, &val)) {
+        *node = (Node){
+            .kind = ND_NUM,
+            .next = node->next,
+            .repr = node->repr,
+            .type = node->type,
+            .val = val,
+        };
+        cse->folded++;
+        return;
+    }
+
+    Node *expr = NULL;
+    if (is_candidate(node)) {
+        Value *v = find_value(node, cse);
+        if (v) {
+            reuse(v, node, cse);
+            return;
+        }
+        expr = copy_node(node, cse->mm);
+    }
+
+    // Operands in the order codegen evaluates them.
+    if (node->rhs) {
+        cse_expr(node->rhs, cse);
+    }
+    if (node->lhs) {
+        cse_expr(node->lhs, cse);
+    }
+
+    if (expr) {
+        Value *v = allocate(cse->mm, sizeof(Value));
+        v->expr = expr;
+        v->first = node;
+        v->memory = reads_memory(expr, cse);
+
+        Avail *a = allocate(cse->mm, sizeof(Avail));
+        a->val = v;
+        a->next = cse->avail;
+        cse->avail = a;
+    }
+}
+
+static void cse_stmt(Node *node, Cse *cse) {
+    switch (node->kind) {
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            cse_stmt(n, cse);
+        }
+        return;
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        cse_expr(node->lhs, cse);
+        return;
+    case ND_IF: {
+        cse_expr(node->condition, cse);
+        Avail *before = cse->avail;
+
+        cse->avail = copy_avail(before, cse->mm);
+        cse_stmt(node->consequence, cse);
+        if (node->alternative) {
+            cse->avail = copy_avail(before, cse->mm);
+            cse_stmt(node->alternative, cse);
+        }
+
+        cse->avail = before;
+        kill_subtree(node->consequence, cse);
+        kill_subtree(node->alternative, cse);
+        return;
+    }
+    case ND_LOOP: {
+        if (node->initialize) {
+            cse_stmt(node->initialize, cse);
+        }
+
+        // Anything changed in a later iteration is not available in this one.
+        kill_subtree(node->condition, cse);
+        kill_subtree(node->consequence, cse);
+        kill_subtree(node->increment, cse);
+        Avail *before = cse->avail;
+
+        cse->avail = copy_avail(before, cse->mm);
+        if (node->condition) {
+            cse_expr(node->condition, cse);
+        }
+        cse_stmt(node->consequence, cse);
+        if (node->increment) {
+            cse_expr(node->increment, cse);
+        }
+
+        cse->avail = before;
+        return;
+    }
+    case ND_VEC_LOOP:
+        // codegen relies on the shape of vector statements
+        kill_subtree(node, cse);
+        return;
+    default:
+        return;
+    }
+}
+
+void eliminate_common_subexprs(Obj *fn, Options *opts, MemManager *mm) {
+    Cse cse = {};
+    cse.fn = fn;
+    cse.mm = mm;
+    cse_stmt(fn->body, &cse);
+
+    if (opts->stats) {
+        fprintf(stderr, "%s: %d common subexpressions eliminated, %d constants folded\n",
+            fn->name, cse.reused, cse.folded);
+    }
+}
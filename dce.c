@@ -0,0 +1,270 @@
+#include "charmcc.h"
+
+/*
+Dead code elimination.
+
+Within a function, statements after one that never completes normally, such
+as a `return`, are dropped, and `if` and loop conditions which are constant
+only keep the code they can reach:
+
+  if (0) a; else b;     ->  b;
+  for (i = 0; 0;) a;    ->  i = 0;
+
+Across the translation unit, only what is reachable from exported roots is
+kept. Every function not declared `static` is a root, since code outside
+the file may call it. Globals are never exported, as the targets emit them
+under local labels, so a global is kept only if a kept function reads or
+writes it, and a static function only if a kept function calls it.
+*/
+
+typedef struct Dce Dce;
+struct Dce {
+    int removed; // unreachable statements dropped
+    int pruned;  // constant conditions resolved
+};
+
+// Can control flow continue with the statement after `node`?
+static bool falls_through(Node *node) {
+    int val;
+
+    switch (node->kind) {
+    case ND_RETURN:
+        return false;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            if (!falls_through(n)) {
+                return false;
+            }
+        }
+        return true;
+    case ND_IF:
+        return !node->alternative
+            || falls_through(node->consequence)
+            || falls_through(node->alternative);
+    case ND_LOOP:
+        // there is no `break`, so only the condition leaves a loop
+        return node->condition && !(eval_const(node->condition, &val) && val);
+    default:
+        return true;
+    }
+}
+
+// Replace `node` with `stmt`, or with an empty block if it is NULL.
+static void replace_stmt(Node *node, Node *stmt) {
+    Node *next = node->next;
+    if (stmt) {
+        *node = *stmt;
+    } else {
+        *node = (Node){.kind = ND_BLOCK, .repr = node->repr};
+    }
+    node->next = next;
+}
+
+static void prune_stmt(Node *node, Dce *dce) {
+    int val;
+
+    switch (node->kind) {
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            prune_stmt(n, dce);
+            if (!falls_through(n) && n->next) {
+                for (Node *dead = n->next; dead; dead = dead->next) {
+                    dce->removed++;
+                }
+                n->next = NULL;
+            }
+        }
+        return;
+    case ND_IF:
+        if (eval_const(node->condition, &val)) {
+            replace_stmt(node, val ? node->consequence : node->alternative);
+            dce->pruned++;
+            prune_stmt(node, dce);
+            return;
+        }
+        prune_stmt(node->consequence, dce);
+        if (node->alternative) {
+            prune_stmt(node->alternative, dce);
+        }
+        return;
+    case ND_LOOP:
+        if (node->condition && eval_const(node->condition, &val) && !val) {
+            replace_stmt(node, node->initialize);
+            dce->pruned++;
+            return;
+        }
+        if (node->initialize) {
+            prune_stmt(node->initialize, dce);
+        }
+        prune_stmt(node->consequence, dce);
+        return;
+    default:
+        return;
+    }
+}
+
+void eliminate_dead_code(Obj *fn, Options *opts, MemManager *mm) {
+    Dce dce = {};
+    prune_stmt(fn->body, &dce);
+
+    if (opts->stats) {
+        fprintf(stderr, "%s: %d unreachable statements removed, %d constant conditions pruned\n",
+            fn->name, dce.removed, dce.pruned);
+    }
+}
+
+/*-----------------
+== Reachability ==
+-----------------*/
+
+/*
+Objects are found by name and marked live through hash tables, as a large
+program has thousands of them and every call and global use looks one up.
+*/
+typedef struct Reach Reach;
+struct Reach {
+    Obj **objs;  // First object of each name, by hash of the name
+    Obj **funcs; // First function of each name, likewise
+    Obj **live;  // Live objects, by hash of the pointer
+    int cap;     // Slots in each table, a power of two
+};
+
+static int name_slot(Obj **table, char *name, int cap) {
+    uint32_t h = 2166136261u;
+    for (char *p = name; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    int i = h & (cap - 1);
+    while (table[i] && strcmp(table[i]->name, name)) {
+        i = (i + 1) & (cap - 1);
+    }
+    return i;
+}
+
+static int live_slot(Obj *obj, Reach *r) {
+    int i = ((uintptr_t)obj >> 4) * 2654435761u & (r->cap - 1);
+    while (r->live[i] && r->live[i] != obj) {
+        i = (i + 1) & (r->cap - 1);
+    }
+    return i;
+}
+
+static bool is_live(Obj *obj, Reach *r) {
+    return r->live[live_slot(obj, r)] != NULL;
+}
+
+static Obj *find_function(char *name, Reach *r) {
+    // NULL if defined in another file
+    return r->funcs[name_slot(r->funcs, name, r->cap)];
+}
+
+// A function or global of the program, by name
+static Obj *find_obj(char *name, Reach *r) {
+    return r->objs[name_slot(r->objs, name, r->cap)];
+}
+
+static void mark_live(Obj *obj, Reach *r);
+
+static void mark_uses(Node *node, Reach *r) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->kind == ND_VAR && !node->var->is_local) {
+        mark_live(node->var, r);
+    } else if (node->kind == ND_FN_CALL) {
+        Obj *fn = find_function(node->func, r);
+        if (fn) {
+            mark_live(fn, r);
+        }
+    }
+
+    mark_uses(node->lhs, r);
+    mark_uses(node->rhs, r);
+    mark_uses(node->condition, r);
+    mark_uses(node->consequence, r);
+    mark_uses(node->alternative, r);
+    mark_uses(node->initialize, r);
+    mark_uses(node->increment, r);
+    for (Node *b = node->body; b; b = b->next) {
+        mark_uses(b, r);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        mark_uses(a, r);
+    }
+}
+
+static void mark_live(Obj *obj, Reach *r) {
+    int slot = live_slot(obj, r);
+    if (r->live[slot]) {
+        return;
+    }
+
+    r->live[slot] = obj;
+    if (obj->fragment) {
+        // Its body is gone or not optimized, but its code used these
+        for (int i = 0; i < obj->fragment->nuses; i++) {
+            Obj *use = find_obj(obj->fragment->uses[i], r);
+            if (use) {
+                mark_live(use, r);
+            }
+        }
+    } else if (obj->is_function) {
+        mark_uses(obj->body, r);
+    }
+}
+
+// Returns `prog` without the static functions and globals nothing exported uses.
+Obj *remove_unreachable(Obj *prog, Options *opts, MemManager *mm) {
+    int nobjs = 0;
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        nobjs++;
+    }
+
+    Reach r = {};
+    r.cap = 16;
+    while (r.cap < nobjs * 2) {
+        r.cap *= 2;
+    }
+    r.objs = allocate(mm, sizeof(Obj *) * r.cap);
+    r.funcs = allocate(mm, sizeof(Obj *) * r.cap);
+    r.live = allocate(mm, sizeof(Obj *) * r.cap);
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        int i = name_slot(r.objs, obj->name, r.cap);
+        if (!r.objs[i]) {
+            r.objs[i] = obj;
+        }
+        i = name_slot(r.funcs, obj->name, r.cap);
+        if (obj->is_function && !r.funcs[i]) {
+            r.funcs[i] = obj;
+        }
+    }
+
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function && !obj->is_static) {
+            mark_live(obj, &r);
+        }
+    }
+
+    int functions = 0;
+    int globals = 0;
+    Obj **obj = &prog;
+    while (*obj) {
+        if (is_live(*obj, &r)) {
+            obj = &(*obj)->next;
+            continue;
+        }
+
+        if ((*obj)->is_function) {
+            functions++;
+        } else {
+            globals++;
+        }
+        *obj = (*obj)->next;
+    }
+
+    if (opts->stats) {
+        fprintf(stderr, "%d unreachable functions and %d unused globals removed\n", functions, globals);
+    }
+    return prog;
+}
@@ -9,24 +9,24 @@ static void debug_nodes(Node *nodes) {
 }
 
 static void debug_binop(char *op, Node *n) {
-    printf("(%s ", op);
+    emit("(%s ", op);
     debug_node(n->lhs);
-    printf(", ");
+    emit(", ");
     debug_node(n->rhs);
-    printf(")");
+    emit(")");
 }
 
 static void debug_unop(char *op, Node *n) {
-    printf("(%s ", op);
+    emit("(%s ", op);
     debug_node(n->lhs);
-    printf(")");
+    emit(")");
 }
 
 static void debug_type(Type *t) {
     if (t == NULL) return;
 
     if (t->kind == TY_PTR) {
-        printf("*");
+        emit("*");
         debug_type(t->base);
     }
 }
@@ -49,14 +49,14 @@ static void debug_node(Node *n) {
         debug_unop("-", n);
         return;
     case ND_ADDR:
-        printf("(addr ");
+        emit("(addr ");
         debug_node(n->lhs);
-        printf(")");
+        emit(")");
         return;
     case ND_DEREF:
-        printf("(deref ");
+        emit("(deref ");
         debug_node(n->lhs);
-        printf(")");
+        emit(")");
         return;
     case ND_EQ:
         debug_binop("==", n);
@@ -71,29 +71,29 @@ static void debug_node(Node *n) {
         debug_binop("<=", n);
         return;
     case ND_NUM:
-        printf("%d", n->val);
+        emit("%d", n->val);
         return;
 
     case ND_ASSIGN:
-        printf("(let ");
+        emit("(let ");
         debug_node(n->lhs);
-        printf(" ");
+        emit(" ");
         debug_node(n->rhs);
-        printf(")");
+        emit(")");
         return;
     case ND_IF:
-        printf("(if ");
+        emit("(if ");
         debug_node(n->condition);
-        printf(" ");
+        emit(" ");
         debug_node(n->consequence);
         if (n->alternative) {
-            printf(" : ");
+            emit(" : ");
             debug_node(n->alternative);
         }
-        printf("); ");
+        emit("); ");
         return;
     case ND_LOOP:
-        printf("(loop ");
+        emit("(loop ");
         if (n->initialize) {
             debug_node(n->initialize);
         }
@@ -104,34 +104,46 @@ static void debug_node(Node *n) {
             debug_node(n->increment);
         }
         debug_node(n->consequence);
-        printf("); ");
+        emit("); ");
+        return;
+    case ND_VEC_LOOP:
+        emit("(vloop ");
+        debug_node(n->condition);
+        debug_node(n->increment);
+        debug_node(n->consequence);
+        emit("); ");
         return;
     case ND_RETURN:
         debug_unop("return", n);
         return;
 
     case ND_BLOCK:
-        printf("{ ");
+        emit("{ ");
         debug_nodes(n->body);
-        printf(" }");
+        emit(" }");
         return;
     case ND_EXPR_STMT:
         debug_node(n->lhs);
-        printf("; ");
+        emit("; ");
         return;
     case ND_VAR:
         if (n->var->type->kind == TY_PTR) {
             debug_type(n->var->type);
         }
-        printf("%s", n->var->name);
+        emit("%s", n->var->name);
         return;
     case ND_FN_CALL:
-        printf("(call %s", n->func);
+        emit("(call %s", n->func);
         for (Node *arg = n->args; arg; arg = arg->next) {
-            printf(" ");
+            emit(" ");
             debug_node(arg);
         }
-        printf(")");
+        emit(")");
+        return;
+    case ND_INLINE:
+        emit("(inline %s ", n->func);
+        debug_nodes(n->body);
+        emit(")");
         return;
     }
 
@@ -140,22 +152,24 @@ static void debug_node(Node *n) {
 
 void debug_fn(Obj *fn) {
     if (fn->locals != NULL) {
-        printf("%s local variables:", fn->name);
+        emit("%s local variables:", fn->name);
         for (Obj *l = fn->locals; l; l = l->next) {
-            printf("  %s", l->name);
+            emit("  %s", l->name);
         }
-        printf("\n");
+        emit("\n");
     }
-    printf("%s :: ", fn->name);
+    emit("%s :: ", fn->name);
 
     debug_nodes(fn->body);
-    printf("\n");
+    emit("\n");
 }
 
-void debug_ast(Obj *prog) {
+void debug_ast(Obj *prog, Buffer *buf) {
+    cc->out = buf;
     for (Obj *fn = prog; fn; fn = fn->next) {
         if (fn->is_function) {
             debug_fn(fn);
         }
     }
+    cc->out = NULL;
 }
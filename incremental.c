@@ -0,0 +1,485 @@
+#include "charmcc.h"
+
+/*
+Incremental compilation: a Compiler with opts.incremental keeps the code of
+each function it generates, and the next compilation reuses it for every
+function whose code would come out the same.
+
+That is decided on the tokens, before parsing. The lexer hands out the
+program's top-level items one by one, and each gets a fingerprint, the
+hash of its source text from its first token to its last. A function's
+code depends on itself, on the globals it names and on the functions it
+calls, whose bodies the inliner may copy in, and on theirs in turn; with
+inlining off, only on the signatures of those it calls. Its key hashes the
+fingerprints of all of those, in program order. Names are matched on the
+tokens alone, so a local that shadows a global still counts the global:
+the dependencies are a superset, never missing one.
+
+A function whose key is unchanged reuses its fragment. Its body is still
+parsed and run through the first optimizer passes if a function that is
+generated may inline it; otherwise the parser skips the body altogether,
+and the fragment stands in for it: the node kinds and the globals its
+optimized body used are kept with the code.
+*/
+
+// Name to pointer, by open addressing, in the compilation's arena.
+// Names not in the map have NULL.
+typedef struct {
+    char **keys;
+    void **vals;
+    int cap;
+    int len;
+} NameMap;
+
+typedef struct Item Item;
+struct Item {
+    char *name;        // Of a function, or NULL for global variables
+    uint8_t fp[32];    // Hash of the item's source text
+    uint8_t sig[32];   // Hash of a function's source text up to its body
+    int *deps;         // Items it names
+    int ndeps;
+    int *closure;      // A function's item, and those its code depends on, in order
+    int nclosure;
+};
+
+typedef struct Reuse Reuse;
+struct Reuse {
+    uint8_t key[32];
+    Fragment *fragment; // Code from last time, if the key is unchanged
+    bool skip;          // Nothing generated inlines it, so its body need not be parsed
+};
+
+struct Plan {
+    NameMap functions;  // Reuse by function name
+    int reused;
+    int skipped;
+    int generated;
+};
+
+static uint32_t hash_name(char *s, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+// The slot for the `len` bytes at `name`, which is either its own or empty.
+static int map_slot(NameMap *m, char *name, int len) {
+    for (int i = hash_name(name, len) & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+        if (!m->keys[i] || (strlen(m->keys[i]) == len && !strncmp(m->keys[i], name, len))) {
+            return i;
+        }
+    }
+}
+
+static void *map_get(NameMap *m, char *name, int len) {
+    return m->cap ? m->vals[map_slot(m, name, len)] : NULL;
+}
+
+// Adds `name`, which must not be there yet.
+static void map_put(NameMap *m, char *name, void *val, MemManager *mm) {
+    if (m->len * 2 >= m->cap) {
+        NameMap old = *m;
+        m->cap = old.cap ? old.cap * 2 : 64;
+        m->keys = allocate(mm, sizeof(char *) * m->cap);
+        m->vals = allocate(mm, sizeof(void *) * m->cap);
+        for (int i = 0; i < old.cap; i++) {
+            if (old.keys[i]) {
+                int j = map_slot(m, old.keys[i], strlen(old.keys[i]));
+                m->keys[j] = old.keys[i];
+                m->vals[j] = old.vals[i];
+            }
+        }
+    }
+    int i = map_slot(m, name, strlen(name));
+    m->keys[i] = name;
+    m->vals[i] = val;
+    m->len++;
+}
+
+static char *token_name(Token *tok, MemManager *mm) {
+    char *name = allocate(mm, tok->len + 1);
+    memcpy(name, tok->loc, tok->len);
+    return name;
+}
+
+// Hashes the source text from `first` to the end of `last`.
+static void hash_range(Token *first, Token *last, uint8_t *digest) {
+    Sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, first->loc, last->loc + last->len - first->loc);
+    sha256_final(&s, digest);
+}
+
+/*
+Lexes the program in `input` item by item, checking that each is what
+the parser will make of it: a function runs up to the brace that closes
+its body, a global declaration up to its semicolon. Adds the names each
+item declares to `names`. Returns the number of items, or -1 if the
+program is too broken to cut up, which the parser will then report.
+*/
+static int split_items(char *input, Item **items, NameMap *names, MemManager *mm) {
+    start_lexer(input);
+    int n = 0, cap = 0;
+    for (Token *tok = next_item(); tok->kind != TK_EOF; tok = next_item()) {
+        if (n == cap) {
+            Item *old = *items;
+            cap = cap ? cap * 2 : 256;
+            *items = allocate(mm, sizeof(Item) * cap);
+            if (n) {
+                memcpy(*items, old, sizeof(Item) * n);
+            }
+        }
+        Item *item = &(*items)[n];
+        *item = (Item){};
+        Token *start = tok;
+
+        int depth = 0;
+        bool body = false;
+        bool init = false;
+        for (;; tok = tok->next) {
+            if (tok->kind == TK_EOF) {
+                return -1;
+            }
+
+            if (tok->kind == TK_IDENT && depth == 0 && !init) {
+                // A declarator's name: one for a function, any number for globals
+                if (body || item->name) {
+                    return -1;
+                }
+                char *name = token_name(tok, mm);
+                if (map_get(names, name, tok->len)) {
+                    return -1;
+                }
+                map_put(names, name, (void *)(intptr_t)(n + 1), mm);
+                if (equal(tok->next, "(")) {
+                    item->name = name;
+                }
+            }
+            if (tok->kind != TK_RESERVED || tok->len != 1) {
+                continue;
+            }
+
+            char c = *tok->loc;
+            if (c == '=' && depth == 0) {
+                init = true;
+            } else if (c == ',' && depth == 0) {
+                init = false;
+            } else if (c == '(' || c == '[' || c == '{') {
+                if (c == '{' && depth == 0) {
+                    hash_range(start, tok, item->sig);
+                    body = true;
+                }
+                depth++;
+            } else if (c == ')' || c == ']' || c == '}') {
+                if (--depth < 0) {
+                    return -1;
+                }
+                if (depth == 0 && body) {
+                    break;
+                }
+            } else if (c == ';' && depth == 0 && !body) {
+                break;
+            }
+        }
+
+        if (body != (item->name != NULL) || tok->next->kind != TK_EOF) {
+            return -1;
+        }
+        hash_range(start, tok, item->fp);
+        n++;
+    }
+    return n;
+}
+
+// The items that the tokens from `tok` on name, other than `idx` itself.
+static void find_deps(Token *tok, Item *items, int idx, NameMap *names, MemManager *mm) {
+    Item *item = &items[idx];
+    int cap = 0;
+    for (; tok->kind != TK_EOF; tok = tok->next) {
+        if (tok->kind != TK_IDENT) {
+            continue;
+        }
+        int dep = (intptr_t)map_get(names, tok->loc, tok->len) - 1;
+        if (dep < 0) {
+            continue;
+        }
+        bool seen = dep == idx;
+        for (int j = 0; j < item->ndeps && !seen; j++) {
+            seen = item->deps[j] == dep;
+        }
+        if (seen) {
+            continue;
+        }
+        if (item->ndeps == cap) {
+            int *old = item->deps;
+            cap = cap ? cap * 2 : 8;
+            item->deps = allocate(mm, sizeof(int) * cap);
+            if (item->ndeps) {
+                memcpy(item->deps, old, sizeof(int) * item->ndeps);
+            }
+        }
+        item->deps[item->ndeps++] = dep;
+    }
+}
+
+// The finalizer of SplitMix64
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(int *)a - *(int *)b;
+}
+
+/*
+Collects the function at `idx` and every item its code depends on into
+its closure, and hashes their fingerprints in program order into `key`.
+Without inlining, only the signatures of the functions it calls matter.
+`mark` is scratch, one int per item, that must not hold `idx + 1`.
+*/
+static void function_key(Item *items, int nitems, int idx, bool inlines, int *mark, uint8_t *key, MemManager *mm) {
+    int *stack = allocate(mm, sizeof(int) * nitems);
+    int *found = allocate(mm, sizeof(int) * nitems);
+    int nfound = 0;
+    int sp = 0;
+    stack[sp++] = idx;
+    mark[idx] = idx + 1;
+    while (sp) {
+        Item *item = &items[stack[--sp]];
+        found[nfound++] = item - items;
+        for (int i = 0; i < item->ndeps; i++) {
+            int dep = item->deps[i];
+            if (mark[dep] != idx + 1) {
+                mark[dep] = idx + 1;
+                // Only functions that may be inlined bring in more
+                if (items[dep].name && inlines) {
+                    stack[sp++] = dep;
+                } else {
+                    found[nfound++] = dep;
+                }
+            }
+        }
+    }
+    qsort(found, nfound, sizeof(int), compare_ints);
+
+    // The closure may be most of the program, so rather than through
+    // SHA-256 item by item, it goes through two lanes of a cheap mix.
+    uint64_t lanes[3] = {0x9e3779b97f4a7c15, 0xc2b2ae3d27d4eb4f, nfound};
+    for (int i = 0; i < nfound; i++) {
+        Item *item = &items[found[i]];
+        bool self = found[i] == idx;
+        uint64_t hash[2];
+        memcpy(hash, item->name && !self && !inlines ? item->sig : item->fp, sizeof(hash));
+        lanes[0] = mix(lanes[0] ^ hash[0] ^ self);
+        lanes[1] = mix(lanes[1] ^ hash[1]);
+    }
+    Sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, lanes, sizeof(lanes));
+    sha256_final(&s, key);
+    items[idx].closure = found;
+    items[idx].nclosure = nfound;
+}
+
+// Decides which functions of the program in `input` reuse their code from last time.
+void plan_reuse(char *input, Options *opts) {
+    MemManager *mm = cc->mm;
+    NameMap names = {};
+    Item *items = NULL;
+    int nitems = split_items(input, &items, &names, mm);
+    if (nitems < 0) {
+        return;
+    }
+
+    NameMap old = {};
+    for (Fragment *frag = cc->fragments; frag; frag = frag->next) {
+        map_put(&old, frag->name, frag, mm);
+    }
+
+    Plan *plan = allocate(mm, sizeof(Plan));
+    int *mark = allocate(mm, sizeof(int) * (nitems + 1));
+    bool *needed = allocate(mm, nitems + 1);
+    Reuse **reuses = allocate(mm, sizeof(Reuse *) * (nitems + 1));
+    // Names may refer to items further on, so this takes a second pass.
+    start_lexer(input);
+    for (int i = 0; i < nitems; i++) {
+        find_deps(next_item(), items, i, &names, mm);
+    }
+    for (int i = 0; i < nitems; i++) {
+        if (!items[i].name) {
+            continue;
+        }
+        Reuse *r = reuses[i] = allocate(mm, sizeof(Reuse));
+        function_key(items, nitems, i, opts->inline_limit > 0, mark, r->key, mm);
+
+        Fragment *frag = map_get(&old, items[i].name, strlen(items[i].name));
+        if (frag && !memcmp(frag->key, r->key, 32)) {
+            r->fragment = frag;
+        }
+        map_put(&plan->functions, items[i].name, r, mm);
+    }
+
+    // Functions generated again need the bodies of all they may inline.
+    for (int i = 0; i < nitems; i++) {
+        if (reuses[i] && !reuses[i]->fragment && opts->inline_limit > 0) {
+            for (int j = 0; j < items[i].nclosure; j++) {
+                needed[items[i].closure[j]] = true;
+            }
+        }
+    }
+    for (int i = 0; i < nitems; i++) {
+        Reuse *r = reuses[i];
+        if (!r) {
+            continue;
+        }
+        if (r->fragment) {
+            plan->reused++;
+            r->skip = !needed[i];
+            plan->skipped += r->skip;
+        } else {
+            plan->generated++;
+        }
+    }
+    cc->plan = plan;
+}
+
+/*
+Called by the parser before the body of `fn`. Gives `fn` its code from
+last time if it has not changed, and returns whether the body need not be
+parsed either.
+*/
+bool reuse_function(Obj *fn) {
+    if (!cc->plan) {
+        return false;
+    }
+    Reuse *r = map_get(&cc->plan->functions, fn->name, strlen(fn->name));
+    if (!r || !r->fragment) {
+        return false;
+    }
+    fn->fragment = r->fragment;
+    return r->skip;
+}
+
+static void add_use(Fragment *frag, char *name, int *cap) {
+    for (int i = 0; i < frag->nuses; i++) {
+        if (!strcmp(frag->uses[i], name)) {
+            return;
+        }
+    }
+    if (frag->nuses == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        frag->uses = realloc(frag->uses, sizeof(char *) * *cap);
+    }
+    frag->uses[frag->nuses++] = strdup(name);
+}
+
+// What remove_unreachable() and the targets' headers need to know about a body
+static void record_body(Node *node, Fragment *frag, int *cap) {
+    for (; node; node = node->next) {
+        frag->kinds |= 1 << node->kind;
+        if (node->kind == ND_VAR && !node->var->is_local) {
+            add_use(frag, node->var->name, cap);
+        } else if (node->kind == ND_FN_CALL) {
+            add_use(frag, node->func, cap);
+        }
+        record_body(node->lhs, frag, cap);
+        record_body(node->rhs, frag, cap);
+        record_body(node->condition, frag, cap);
+        record_body(node->consequence, frag, cap);
+        record_body(node->alternative, frag, cap);
+        record_body(node->initialize, frag, cap);
+        record_body(node->increment, frag, cap);
+        record_body(node->body, frag, cap);
+        record_body(node->args, frag, cap);
+    }
+}
+
+/*
+Keeps the `len` bytes of code at `code` just generated for `fn`. Runs on
+the thread that generated it, and touches nothing but `fn`.
+*/
+void keep_fragment(Obj *fn, char *code, int len) {
+    Reuse *r = cc->plan ? map_get(&cc->plan->functions, fn->name, strlen(fn->name)) : NULL;
+    if (!r) {
+        return;
+    }
+    Fragment *frag = calloc(1, sizeof(Fragment));
+    frag->name = strdup(fn->name);
+    memcpy(frag->key, r->key, 32);
+    frag->code = malloc(len);
+    memcpy(frag->code, code, len);
+    frag->len = len;
+    int cap = 0;
+    record_body(fn->body, frag, &cap);
+    fn->fragment = frag;
+}
+
+static void free_fragment(Fragment *frag) {
+    for (int i = 0; i < frag->nuses; i++) {
+        free(frag->uses[i]);
+    }
+    free(frag->uses);
+    free(frag->code);
+    free(frag->name);
+    free(frag);
+}
+
+void free_fragments(Fragment *frag) {
+    while (frag) {
+        Fragment *next = frag->next;
+        free_fragment(frag);
+        frag = next;
+    }
+}
+
+// After a successful compilation, the fragments of `prog` replace the kept ones.
+void commit_fragments(Obj *prog, Options *opts) {
+    if (!cc->plan) {
+        return;
+    }
+    for (Fragment *frag = cc->fragments; frag; frag = frag->next) {
+        frag->committed = false;
+    }
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->fragment) {
+            fn->fragment->committed = true;
+        }
+    }
+    for (Fragment *frag = cc->fragments, *next; frag; frag = next) {
+        next = frag->next;
+        if (!frag->committed) {
+            free_fragment(frag);
+        }
+    }
+
+    cc->fragments = NULL;
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->fragment) {
+            fn->fragment->next = cc->fragments;
+            cc->fragments = fn->fragment;
+        }
+    }
+
+    if (opts->stats) {
+        fprintf(stderr, "incremental: %d functions reused, %d of them unparsed, %d generated\n",
+                cc->plan->reused, cc->plan->skipped, cc->plan->generated);
+    }
+}
+
+// Ends the compilation's plan, freeing the fragments a failed one made.
+void drop_plan(Obj *prog) {
+    if (!cc->plan) {
+        return;
+    }
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->fragment && !fn->fragment->committed) {
+            free_fragment(fn->fragment);
+            fn->fragment = NULL;
+        }
+    }
+    cc->plan = NULL;
+}
@@ -0,0 +1,275 @@
+#include "charmcc.h"
+
+/*
+Function inlining.
+
+A call to a small function defined in the same file is replaced by a copy of
+the callee's body. Each parameter and local of the callee gets a fresh local
+in the caller, and the arguments are assigned to the parameters in the order
+a call would evaluate them.
+
+  int add(int x, int y) { return x+y; }
+  add(a, 2)  ->  inline { add.x = a; add.y = 2; { return add.x+add.y; } }
+
+A `return` inside the inlined body leaves its value in r0 and jumps to the
+end of the inlined call, where the caller picks it up just as it would after
+a `bl`.
+
+Callees which may end up calling themselves are never inlined. Any other
+callee has its own calls inlined first, so its size is measured, and its
+body copied, as it will be generated; this terminates since the remaining
+call graph has no cycles. A caller stops taking callees once it has grown
+to INLINE_GROWTH times its size, or times the limit if it is smaller, so
+that chains of calls that double at each step cannot blow up the program.
+*/
+
+#define INLINE_GROWTH 4
+
+typedef struct Inliner Inliner;
+struct Inliner {
+    Obj *prog;
+    Obj *fn;
+    Options *opts;
+    MemManager *mm;
+    int inlined;
+    int size;     // Of the caller's body
+    int max_size; // Beyond which it takes no more callees
+};
+
+// Maps the callee's locals to their copies in the caller.
+typedef struct VarMap VarMap;
+struct VarMap {
+    VarMap *next;
+    Obj *from;
+    Obj *to;
+};
+
+static Obj *find_function(char *name, Obj *prog) {
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function && !strcmp(obj->name, name)) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+// Does anything in `node` call `target`, directly or through other functions?
+static bool calls(Node *node, Obj *target, Obj **visited, int *nvisited, Obj *prog) {
+    if (node == NULL) {
+        return false;
+    }
+
+    if (node->kind == ND_FN_CALL) {
+        Obj *callee = find_function(node->func, prog);
+        if (callee == target) {
+            return true;
+        }
+
+        bool seen = false;
+        for (int i = 0; i < *nvisited; i++) {
+            seen |= visited[i] == callee;
+        }
+        if (callee && !seen) {
+            visited[(*nvisited)++] = callee;
+            if (calls(callee->body, target, visited, nvisited, prog)) {
+                return true;
+            }
+        }
+    }
+
+    for (Node *b = node->body; b; b = b->next) {
+        if (calls(b, target, visited, nvisited, prog)) {
+            return true;
+        }
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        if (calls(a, target, visited, nvisited, prog)) {
+            return true;
+        }
+    }
+
+    return calls(node->lhs, target, visited, nvisited, prog)
+        || calls(node->rhs, target, visited, nvisited, prog)
+        || calls(node->condition, target, visited, nvisited, prog)
+        || calls(node->consequence, target, visited, nvisited, prog)
+        || calls(node->alternative, target, visited, nvisited, prog)
+        || calls(node->initialize, target, visited, nvisited, prog)
+        || calls(node->increment, target, visited, nvisited, prog);
+}
+
+static bool is_recursive(Obj *fn, Inliner *in) {
+    int nfuncs = 0;
+    for (Obj *obj = in->prog; obj; obj = obj->next) {
+        nfuncs++;
+    }
+
+    Obj **visited = allocate(in->mm, sizeof(Obj *) * (nfuncs + 1));
+    int nvisited = 0;
+    return calls(fn->body, fn, visited, &nvisited, in->prog);
+}
+
+static int count_args(Node *args) {
+    int n = 0;
+    for (Node *a = args; a; a = a->next) {
+        n++;
+    }
+    return n;
+}
+
+static int count_params(Obj *fn) {
+    int n = 0;
+    for (Obj *var = fn->params; var; var = var->next) {
+        n++;
+    }
+    return n;
+}
+
+static Obj *find_callee(Node *call, Inliner *in) {
+    if (in->opts->inline_limit <= 0) {
+        return NULL;
+    }
+
+    Obj *callee = find_function(call->func, in->prog);
+    // A body an incremental compilation did not parse is not needed here
+    if (!callee || callee == in->fn || !callee->body) {
+        return NULL;
+    }
+
+    if (count_args(call->args) != count_params(callee) || is_recursive(callee, in)) {
+        return NULL;
+    }
+
+    inline_calls(callee, in->prog, in->opts, in->mm);
+    int size = count_nodes(callee->body);
+    if (size > in->opts->inline_limit || in->size + size > in->max_size) {
+        return NULL;
+    }
+    return callee;
+}
+
+static void remap_vars(Node *node, VarMap *map) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->kind == ND_VAR) {
+        for (VarMap *m = map; m; m = m->next) {
+            if (m->from == node->var) {
+                node->var = m->to;
+                break;
+            }
+        }
+    }
+
+    remap_vars(node->lhs, map);
+    remap_vars(node->rhs, map);
+    remap_vars(node->condition, map);
+    remap_vars(node->consequence, map);
+    remap_vars(node->alternative, map);
+    remap_vars(node->initialize, map);
+    remap_vars(node->increment, map);
+    for (Node *b = node->body; b; b = b->next) {
+        remap_vars(b, map);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        remap_vars(a, map);
+    }
+}
+
+// Overwrite `call` with the callee's body, parameters bound to the arguments.
+static void inline_call(Node *call, Obj *callee, Inliner *in) {
+    MemManager *mm = in->mm;
+    in->size -= count_nodes(call);
+
+    VarMap *map = NULL;
+    for (Obj *var = callee->locals; var; var = var->next) {
+        int len = strlen(callee->name) + strlen(var->name) + 2;
+        char *name = allocate(mm, len);
+        snprintf(name, len, "%s.%s", callee->name, var->name);
+
+        VarMap *m = allocate(mm, sizeof(VarMap));
+        m->from = var;
+        m->to = new_local(in->fn, name, var->type, mm);
+        m->next = map;
+        map = m;
+    }
+
+    Node head = {};
+    Node *cur = &head;
+    Node *arg = call->args;
+    for (Obj *param = callee->params; param; param = param->next) {
+        Node *next = arg->next;
+        arg->next = NULL;
+
+        Node *lhs = new_var(param, call->repr, mm);
+        remap_vars(lhs, map);
+        Node *assign = new_binary(ND_ASSIGN, lhs, arg, call->repr, mm);
+        add_type(assign, mm);
+        cur = cur->next = new_expr_stmt(assign, call->repr, mm);
+
+        arg = next;
+    }
+
+    Node *body = copy_node(callee->body, mm);
+    remap_vars(body, map);
+    cur->next = body;
+
+    Node *next = call->next;
+    *call = (Node){
+        .kind = ND_INLINE,
+        .next = next,
+        .repr = call->repr,
+        .type = call->type,
+        .func = call->func,
+        .body = head.next,
+    };
+    in->size += count_nodes(call);
+    in->inlined++;
+}
+
+static void inline_expr(Node *node, Inliner *in) {
+    if (node == NULL) {
+        return;
+    }
+
+    inline_expr(node->lhs, in);
+    inline_expr(node->rhs, in);
+    inline_expr(node->condition, in);
+    inline_expr(node->consequence, in);
+    inline_expr(node->alternative, in);
+    inline_expr(node->initialize, in);
+    inline_expr(node->increment, in);
+    for (Node *b = node->body; b; b = b->next) {
+        inline_expr(b, in);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        inline_expr(a, in);
+    }
+
+    if (node->kind == ND_FN_CALL) {
+        Obj *callee = find_callee(node, in);
+        if (callee) {
+            inline_call(node, callee, in);
+        }
+    }
+}
+
+void inline_calls(Obj *fn, Obj *prog, Options *opts, MemManager *mm) {
+    if (fn->inlined) {
+        return;
+    }
+    fn->inlined = true;
+
+    Inliner in = {};
+    in.prog = prog;
+    in.fn = fn;
+    in.opts = opts;
+    in.mm = mm;
+    in.size = count_nodes(fn->body);
+    in.max_size = (in.size > opts->inline_limit ? in.size : opts->inline_limit) * INLINE_GROWTH;
+    inline_expr(fn->body, &in);
+
+    if (opts->stats) {
+        fprintf(stderr, "%s: %d calls inlined\n", fn->name, in.inlined);
+    }
+}
@@ -1,26 +1,55 @@
 #include "charmcc.h"
 
-// Input string
-static char *current_input;
+// Format a message into a new string.
+static char *format(char *fmt, va_list ap) {
+    va_list copy;
+    va_copy(copy, ap);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
 
-// Reports an error and exits.
+    char *msg = malloc(len + 1);
+    vsnprintf(msg, len + 1, fmt, ap);
+    return msg;
+}
+
+/*
+Fails with `msg`, which is taken over. A compilation run by
+charmcc_compile() stops and returns it; outside of one, it is printed and
+the process exits.
+*/
+void raise_error(char *msg) {
+    if (cc && cc->on_error) {
+        free(cc->error);
+        cc->error = msg;
+        longjmp(*cc->on_error, 1);
+    }
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+// Reports an error.
 void error(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    char *msg = format(fmt, ap);
+    va_end(ap);
+    raise_error(msg);
 }
 
-// Reports an error location and exits.
+// Reports an error location under the line of input it is on.
 static void verror_at(char *loc, char *fmt, va_list ap) {
-    int pos = loc - current_input;
-    fprintf(stderr, "%s\n", current_input);
-    fprintf(stderr, "%*s", pos, ""); // print spaces for pos
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    char *msg = format(fmt, ap);
+    char *line = loc;
+    while (line > cc->input && line[-1] != '\n') {
+        line--;
+    }
+    int width = strcspn(line, "\n");
+    int pos = loc - line;
+    int len = snprintf(NULL, 0, "%.*s\n%*s^ %s", width, line, pos, "", msg);
+    char *full = malloc(len + 1);
+    snprintf(full, len + 1, "%.*s\n%*s^ %s", width, line, pos, "", msg);
+    free(msg);
+    raise_error(full);
 }
 
 void error_at(char *loc, char *fmt, ...) {
@@ -66,9 +95,15 @@ static int get_number(Token *tok) {
     return tok->val;
 }
 
-// Create a token.
+// Create a token, reusing one of an item already parsed if there is one.
 static Token *new_token(TokenKind kind, char *start, char *end) {
-    Token *tok = calloc(1, sizeof(Token));
+    Token *tok = cc->spare;
+    if (tok) {
+        cc->spare = tok->next;
+        *tok = (Token){};
+    } else {
+        tok = calloc(1, sizeof(Token));
+    }
 
     #if DEBUG_ALLOCS
     char *raw = calloc(end - start + 1, sizeof(char));
@@ -113,7 +148,7 @@ static bool is_ident_tail(char c) {
 }
 
 static bool is_keyword(Token *tok) {
-    static char *kw[] = {"return", "if", "else", "for", "while", "int", "sizeof"};
+    static char *kw[] = {"return", "if", "else", "for", "while", "int", "sizeof", "static"};
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
         if (equal(tok, kw[i])) {
             return true;
@@ -122,93 +157,166 @@ static bool is_keyword(Token *tok) {
     return false;
 }
 
-static void convert_keywords(Token *tok) {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
-        if (is_keyword(t)) {
-            t->kind = TK_RESERVED;
+// Lexes the token at `*p`, which is not whitespace, and moves past it.
+static Token *lex_token(char **p) {
+    char *start = *p;
+
+    // Numeric literal
+    if (isdigit((unsigned char)*start)) {
+        Token *tok = new_token(TK_NUM, start, start);
+        tok->val = strtoul(start, p, 10);
+        tok->len = *p - start;
+        return tok;
+    }
+
+    // Identifier or keyword
+    if (is_ident_head(*start)) {
+        do {
+            (*p)++;
+        } while (is_ident_tail(**p));
+        Token *tok = new_token(TK_IDENT, start, *p);
+        if (is_keyword(tok)) {
+            tok->kind = TK_RESERVED;
         }
+        return tok;
     }
+
+    // Punctuation
+    if (startswith(start, "==") || startswith(start, "!=") ||
+        startswith(start, "<=") || startswith(start, ">=")) {
+        *p += 2;
+        return new_token(TK_RESERVED, start, *p);
+    }
+    if (ispunct((unsigned char)*start)) {
+        (*p)++;
+        return new_token(TK_RESERVED, start, *p);
+    }
+
+    error_at(start, "invalid token");
+    return NULL;
 }
 
-// Create linked list of tokens from program source.
-Token *tokenize(char *p) {
-    current_input = p;
-    Token head = {};
-    Token *cur = &head;
+/*
+The lexer is pulled by the parser one top-level item at a time, rather
+than turning the whole program into tokens first: a function runs up to
+the brace that closes its body, a global declaration up to its
+semicolon. The parser's lookahead, including the declarator is_function()
+tries before going back to parse it for real, never leaves an item, so
+only the item being parsed is in tokens. Those are reused for the next
+one; what the AST refers to after that goes through keep_token().
+*/
 
-    while (*p) {
-        // Skip whitespace
-        if (isspace(*p)) {
-            p++;
-            continue;
-        }
+// Starts lexing `input`.
+void start_lexer(char *input) {
+    cc->input = input;
+    cc->lex_pos = input;
+}
 
-        // Numeric literal
-        if (isdigit(*p)) {
-            cur = cur->next = new_token(TK_NUM, p, p);
-            char *q = p;
-            cur->val = strtoul(p, &p, 10);
-            cur->len = p - q;
-            continue;
+// Lexes the next item. Its tokens end with a TK_EOF at the start of the
+// item after it, or at the end of the input if there is none.
+Token *next_item(void) {
+    // The tokens of the last item go back to be reused
+    if (cc->window) {
+        Token *last = cc->window;
+        while (last->next) {
+            last = last->next;
         }
+        last->next = cc->spare;
+        cc->spare = cc->window;
+        cc->window = NULL;
+    }
 
-        // Identifier or keyword
-        if (is_ident_head(*p)) {
-            char *start = p;
-            do {
-                p++;
-            } while (is_ident_tail(*p));
-            cur = cur->next = new_token(TK_IDENT, start, p);
-            continue;
+    char *p = cc->lex_pos;
+    Token **tail = &cc->window;
+    int depth = 0;
+    bool body = false;
+    for (;;) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
         }
 
-        // Punctuation
-        if (startswith(p, "==") || startswith(p, "!=") ||
-            startswith(p, "<=") || startswith(p, ">=")) {
-            cur = cur->next = new_token(TK_RESERVED, p, p+2);
-            p += 2;
+        Token *tok = *tail = lex_token(&p);
+        tail = &tok->next;
+        if (tok->kind != TK_RESERVED || tok->len != 1) {
             continue;
         }
-        if (ispunct(*p)) {
-            cur = cur->next = new_token(TK_RESERVED, p, p+1);
-            p++;
-            continue;
+
+        // A stray closing bracket ends the item too, for the parser to report
+        char c = *tok->loc;
+        if (c == '(' || c == '[' || c == '{') {
+            body |= c == '{' && depth == 0;
+            depth++;
+        } else if (c == ')' || c == ']' || c == '}') {
+            if (--depth < 0 || (depth == 0 && body)) {
+                break;
+            }
+        } else if (c == ';' && depth == 0 && !body) {
+            break;
         }
+    }
 
-        error_at(p, "invalid token");
+    while (isspace((unsigned char)*p)) {
+        p++;
     }
+    *tail = new_token(TK_EOF, p, p);
+    cc->lex_pos = p;
+    return cc->window;
+}
+
+// The TK_EOF after the item being parsed.
+Token *item_end(void) {
+    Token *tok = cc->window;
+    while (tok->next) {
+        tok = tok->next;
+    }
+    return tok;
+}
 
-    cur = cur->next = new_token(TK_EOF, p, p);
-    convert_keywords(head.next);
-    return head.next;
+// A copy of `tok` that outlives its item, in the compilation's arena.
+Token *keep_token(Token *tok) {
+    if (!tok || tok->kept == tok) {
+        return tok;
+    }
+    if (!tok->kept) {
+        Token *copy = allocate(cc->mm, sizeof(Token));
+        *copy = (Token){.kind = tok->kind, .val = tok->val, .loc = tok->loc, .len = tok->len};
+        copy->kept = copy;
+        tok->kept = copy;
+    }
+    return tok->kept;
 }
 
 void free_tokens(Token *tok) {
-    if (tok == NULL) return;
+    // Not recursive, as a large file has far more tokens than the stack has frames
+    while (tok) {
+        Token *next = tok->next;
 
-    free_tokens(tok->next);
+        #if DEBUG_ALLOCS
+        char *raw = calloc(tok->len + 1, sizeof(char));
+        strncpy(raw, tok->loc, tok->len);
+        raw[tok->len] = '\0';
+        fprintf(stderr, "free  token %p ", tok);
+        switch (tok->kind) {
+        case TK_IDENT:
+            fprintf(stderr, "ident %s\n", raw);
+            break;
+        case TK_RESERVED:
+            fprintf(stderr, "reserved %s\n", raw);
+            break;
+        case TK_NUM:
+            fprintf(stderr, "number %s\n", raw);
+            break;
+        case TK_EOF:
+            fprintf(stderr, "eof\n");
+            break;
+        }
+        free(raw);
+        #endif
 
-    #if DEBUG_ALLOCS
-    char *raw = calloc(tok->len + 1, sizeof(char));
-    strncpy(raw, tok->loc, tok->len);
-    raw[tok->len] = '\0';
-    fprintf(stderr, "free  token %p ", tok);
-    switch (tok->kind) {
-    case TK_IDENT:
-        fprintf(stderr, "ident %s\n", raw);
-        break;
-    case TK_RESERVED:
-        fprintf(stderr, "reserved %s\n", raw);
-        break;
-    case TK_NUM:
-        fprintf(stderr, "number %s\n", raw);
-        break;
-    case TK_EOF:
-        fprintf(stderr, "eof\n");
-        break;
+        free(tok);
+        tok = next;
     }
-    free(raw);
-    #endif
-
-    free(tok);
 }
@@ -0,0 +1,77 @@
+#ifndef LIBCHARMCC_H
+#define LIBCHARMCC_H
+
+#include <stdbool.h>
+
+/*
+The compiler as a library. Everything a compilation needs lives in a
+Compiler, so any number of them can run at once on different threads,
+and a failed compilation reports its error instead of exiting.
+
+    Options opts;
+    charmcc_default_options(&opts);
+    Compiler *cc = charmcc_new(&opts);
+    Buffer out = {};
+    if (charmcc_compile(cc, "int main() { return 0; }", &out)) {
+        puts(charmcc_error(cc));
+    }
+    free(out.data);
+    charmcc_free(cc);
+*/
+
+typedef struct Options Options;
+struct Options {
+    char *target;   // --target=NAME, or NULL for arm
+    bool debug;     // --debug: print the AST instead of assembly
+    int unroll;     // --unroll=N: loop unroll factor, or -1 to pick by size
+    bool vectorize; // cleared by --no-vectorize
+    bool stats;     // --stats: report what the optimizer did to stderr
+    int inline_limit; // --inline=N: largest callee body inlined, in nodes
+    bool movt;      // cleared by --no-movt: load wide constants from literal pools
+    bool thumb;     // -mthumb: emit Thumb-2 rather than A32 code
+    bool object;    // -c: assemble into an object file
+    bool save_ast;  // --save-ast: write the parsed program as an AST file
+    bool incremental; // reuse the code of unchanged functions from the last compilation
+    int jobs;       // -jN: threads generating functions
+    char *cache;    // --cache=DIR: reuse results stored under DIR, or NULL
+    long cache_size; // --cache-size=N: bytes the cache may hold
+};
+
+// Growable output buffer, kept NUL-terminated. Owned by the caller.
+typedef struct Buffer Buffer;
+struct Buffer {
+    char *data;
+    int len;
+    int cap;
+};
+
+typedef struct Compiler Compiler;
+
+// What the cache did over a Compiler's compilations so far
+typedef struct CacheStats CacheStats;
+struct CacheStats {
+    int hits;
+    int misses;
+    int evictions; // entries removed to keep the cache under its size
+};
+
+void charmcc_default_options(Options *opts);
+Compiler *charmcc_new(Options *opts);
+// Appends the assembly, object file or AST dump for `source` to `out`.
+// Returns 0, or -1 with `out` left as it was.
+int charmcc_compile(Compiler *cc, char *source, Buffer *out);
+// The same for a program saved by --save-ast in the file at `path`
+int charmcc_compile_ast(Compiler *cc, char *path, Buffer *out);
+// Message of the last failed compilation
+char *charmcc_error(Compiler *cc);
+CacheStats charmcc_cache_stats(Compiler *cc);
+void charmcc_free(Compiler *cc);
+
+// Serves compilations on the Unix socket at `path`. Returns -1 with errno
+// set only if it cannot listen there.
+int charmcc_serve(char *path);
+// Has the server at `path` compile `source`, known to it as `name`, and
+// appends the result to `out`. Returns 0, or -1 with a new message in `error`.
+int charmcc_request(char *path, Options *opts, char *name, char *source, Buffer *out, char **error);
+
+#endif
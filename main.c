@@ -1,35 +1,425 @@
-#include "charmcc.h"
+#define _POSIX_C_SOURCE 200809L
+#include "libcharmcc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-int main(int argc, char **argv) {
-    if (argc < 2 || 3 < argc) {
-        error("%s: invalid number of arguments\n", argv[0]);
-    }
+/*
+The charmcc command: reads the flags, compiles the inputs through the
+library and writes each result to stdout, the -o file or a file named
+after the input.
+
+An input ending in .c is a file to read, one ending in .ast a program
+saved by --save-ast, and anything else the program text itself.
+Several inputs are compiled by a pool of -j threads, each with a
+Compiler of its own that is reused from one input to the next.
+With --cache=DIR, results are looked up in and added to the cache there.
+With --connect=PATH, the server started by --server=PATH compiles them.
+*/
+
+static char *argv0;
+
+static void usage_error(char *fmt, char *arg) {
+    fprintf(stderr, "%s: ", argv0);
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static bool startswith(char *s, char *prefix) {
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
 
-    bool debug = false;
+typedef struct Input Input;
+struct Input {
+    char *path;   // file to read, or NULL if `source` was given as text
+    bool ast;     // `path` is an AST file
     char *source;
-    if (argc == 2) {
-        source = argv[1];
-    } else {
-        if (strlen(argv[1]) == 7 && strncmp(argv[1], "--debug", 7) == 0) {
-            source = argv[2];
-            debug = true;
+    char *output; // where the result goes, or NULL for stdout
+    char *error;  // why it failed
+};
+
+static bool endswith(char *s, char *suffix) {
+    int n = strlen(s), m = strlen(suffix);
+    return n >= m && !strcmp(s + n - m, suffix);
+}
+
+static bool is_number(char *s) {
+    if (!*s) {
+        return false;
+    }
+    for (; *s; s++) {
+        if (*s < '0' || '9' < *s) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a.c becomes a.s, a.o with -c or a.ast with --save-ast.
+static char *output_name(char *path, Options *opts) {
+    char *ext = opts->save_ast ? ".ast" : opts->object ? ".o" : ".s";
+    int len = strrchr(path, '.') - path;
+    char *name = malloc(len + strlen(ext) + 1);
+    sprintf(name, "%.*s%s", len, path, ext);
+    return name;
+}
+
+// Where --server listens or --connect sends the inputs
+static char *server;
+static char *connect_to;
+
+static int parse_args(int argc, char **argv, Options *opts, Input *inputs, char **output) {
+    int ninputs = 0;
+    charmcc_default_options(opts);
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--debug")) {
+            opts->debug = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--stats")) {
+            opts->stats = true;
+            continue;
+        }
+
+        if (startswith(argv[i], "--unroll=")) {
+            opts->unroll = atoi(argv[i] + strlen("--unroll="));
+            continue;
+        }
+
+        if (startswith(argv[i], "--inline=")) {
+            opts->inline_limit = atoi(argv[i] + strlen("--inline="));
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--no-vectorize")) {
+            opts->vectorize = false;
+            continue;
+        }
+
+        if (startswith(argv[i], "--target=")) {
+            opts->target = argv[i] + strlen("--target=");
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-mthumb")) {
+            opts->thumb = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--no-movt")) {
+            opts->movt = false;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--save-ast")) {
+            opts->save_ast = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-c")) {
+            opts->object = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc) {
+                usage_error("-o needs a file name", NULL);
+            }
+            *output = argv[i];
+            continue;
+        }
+
+        if (startswith(argv[i], "-j")) {
+            // -j alone uses every processor; the count may be the next argument
+            char *n = argv[i] + strlen("-j");
+            if (!*n && i + 1 < argc && is_number(argv[i + 1])) {
+                n = argv[++i];
+            }
+            opts->jobs = *n ? atoi(n) : sysconf(_SC_NPROCESSORS_ONLN);
+            if (opts->jobs < 1) {
+                usage_error("invalid number of jobs %s", n);
+            }
+            continue;
+        }
+
+        if (startswith(argv[i], "--cache=")) {
+            opts->cache = argv[i] + strlen("--cache=");
+            continue;
+        }
+
+        if (startswith(argv[i], "--cache-size=")) {
+            // A number of bytes, or of K, M or G
+            char *end;
+            opts->cache_size = strtol(argv[i] + strlen("--cache-size="), &end, 10);
+            int shift = !strcmp(end, "K") ? 10 : !strcmp(end, "M") ? 20 : !strcmp(end, "G") ? 30 : 0;
+            if (*end && !shift) {
+                usage_error("invalid cache size %s", argv[i]);
+            }
+            opts->cache_size <<= shift;
+            continue;
+        }
+
+        if (startswith(argv[i], "--server=")) {
+            server = argv[i] + strlen("--server=");
+            continue;
+        }
+
+        if (startswith(argv[i], "--connect=")) {
+            connect_to = argv[i] + strlen("--connect=");
+            continue;
+        }
+
+        if (startswith(argv[i], "--")) {
+            usage_error("invalid flag %s", argv[i]);
+        }
+
+        Input *in = &inputs[ninputs++];
+        if (endswith(argv[i], ".c") || endswith(argv[i], ".ast")) {
+            in->path = argv[i];
+            in->ast = endswith(argv[i], ".ast");
         } else {
-            error("%s: invalid flag %s\n", argv[0], argv[1]);
+            in->source = argv[i];
+        }
+    }
+
+    if (server) {
+        if (ninputs || connect_to) {
+            usage_error("--server takes no inputs", NULL);
+        }
+        return 0;
+    }
+    if (ninputs == 0) {
+        usage_error("invalid number of arguments", NULL);
+    }
+    if (connect_to) {
+        if (opts->cache) {
+            usage_error("--connect cannot be used with --cache", NULL);
+        }
+        // The server would print them to its own stderr
+        if (opts->stats) {
+            usage_error("--connect cannot be used with --stats", NULL);
+        }
+        for (int i = 0; i < ninputs; i++) {
+            if (inputs[i].ast) {
+                usage_error("--connect cannot compile %s", inputs[i].path);
+            }
         }
     }
+    if (ninputs > 1) {
+        for (int i = 0; i < ninputs; i++) {
+            if (!inputs[i].path) {
+                usage_error("program text must be the only input", NULL);
+            }
+        }
+        if (*output) {
+            usage_error("-o needs a single input", NULL);
+        }
+        if (opts->debug) {
+            usage_error("--debug needs a single input", NULL);
+        }
+    }
+    // Binary output of program text goes to a file
+    if ((opts->object || opts->save_ast) && !*output && !inputs[0].path) {
+        usage_error("%s needs -o", opts->object ? "-c" : "--save-ast");
+    }
 
-    MemManager *mm = new_memmanager();
-    Token *tok = tokenize(source);
-    Obj *prog = parse(tok, mm);
+    for (int i = 0; i < ninputs; i++) {
+        if (*output) {
+            inputs[i].output = *output;
+        } else if (inputs[i].path && !opts->debug) {
+            inputs[i].output = output_name(inputs[i].path, opts);
+        }
+    }
+    return ninputs;
+}
 
-    if (debug) {
-        debug_ast(prog);
+// Formats a message about `arg` into a new string.
+static char *message(char *fmt, char *arg) {
+    int len = snprintf(NULL, 0, fmt, arg);
+    char *msg = malloc(len + 1);
+    snprintf(msg, len + 1, fmt, arg);
+    return msg;
+}
+
+// Read the whole file at `path` into a new NUL-terminated string.
+static char *read_file(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    Buffer buf = {};
+    for (;;) {
+        if (buf.cap - buf.len < 4096) {
+            buf.cap = buf.cap ? buf.cap * 2 : 8192;
+            buf.data = realloc(buf.data, buf.cap);
+        }
+        ssize_t n = read(fd, buf.data + buf.len, buf.cap - buf.len - 1);
+        if (n < 0) {
+            free(buf.data);
+            close(fd);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        buf.len += n;
+    }
+    close(fd);
+    buf.data[buf.len] = '\0';
+    return buf.data;
+}
+
+// Write the buffer to `path`, or to stdout if it is NULL, in one go.
+static int write_output(Buffer *buf, char *path) {
+    int fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    if (fd < 0) {
+        return -1;
+    }
+    for (int done = 0; done < buf->len;) {
+        ssize_t n = write(fd, buf->data + done, buf->len - done);
+        if (n < 0) {
+            if (path) {
+                close(fd);
+            }
+            return -1;
+        }
+        done += n;
+    }
+    if (path && close(fd)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void compile_input(Compiler *compiler, Options *opts, Input *in, Buffer *out) {
+    out->len = 0;
+    if (connect_to) {
+        // The server knows program text given as an argument as "-"
+        if (in->path && !(in->source = read_file(in->path))) {
+            in->error = strdup(strerror(errno));
+            return;
+        }
+        int status = charmcc_request(connect_to, opts, in->path ? in->path : "-", in->source, out, &in->error);
+        if (in->path) {
+            free(in->source);
+        }
+        if (status) {
+            return;
+        }
+    } else if (in->ast) {
+        if (charmcc_compile_ast(compiler, in->path, out)) {
+            in->error = strdup(charmcc_error(compiler));
+            return;
+        }
     } else {
-        codegen(prog);
+        if (in->path && !(in->source = read_file(in->path))) {
+            in->error = strdup(strerror(errno));
+            return;
+        }
+        int status = charmcc_compile(compiler, in->source, out);
+        if (in->path) {
+            free(in->source);
+        }
+        if (status) {
+            in->error = strdup(charmcc_error(compiler));
+            return;
+        }
+    }
+    if (write_output(out, in->output)) {
+        in->error = message("cannot write %s", in->output ? in->output : "output");
     }
+}
 
-    free_tokens(tok);
-    cleanup(mm);
+typedef struct Batch Batch;
+struct Batch {
+    Options *opts;
+    Input *inputs;
+    int ninputs;
+    atomic_int next; // first input not yet taken by a worker
+    atomic_int hits, misses, evictions;
+};
 
-    return 0;
+// Takes inputs off the batch until there are none left.
+static void *worker(void *arg) {
+    Batch *batch = arg;
+    Compiler *compiler = charmcc_new(batch->opts);
+    Buffer out = {};
+    for (int i; (i = atomic_fetch_add(&batch->next, 1)) < batch->ninputs;) {
+        compile_input(compiler, batch->opts, &batch->inputs[i], &out);
+    }
+    CacheStats stats = charmcc_cache_stats(compiler);
+    batch->hits += stats.hits;
+    batch->misses += stats.misses;
+    batch->evictions += stats.evictions;
+    free(out.data);
+    charmcc_free(compiler);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    argv0 = argv[0];
+    Options opts;
+    Input *inputs = calloc(argc, sizeof(Input));
+    char *output = NULL;
+    int ninputs = parse_args(argc, argv, &opts, inputs, &output);
+    if (server) {
+        charmcc_serve(server);
+        fprintf(stderr, "%s: cannot serve on %s: %s\n", argv0, server, strerror(errno));
+        return 1;
+    }
+
+    // With several inputs -j runs that many of them at once, each on one thread.
+    int nthreads = 1;
+    if (ninputs > 1) {
+        nthreads = opts.jobs < ninputs ? opts.jobs : ninputs;
+        opts.jobs = 1;
+    }
+
+    Batch batch = {.opts = &opts, .inputs = inputs, .ninputs = ninputs};
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &batch)) {
+            usage_error("cannot create threads", NULL);
+        }
+    }
+    worker(&batch);
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (opts.stats && opts.cache) {
+        fprintf(stderr, "cache: %d hits, %d misses, %d evicted\n",
+                (int)batch.hits, (int)batch.misses, (int)batch.evictions);
+    }
+
+    // Report failures in the order the inputs were given.
+    int status = 0;
+    for (int i = 0; i < ninputs; i++) {
+        Input *in = &inputs[i];
+        if (in->error) {
+            if (in->path) {
+                // Keep a source line and its marker lined up
+                char *sep = strchr(in->error, '\n') ? ":\n" : ": ";
+                fprintf(stderr, "%s%s%s\n", in->path, sep, in->error);
+            } else {
+                fprintf(stderr, "%s\n", in->error);
+            }
+            free(in->error);
+            status = 1;
+        }
+        if (in->output != output) {
+            free(in->output);
+        }
+    }
+    free(threads);
+    free(inputs);
+    return status;
 }
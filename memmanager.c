@@ -3,14 +3,29 @@
 /*
 A linked list where the head keeps track of the tail for fast append.
 Each element of the list is a pointer which needs to be freed before the program can exit.
+
+Objects from allocate() are instead carved out of chunks owned by the head,
+which reset_memmanager() keeps for the next compilation rather than handing
+back to malloc, so a compiler that runs many times stops allocating once
+its chunks are big enough.
 */
+
+#define CHUNK_SIZE (64 * 1024)
+
+struct Chunk {
+    Chunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
 MemManager *new_memmanager() {
     MemManager *mm = calloc(1, sizeof(MemManager));
     return mm;
 }
 
 void register_obj(MemManager *mm, void *obj) {
-    MemManager *next = calloc(1, sizeof(MemManager));
+    MemManager *next = allocate(mm, sizeof(MemManager));
     next->obj = obj;
 
     if (mm->tail == NULL) {
@@ -23,38 +38,71 @@ void register_obj(MemManager *mm, void *obj) {
     mm->tail = next;
 }
 
+// Makes a chunk with room for `size` bytes current, reusing a spare one if it fits.
+static Chunk *new_chunk(MemManager *mm, size_t size) {
+    Chunk *chunk = mm->spare;
+    if (chunk && chunk->size >= size) {
+        mm->spare = chunk->next;
+    } else {
+        if (size < CHUNK_SIZE) {
+            size = CHUNK_SIZE;
+        }
+        chunk = malloc(sizeof(Chunk) + size);
+        chunk->size = size;
+    }
+    chunk->used = 0;
+    chunk->next = mm->chunks;
+    mm->chunks = chunk;
+    return chunk;
+}
+
 void *allocate(MemManager *mm, size_t size) {
-    void *obj = calloc(1, size);
-    register_obj(mm, obj);
+    size_t align = _Alignof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    Chunk *chunk = mm->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = new_chunk(mm, size);
+    }
+    void *obj = chunk->data + chunk->used;
+    chunk->used += size;
+    memset(obj, 0, size);
     return obj;
 }
 
 /*
-Frees each element of the list and the root MemManager.
+Frees each registered object and keeps the chunks as spares, leaving `mm`
+empty and ready for the next compilation.
 */
-void cleanup(MemManager *mm) {
-    if (mm == NULL) return;
-    if (mm->obj != NULL) {
+void reset_memmanager(MemManager *mm) {
+    for (MemManager *node = mm->next; node; node = node->next) {
         #if DEBUG_ALLOCS
-        printf("free %p\n", mm->obj);
-        #endif
-        free(mm->obj);
-        #if DEBUG_ALLOCS
-        mm->obj = NULL;
+        printf("free %p\n", node->obj);
         #endif
+        free(node->obj);
     }
-    if (mm->next != NULL) {
-        cleanup(mm->next);
-        free(mm->next);
-        #if DEBUG_ALLOCS
-        mm->next = NULL;
-        #endif
+    mm->next = mm->tail = NULL;
+
+    while (mm->chunks) {
+        Chunk *chunk = mm->chunks;
+        mm->chunks = chunk->next;
+        chunk->next = mm->spare;
+        mm->spare = chunk;
     }
-    if (mm->tail != NULL) {
-        // free root
-        free(mm);
-        #if DEBUG_ALLOCS
-        mm->tail = NULL;
-        #endif
+}
+
+/*
+Frees each element of the list, the chunks and the root MemManager.
+Walks the lists iteratively, as big programs register far more objects than
+the stack has room for frames.
+*/
+void cleanup(MemManager *mm) {
+    if (mm == NULL) return;
+    reset_memmanager(mm);
+    while (mm->spare) {
+        Chunk *chunk = mm->spare;
+        mm->spare = chunk->next;
+        free(chunk);
     }
+    free(mm);
 }
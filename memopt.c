@@ -0,0 +1,527 @@
+#include "charmcc.h"
+
+/*
+Memory optimization for locals.
+
+Only scalar locals are considered, and only in functions which never take
+the address of one. Nothing but a direct assignment can change them then,
+so their stack slots behave like registers.
+
+Forwarding walks the function forward, remembering which of them hold a
+literal or a copy of another one. Later reads are replaced by that value,
+so `int x=1; return x+1;` becomes `int x=1; return 1+1;`.
+
+Dead store elimination walks backward computing which of them are live. An
+assignment to a variable that is not read again before being overwritten
+or the function returning is replaced by its right-hand side, which is
+dropped altogether when it has no side effects.
+
+Locals which are no longer mentioned at all are removed from the function,
+which shrinks its stack frame.
+*/
+
+typedef struct MemOpt MemOpt;
+struct MemOpt {
+    Obj *fn;
+    MemManager *mm;
+
+    // Tracked locals, identified by their index in this array
+    Obj **vars;
+    int nvars;
+
+    // Live after a `return`: nothing in the function itself, or what is
+    // live after the inlined call it belongs to
+    bool *ret;
+
+    int forwarded;
+    int removed;
+};
+
+static int var_index(Obj *var, MemOpt *m) {
+    for (int i = 0; i < m->nvars; i++) {
+        if (m->vars[i] == var) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool is_tracked(Node *node, MemOpt *m) {
+    return node->kind == ND_VAR && var_index(node->var, m) >= 0;
+}
+
+static bool has_side_effects(Node *node) {
+    if (node == NULL) {
+        return false;
+    }
+
+    switch (node->kind) {
+    case ND_ASSIGN:
+    case ND_FN_CALL:
+    case ND_INLINE:
+        return true;
+    default:
+        return has_side_effects(node->lhs) || has_side_effects(node->rhs);
+    }
+}
+
+// Overwrite `node` with a copy of `with`, keeping its place in any list.
+static void replace_node(Node *node, Node *with) {
+    Node *next = node->next;
+    *node = *with;
+    node->next = next;
+}
+
+/*-------------
+== Forwarding ==
+-------------*/
+
+// Known value of each tracked variable, ND_NUM or a tracked ND_VAR, or NULL
+typedef Node **Facts;
+
+static Facts copy_facts(Facts facts, MemOpt *m) {
+    Facts copy = allocate(m->mm, sizeof(Node *) * (m->nvars + 1));
+    memcpy(copy, facts, sizeof(Node *) * m->nvars);
+    return copy;
+}
+
+// Forget what is known about `var`, including copies of it.
+static void forget(Facts facts, Obj *var, MemOpt *m) {
+    int i = var_index(var, m);
+    if (i < 0) {
+        return;
+    }
+
+    facts[i] = NULL;
+    for (int j = 0; j < m->nvars; j++) {
+        if (facts[j] && facts[j]->kind == ND_VAR && facts[j]->var == var) {
+            facts[j] = NULL;
+        }
+    }
+}
+
+static void forget_assigned(Facts facts, Node *node, MemOpt *m) {
+    for (int i = 0; i < m->nvars; i++) {
+        if (assigns_var(node, m->vars[i])) {
+            forget(facts, m->vars[i], m);
+        }
+    }
+}
+
+// Keep only what is known on both paths.
+static void meet(Facts facts, Facts other, MemOpt *m) {
+    for (int i = 0; i < m->nvars; i++) {
+        if (facts[i] && !(other[i] && same_expr(facts[i], other[i]))) {
+            facts[i] = NULL;
+        }
+    }
+}
+
+static void forward_stmt(Node *node, Facts facts, MemOpt *m);
+
+static void forward_expr(Node *node, Facts facts, MemOpt *m) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_VAR: {
+        int i = var_index(node->var, m);
+        if (i >= 0 && facts[i]) {
+            Type *type = node->type;
+            replace_node(node, facts[i]);
+            node->type = type;
+            m->forwarded++;
+        }
+        return;
+    }
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_DEREF) {
+            forward_expr(node->lhs->lhs, facts, m);
+        }
+        forward_expr(node->rhs, facts, m);
+        if (node->lhs->kind != ND_VAR) {
+            return;
+        }
+
+        forget(facts, node->lhs->var, m);
+        int i = var_index(node->lhs->var, m);
+        if (i < 0) {
+            return;
+        }
+
+        Node *val = node->rhs;
+        int c;
+        if (eval_const(val, &c)) {
+            facts[i] = new_num(c, val->repr, m->mm);
+            facts[i]->type = val->type;
+        } else if (is_tracked(val, m) && val->var != node->lhs->var) {
+            facts[i] = copy_node(val, m->mm);
+        }
+        return;
+    case ND_ADDR:
+        if (node->lhs->kind == ND_DEREF) {
+            forward_expr(node->lhs->lhs, facts, m);
+        }
+        return;
+    case ND_FN_CALL:
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            forward_expr(arg, facts, m);
+        }
+        return;
+    case ND_INLINE: {
+        // Returns leave from the middle, so only keep what the body never changes.
+        Facts inner = copy_facts(facts, m);
+        for (Node *n = node->body; n; n = n->next) {
+            forward_stmt(n, inner, m);
+        }
+        forget_assigned(facts, node, m);
+        return;
+    }
+    default:
+        // operands in the order codegen evaluates them
+        forward_expr(node->rhs, facts, m);
+        forward_expr(node->lhs, facts, m);
+        return;
+    }
+}
+
+static void forward_stmt(Node *node, Facts facts, MemOpt *m) {
+    switch (node->kind) {
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            forward_stmt(n, facts, m);
+        }
+        return;
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        forward_expr(node->lhs, facts, m);
+        return;
+    case ND_IF: {
+        forward_expr(node->condition, facts, m);
+        Facts other = copy_facts(facts, m);
+        forward_stmt(node->consequence, facts, m);
+        if (node->alternative) {
+            forward_stmt(node->alternative, other, m);
+        }
+        meet(facts, other, m);
+        return;
+    }
+    case ND_LOOP:
+        if (node->initialize) {
+            forward_stmt(node->initialize, facts, m);
+        }
+
+        // Only what no iteration changes holds at the top of the loop.
+        forget_assigned(facts, node, m);
+
+        Facts inner = copy_facts(facts, m);
+        if (node->condition) {
+            forward_expr(node->condition, inner, m);
+        }
+        forward_stmt(node->consequence, inner, m);
+        if (node->increment) {
+            forward_expr(node->increment, inner, m);
+        }
+        return;
+    case ND_VEC_LOOP:
+        forget_assigned(facts, node, m);
+        return;
+    default:
+        return;
+    }
+}
+
+/*-------------------------
+== Dead Store Elimination ==
+-------------------------*/
+
+// Whether each tracked variable may be read before it is next assigned
+typedef bool *Live;
+
+static Live copy_live(Live live, MemOpt *m) {
+    Live copy = allocate(m->mm, m->nvars + 1);
+    memcpy(copy, live, m->nvars);
+    return copy;
+}
+
+static void union_live(Live live, Live other, MemOpt *m) {
+    for (int i = 0; i < m->nvars; i++) {
+        live[i] |= other[i];
+    }
+}
+
+static bool same_live(Live a, Live b, MemOpt *m) {
+    return memcmp(a, b, m->nvars) == 0;
+}
+
+// Mark every tracked variable mentioned in the subtree as live.
+static void use_all(Node *node, Live live, MemOpt *m) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->kind == ND_VAR) {
+        int i = var_index(node->var, m);
+        if (i >= 0) {
+            live[i] = true;
+        }
+    }
+
+    use_all(node->lhs, live, m);
+    use_all(node->rhs, live, m);
+    use_all(node->condition, live, m);
+    use_all(node->consequence, live, m);
+    use_all(node->alternative, live, m);
+    use_all(node->initialize, live, m);
+    use_all(node->increment, live, m);
+    for (Node *b = node->body; b; b = b->next) {
+        use_all(b, live, m);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        use_all(a, live, m);
+    }
+}
+
+static void live_expr(Node *node, Live live, bool apply, MemOpt *m);
+static void live_stmts(Node *stmt, Live live, bool apply, MemOpt *m);
+
+// Arguments are evaluated first to last, so visit them last to first.
+static void live_args(Node *arg, Live live, bool apply, MemOpt *m) {
+    if (arg) {
+        live_args(arg->next, live, apply, m);
+        live_expr(arg, live, apply, m);
+    }
+}
+
+/*
+Update `live` from the point after `node` to the point before it.
+With `apply`, assignments to variables that are dead afterwards are removed.
+*/
+static void live_expr(Node *node, Live live, bool apply, MemOpt *m) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_VAR: {
+        int i = var_index(node->var, m);
+        if (i >= 0) {
+            live[i] = true;
+        }
+        return;
+    }
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_VAR) {
+            int i = var_index(node->lhs->var, m);
+            if (i >= 0) {
+                if (apply && !live[i]) {
+                    // The value of the assignment is still its right-hand side.
+                    replace_node(node, node->rhs);
+                    m->removed++;
+                    live_expr(node, live, apply, m);
+                    return;
+                }
+                live[i] = false;
+            }
+            live_expr(node->rhs, live, apply, m);
+            return;
+        }
+        live_expr(node->rhs, live, apply, m);
+        live_expr(node->lhs->lhs, live, apply, m);
+        return;
+    case ND_ADDR:
+        if (node->lhs->kind == ND_DEREF) {
+            live_expr(node->lhs->lhs, live, apply, m);
+        }
+        return;
+    case ND_FN_CALL:
+        live_args(node->args, live, apply, m);
+        return;
+    case ND_INLINE: {
+        bool *ret = m->ret;
+        m->ret = copy_live(live, m);
+        live_stmts(node->body, live, apply, m);
+        m->ret = ret;
+        return;
+    }
+    default:
+        live_expr(node->lhs, live, apply, m);
+        live_expr(node->rhs, live, apply, m);
+        return;
+    }
+}
+
+static void live_stmt(Node *node, Live live, bool apply, MemOpt *m);
+
+static void live_stmts(Node *stmt, Live live, bool apply, MemOpt *m) {
+    if (stmt) {
+        live_stmts(stmt->next, live, apply, m);
+        live_stmt(stmt, live, apply, m);
+    }
+}
+
+static void live_loop(Node *node, Live live, bool apply, MemOpt *m) {
+    Live exit = copy_live(live, m);
+
+    // Live at the top of the loop, grown until it stops changing
+    Live head = copy_live(exit, m);
+    memset(head, 0, m->nvars);
+    for (;;) {
+        Live next = copy_live(head, m);
+        live_expr(node->increment, next, false, m);
+        live_stmt(node->consequence, next, false, m);
+        union_live(next, exit, m);
+        live_expr(node->condition, next, false, m);
+        if (same_live(next, head, m)) {
+            break;
+        }
+        head = next;
+    }
+
+    if (apply) {
+        Live body = copy_live(head, m);
+        live_expr(node->increment, body, true, m);
+        live_stmt(node->consequence, body, true, m);
+        union_live(body, exit, m);
+        live_expr(node->condition, body, true, m);
+    }
+
+    memcpy(live, head, m->nvars);
+    if (node->initialize) {
+        live_stmt(node->initialize, live, apply, m);
+    }
+}
+
+static void live_stmt(Node *node, Live live, bool apply, MemOpt *m) {
+    switch (node->kind) {
+    case ND_BLOCK:
+        live_stmts(node->body, live, apply, m);
+        return;
+    case ND_EXPR_STMT:
+        live_expr(node->lhs, live, apply, m);
+        if (apply && !has_side_effects(node->lhs)) {
+            // nothing left worth evaluating
+            Node *next = node->next;
+            *node = (Node){.kind = ND_BLOCK, .repr = node->repr, .next = next};
+        }
+        return;
+    case ND_RETURN:
+        memcpy(live, m->ret, m->nvars);
+        live_expr(node->lhs, live, apply, m);
+        return;
+    case ND_IF: {
+        Live other = copy_live(live, m);
+        live_stmt(node->consequence, live, apply, m);
+        if (node->alternative) {
+            live_stmt(node->alternative, other, apply, m);
+        }
+        union_live(live, other, m);
+        live_expr(node->condition, live, apply, m);
+        return;
+    }
+    case ND_LOOP:
+        live_loop(node, live, apply, m);
+        return;
+    case ND_VEC_LOOP:
+        use_all(node, live, m);
+        return;
+    default:
+        return;
+    }
+}
+
+/*-------------------
+== Unused Locals ==
+-------------------*/
+
+static bool mentions(Node *node, Obj *var) {
+    if (node == NULL) {
+        return false;
+    }
+
+    if (node->kind == ND_VAR && node->var == var) {
+        return true;
+    }
+
+    for (Node *b = node->body; b; b = b->next) {
+        if (mentions(b, var)) {
+            return true;
+        }
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        if (mentions(a, var)) {
+            return true;
+        }
+    }
+
+    return mentions(node->lhs, var)
+        || mentions(node->rhs, var)
+        || mentions(node->condition, var)
+        || mentions(node->consequence, var)
+        || mentions(node->alternative, var)
+        || mentions(node->initialize, var)
+        || mentions(node->increment, var);
+}
+
+static int locals_size(Obj *fn) {
+    int size = 0;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        size += var->type->size;
+    }
+    return size;
+}
+
+// Drop locals that are no longer mentioned. Parameters always keep a slot.
+static int drop_unused_locals(Obj *fn) {
+    int dropped = 0;
+    Obj **var = &fn->locals;
+    while (*var && *var != fn->params) {
+        if (!mentions(fn->body, *var)) {
+            *var = (*var)->next;
+            dropped++;
+        } else {
+            var = &(*var)->next;
+        }
+    }
+    return dropped;
+}
+
+void optimize_locals(Obj *fn, Options *opts, MemManager *mm) {
+    MemOpt m = {};
+    m.fn = fn;
+    m.mm = mm;
+
+    int nlocals = 0;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        nlocals++;
+    }
+    m.vars = allocate(mm, sizeof(Obj *) * (nlocals + 1));
+    for (Obj *var = fn->locals; var; var = var->next) {
+        if (var->type->kind == TY_ARRAY) {
+            continue;
+        }
+        if (addr_taken(fn->body, var)) {
+            // Pointer arithmetic from it may reach its neighbours in the frame.
+            m.nvars = 0;
+            break;
+        }
+        m.vars[m.nvars++] = var;
+    }
+
+    int size_before = locals_size(fn);
+
+    Facts facts = allocate(mm, sizeof(Node *) * (m.nvars + 1));
+    forward_stmt(fn->body, facts, &m);
+
+    m.ret = allocate(mm, m.nvars + 1);
+    Live live = allocate(mm, m.nvars + 1);
+    live_stmt(fn->body, live, true, &m);
+
+    int dropped = drop_unused_locals(fn);
+
+    if (opts->stats) {
+        fprintf(stderr, "%s: %d loads forwarded, %d dead stores removed, %d locals dropped (%d -> %d bytes)\n",
+            fn->name, m.forwarded, m.removed, dropped, size_before, locals_size(fn));
+    }
+}
@@ -0,0 +1,532 @@
+#include "charmcc.h"
+
+static Node *copy_list(Node *list, MemManager *mm) {
+    Node head = {};
+    Node *cur = &head;
+    for (Node *n = list; n; n = n->next) {
+        cur = cur->next = copy_node(n, mm);
+    }
+    return head.next;
+}
+
+/*
+Deep copy of a subtree.
+Types, variables, and tokens are shared with the original.
+*/
+Node *copy_node(Node *node, MemManager *mm) {
+    if (node == NULL) {
+        return NULL;
+    }
+
+    Node *copy = allocate(mm, sizeof(Node));
+    *copy = *node;
+    copy->next = NULL;
+    copy->lhs = copy_node(node->lhs, mm);
+    copy->rhs = copy_node(node->rhs, mm);
+    copy->condition = copy_node(node->condition, mm);
+    copy->consequence = copy_node(node->consequence, mm);
+    copy->alternative = copy_node(node->alternative, mm);
+    copy->initialize = copy_node(node->initialize, mm);
+    copy->increment = copy_node(node->increment, mm);
+    copy->body = copy_list(node->body, mm);
+    copy->args = copy_list(node->args, mm);
+    return copy;
+}
+
+// Number of nodes in a subtree, used as a rough estimate of code size.
+int count_nodes(Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int n = 1
+        + count_nodes(node->lhs)
+        + count_nodes(node->rhs)
+        + count_nodes(node->condition)
+        + count_nodes(node->consequence)
+        + count_nodes(node->alternative)
+        + count_nodes(node->initialize)
+        + count_nodes(node->increment);
+    for (Node *b = node->body; b; b = b->next) {
+        n += count_nodes(b);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        n += count_nodes(a);
+    }
+    return n;
+}
+
+/*
+Evaluate an integer expression made only of literals.
+Returns false if the expression depends on anything known only at runtime.
+Arithmetic wraps like the generated code does.
+*/
+bool eval_const(Node *node, int *val) {
+    if (node == NULL || (node->type && !is_integer(node->type))) {
+        return false;
+    }
+
+    if (node->kind == ND_NUM) {
+        *val = node->val;
+        return true;
+    }
+
+    int l, r;
+    if (node->kind == ND_NEG) {
+        if (!eval_const(node->lhs, &l)) {
+            return false;
+        }
+        *val = (int)(0u - (unsigned)l);
+        return true;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NEQ:
+    case ND_LT:
+    case ND_LTE:
+        break;
+    default:
+        return false;
+    }
+
+    if (!eval_const(node->lhs, &l) || !eval_const(node->rhs, &r)) {
+        return false;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+        *val = (int)((unsigned)l + (unsigned)r);
+        return true;
+    case ND_SUB:
+        *val = (int)((unsigned)l - (unsigned)r);
+        return true;
+    case ND_MUL:
+        *val = (int)((unsigned)l * (unsigned)r);
+        return true;
+    case ND_DIV:
+        if (r == 0 || (l == -2147483647 - 1 && r == -1)) {
+            return false;
+        }
+        *val = l / r;
+        return true;
+    case ND_EQ:
+        *val = l == r;
+        return true;
+    case ND_NEQ:
+        *val = l != r;
+        return true;
+    case ND_LT:
+        *val = l < r;
+        return true;
+    case ND_LTE:
+        *val = l <= r;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Check if the subtree stores directly to `var`.
+bool assigns_var(Node *node, Obj *var) {
+    if (node == NULL) {
+        return false;
+    }
+
+    if (node->kind == ND_ASSIGN && node->lhs->kind == ND_VAR && node->lhs->var == var) {
+        return true;
+    }
+
+    for (Node *b = node->body; b; b = b->next) {
+        if (assigns_var(b, var)) {
+            return true;
+        }
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        if (assigns_var(a, var)) {
+            return true;
+        }
+    }
+
+    return assigns_var(node->lhs, var)
+        || assigns_var(node->rhs, var)
+        || assigns_var(node->condition, var)
+        || assigns_var(node->consequence, var)
+        || assigns_var(node->alternative, var)
+        || assigns_var(node->initialize, var)
+        || assigns_var(node->increment, var);
+}
+
+/*
+Check if the subtree takes the address of `var`.
+Arrays decay to pointers without an explicit `&`, so any use of an array counts.
+Once its address escapes, a variable may be changed through any store or call.
+*/
+bool addr_taken(Node *node, Obj *var) {
+    if (node == NULL) {
+        return false;
+    }
+
+    if (node->kind == ND_ADDR && node->lhs->kind == ND_VAR && node->lhs->var == var) {
+        return true;
+    }
+    if (node->kind == ND_VAR && node->var == var && var->type->kind == TY_ARRAY) {
+        return true;
+    }
+
+    for (Node *b = node->body; b; b = b->next) {
+        if (addr_taken(b, var)) {
+            return true;
+        }
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        if (addr_taken(a, var)) {
+            return true;
+        }
+    }
+
+    return addr_taken(node->lhs, var)
+        || addr_taken(node->rhs, var)
+        || addr_taken(node->condition, var)
+        || addr_taken(node->consequence, var)
+        || addr_taken(node->alternative, var)
+        || addr_taken(node->initialize, var)
+        || addr_taken(node->increment, var);
+}
+
+Node *new_expr_stmt(Node *expr, Token *repr, MemManager *mm) {
+    Node *node = new_unary(ND_EXPR_STMT, expr, repr, mm);
+    add_type(node, mm);
+    return node;
+}
+
+// var + delta, written as a subtraction when delta is negative.
+Node *offset_var(Obj *var, long delta, Token *repr, MemManager *mm) {
+    Node *node = new_var(var, repr, mm);
+    if (delta > 0) {
+        node = new_binary(ND_ADD, node, new_num(delta, repr, mm), repr, mm);
+    } else if (delta < 0) {
+        node = new_binary(ND_SUB, node, new_num(-delta, repr, mm), repr, mm);
+    }
+    add_type(node, mm);
+    return node;
+}
+
+// Overwrite `node` with a block, keeping its place in the statement list.
+void replace_with_block(Node *node, Node *stmts) {
+    Node *next = node->next;
+    Token *repr = node->repr;
+    *node = (Node){};
+    node->kind = ND_BLOCK;
+    node->repr = repr;
+    node->body = stmts;
+    node->next = next;
+}
+
+// Check if two expressions are the same tree, and so compute the same value
+// when evaluated at the same point.
+bool same_expr(Node *a, Node *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+
+    if (a->kind != b->kind) {
+        return false;
+    }
+
+    switch (a->kind) {
+    case ND_NUM:
+        return a->val == b->val;
+    case ND_VAR:
+        return a->var == b->var;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NEQ:
+    case ND_LT:
+    case ND_LTE:
+        return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+        return same_expr(a->lhs, b->lhs);
+    default:
+        return false;
+    }
+}
+
+// Add a compiler-generated local variable to `fn`.
+Obj *new_local(Obj *fn, char *name, Type *type, MemManager *mm) {
+    Obj *var = allocate(mm, sizeof(Obj));
+    var->name = name;
+    var->type = type;
+    var->is_local = true;
+    var->next = fn->locals;
+    fn->locals = var;
+    return var;
+}
+
+// Is `node` the variable `var`?
+bool is_var(Node *node, Obj *var) {
+    return node->kind == ND_VAR && node->var == var;
+}
+
+// How many times `node` and what it contains refer to `var`.
+int count_uses(Node *node, Obj *var) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int n = is_var(node, var)
+        + count_uses(node->lhs, var)
+        + count_uses(node->rhs, var)
+        + count_uses(node->condition, var)
+        + count_uses(node->consequence, var)
+        + count_uses(node->alternative, var)
+        + count_uses(node->initialize, var)
+        + count_uses(node->increment, var);
+    for (Node *b = node->body; b; b = b->next) {
+        n += count_uses(b, var);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        n += count_uses(a, var);
+    }
+    return n;
+}
+
+// Is `node`, or anything in it, of kind `kind`?
+bool contains(Node *node, NodeKind kind) {
+    if (node == NULL) {
+        return false;
+    }
+    if (node->kind == kind) {
+        return true;
+    }
+
+    for (Node *b = node->body; b; b = b->next) {
+        if (contains(b, kind)) {
+            return true;
+        }
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        if (contains(a, kind)) {
+            return true;
+        }
+    }
+    return contains(node->lhs, kind)
+        || contains(node->rhs, kind)
+        || contains(node->condition, kind)
+        || contains(node->consequence, kind)
+        || contains(node->alternative, kind)
+        || contains(node->initialize, kind)
+        || contains(node->increment, kind);
+}
+
+// Can `node` be recomputed at any point in the loop with the same result?
+bool is_invariant(Node *node, Node *loop, Obj *fn) {
+    switch (node->kind) {
+    case ND_NUM:
+        return true;
+    case ND_VAR:
+        return node->var->is_local
+            && node->var->type->kind == TY_INT
+            && !addr_taken(fn->body, node->var)
+            && !assigns_var(loop->consequence, node->var)
+            && !assigns_var(loop->increment, node->var);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+        return is_integer(node->type)
+            && is_invariant(node->lhs, loop, fn)
+            && is_invariant(node->rhs, loop, fn);
+    case ND_NEG:
+        return is_invariant(node->lhs, loop, fn);
+    default:
+        return false;
+    }
+}
+
+// Match `var = var + step`, `var = step + var` and `var = var - step`.
+static bool match_increment(Node *inc, Induction *ind) {
+    if (!inc || inc->kind != ND_ASSIGN || inc->lhs->kind != ND_VAR) {
+        return false;
+    }
+
+    Obj *var = inc->lhs->var;
+    if (!var->is_local || var->type->kind != TY_INT) {
+        return false;
+    }
+
+    Node *rhs = inc->rhs;
+    int step;
+    if (rhs->kind == ND_ADD && is_var(rhs->lhs, var) && eval_const(rhs->rhs, &step)) {
+        // var = var + step
+    } else if (rhs->kind == ND_ADD && is_var(rhs->rhs, var) && eval_const(rhs->lhs, &step)) {
+        // var = step + var
+    } else if (rhs->kind == ND_SUB && is_var(rhs->lhs, var) && eval_const(rhs->rhs, &step)) {
+        step = -step;
+    } else {
+        return false;
+    }
+
+    if (step == 0 || step > 0xffff || step < -0xffff) {
+        return false;
+    }
+
+    ind->var = var;
+    ind->step = step;
+    return true;
+}
+
+/*
+Recognize a counted loop: a local `int` stepped by a constant and compared
+against a bound which does not change inside the loop.
+*/
+bool find_induction(Node *loop, Obj *fn, Induction *ind) {
+    *ind = (Induction){};
+
+    if (!match_increment(loop->increment, ind)) {
+        return false;
+    }
+
+    Node *cond = loop->condition;
+    if (!cond || (cond->kind != ND_LT && cond->kind != ND_LTE)) {
+        return false;
+    }
+    ind->cmp = cond->kind;
+
+    if (is_var(cond->lhs, ind->var)) {
+        ind->upward = true;
+        ind->bound = cond->rhs;
+    } else if (is_var(cond->rhs, ind->var)) {
+        ind->upward = false;
+        ind->bound = cond->lhs;
+    } else {
+        return false;
+    }
+
+    // A step against the direction of the comparison would never terminate
+    // normally, so leave such loops alone.
+    if (ind->upward != (ind->step > 0)) {
+        return false;
+    }
+
+    if (addr_taken(fn->body, ind->var) || assigns_var(loop->consequence, ind->var)) {
+        return false;
+    }
+
+    if (!is_invariant(ind->bound, loop, fn)) {
+        return false;
+    }
+
+    Node *init = loop->initialize;
+    if (init && init->kind == ND_EXPR_STMT &&
+        init->lhs->kind == ND_ASSIGN && is_var(init->lhs->lhs, ind->var) &&
+        eval_const(init->lhs->rhs, &ind->start)) {
+        ind->has_start = true;
+    }
+
+    return true;
+}
+
+// Number of iterations, or -1 if it is not known at compile time.
+long trip_count(Induction *ind) {
+    int bound;
+    if (!ind->has_start || !eval_const(ind->bound, &bound)) {
+        return -1;
+    }
+
+    long start = ind->start;
+    long step = ind->step;
+    long span; // distance the variable travels while the condition holds
+    if (ind->upward) {
+        span = bound - start;
+    } else {
+        span = start - bound;
+        step = -step;
+    }
+
+    if (ind->cmp == ND_LTE) {
+        return span < 0 ? 0 : span / step + 1;
+    }
+    return span <= 0 ? 0 : (span + step - 1) / step;
+}
+
+/*
+The condition for `ahead` more steps of the counted loop `ind` to stay
+within its bound. Rather than the loop's own comparison at var + step *
+ahead, which may overflow where the loop would simply have stopped, it is
+checked as var < bound - step * ahead. Sets `*no_wrap` to the condition
+for that subtraction not to overflow, or to NULL if it cannot. Returns
+NULL if it always does.
+*/
+Node *steps_remain(Induction *ind, int ahead, Node **no_wrap, Token *repr, MemManager *mm) {
+    long dist = (long)ind->step * ahead;
+    if (dist > INT_MAX || dist < -INT_MAX) {
+        return NULL;
+    }
+
+    Node *var = new_var(ind->var, repr, mm);
+    Node *bound = copy_node(ind->bound, mm);
+    Node *cond, *check;
+    if (ind->upward) {
+        Node *limit = new_binary(ND_SUB, bound, new_num(dist, repr, mm), repr, mm);
+        cond = new_binary(ind->cmp, var, limit, repr, mm);
+        check = new_binary(ND_LTE, new_num(INT_MIN + dist, repr, mm), copy_node(ind->bound, mm), repr, mm);
+    } else {
+        // The step is negative, so the bound moves up
+        Node *limit = new_binary(ND_ADD, bound, new_num(-dist, repr, mm), repr, mm);
+        cond = new_binary(ind->cmp, limit, var, repr, mm);
+        check = new_binary(ND_LTE, copy_node(ind->bound, mm), new_num(INT_MAX + dist, repr, mm), repr, mm);
+    }
+    add_type(cond, mm);
+    add_type(check, mm);
+
+    int val;
+    *no_wrap = check;
+    if (eval_const(check, &val)) {
+        if (!val) {
+            return NULL;
+        }
+        *no_wrap = NULL;
+    }
+    return cond;
+}
+
+/*
+Run the AST-level optimization passes over every function.
+The tree stays fully typed so that `debug_ast` and `codegen` work on the result.
+Returns the program without the objects nothing reachable uses.
+*/
+Obj *optimize(Obj *prog, Options *opts, MemManager *mm) {
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->is_function && fn->body) {
+            eliminate_dead_code(fn, opts, mm);
+        }
+    }
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->is_function && fn->body) {
+            inline_calls(fn, prog, opts, mm);
+        }
+    }
+
+    // Functions whose code is kept from an incremental compilation stop here.
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (!fn->is_function || fn->fragment) {
+            continue;
+        }
+
+        vectorize_loops(fn, opts, mm);
+        unroll_loops(fn, opts, mm);
+        optimize_locals(fn, opts, mm);
+        eliminate_common_subexprs(fn, opts, mm);
+    }
+
+    return remove_unreachable(prog, opts, mm);
+}
@@ -1,10 +1,6 @@
 #include "charmcc.h"
 
-// All local variable instances found during parsing.
-Obj *locals;
-Obj *globals;
-
-static Node *new_node(NodeKind kind, Token *repr, MemManager *mm) {
+Node *new_node(NodeKind kind, Token *repr, MemManager *mm) {
     Node *node = allocate(mm, sizeof(Node));
 
     #if DEBUG_ALLOCS
@@ -55,6 +51,9 @@ static Node *new_node(NodeKind kind, Token *repr, MemManager *mm) {
     case ND_LOOP:
         fprintf(stderr, "loop\n");
         break;
+    case ND_VEC_LOOP:
+        fprintf(stderr, "vec loop\n");
+        break;
     case ND_RETURN:
         fprintf(stderr, "return\n");
         break;
@@ -70,28 +69,31 @@ static Node *new_node(NodeKind kind, Token *repr, MemManager *mm) {
     case ND_FN_CALL:
         fprintf(stderr, "fn call\n");
         break;
+    case ND_INLINE:
+        fprintf(stderr, "inline\n");
+        break;
     }
     #endif
 
     node->kind = kind;
-    node->repr = repr;
+    node->repr = keep_token(repr);
     return node;
 }
 
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *repr, MemManager *mm) {
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *repr, MemManager *mm) {
     Node *node = new_node(kind, repr, mm);
     node->lhs = lhs;
     node->rhs = rhs;
     return node;
 }
 
-static Node *new_unary(NodeKind kind, Node *expr, Token *repr, MemManager *mm) {
+Node *new_unary(NodeKind kind, Node *expr, Token *repr, MemManager *mm) {
     Node *node = new_node(kind, repr, mm);
     node->lhs = expr;
     return node;
 }
 
-static Node *new_var(Obj *var, Token *repr, MemManager *mm) {
+Node *new_var(Obj *var, Token *repr, MemManager *mm) {
     Node *node = new_node(ND_VAR, repr, mm);
     node->var = var;
     return node;
@@ -126,19 +128,19 @@ static Obj *new_obj(char *name, Type *type, MemManager *mm) {
 static Obj *new_lvar(char *name, Type *type, MemManager *mm) {
     Obj *var = new_obj(name, type, mm);
     var->is_local = true;
-    var->next = locals;
-    locals = var;
+    var->next = cc->locals;
+    cc->locals = var;
     return var;
 }
 
 static Obj *new_gvar(char *name, Type *type, MemManager *mm) {
     Obj *var = new_obj(name, type, mm);
-    var->next = globals;
-    globals = var;
+    var->next = cc->globals;
+    cc->globals = var;
     return var;
 }
 
-static Node *new_num(int val, Token *repr, MemManager *mm) {
+Node *new_num(int val, Token *repr, MemManager *mm) {
     Node *node = new_node(ND_NUM, repr, mm);
     node->val = val;
     return node;
@@ -169,13 +171,13 @@ static void create_param_lvars(Type *param, MemManager *mm) {
 
 // Find variable by name.
 static Obj *find_var(Token *tok) {
-    for (Obj *var = locals; var; var = var->next) {
+    for (Obj *var = cc->locals; var; var = var->next) {
         if (strlen(var->name) == tok->len &&
             !strncmp(tok->loc, var->name, tok->len)) {
             return var;
         }
     }
-    for (Obj *var = globals; var; var = var->next) {
+    for (Obj *var = cc->globals; var; var = var->next) {
         if (strlen(var->name) == tok->len &&
             !strncmp(tok->loc, var->name, tok->len)) {
             return var;
@@ -256,8 +258,9 @@ static Type *declarator(Token **rest, Token *tok, Type *type, MemManager *mm) {
         error_tok(tok, "expected a variable name");
     }
 
-    type = type_suffix(rest, tok->next, type, mm);
-    type->name = tok;
+    // the name goes on a copy, as `type` may be shared, like ty_int
+    type = copy_type(type_suffix(rest, tok->next, type, mm), mm);
+    type->name = keep_token(tok);
     return type;
 }
 
@@ -667,28 +670,36 @@ static Node *primary(Token **rest, Token *tok, MemManager *mm) {
 }
 
 // function-definition :: stmt*
-static Token *function(Token *tok, Type *base_type, MemManager *mm) {
-    Type *type = declarator(&tok, tok, type, mm);
+static Token *function(Token *tok, Type *base_type, bool is_static, MemManager *mm) {
+    Type *type = declarator(&tok, tok, base_type, mm);
 
     Obj *fn = new_gvar(get_ident(type->name, mm), type, mm);
     fn->is_function = true;
+    fn->is_static = is_static;
 
-    locals = NULL;
+    cc->locals = NULL;
 
     create_param_lvars(type->params, mm);
-    fn->params = locals;
+    fn->params = cc->locals;
 
     #if DEBUG_ALLOCS
     fprintf(stderr, "alloc func  %p %s\n", fn, fn->name);
     #endif
 
+    // An incremental compilation may reuse its code without parsing the body
+    if (reuse_function(fn)) {
+        fn->locals = cc->locals;
+        return item_end();
+    }
+
     tok = skip(tok, "{");
     fn->body = compound_stmt(&tok, tok, mm);
-    fn->locals = locals;
+    fn->locals = cc->locals;
     return tok;
 }
 
-static Token *global_variable(Token *tok, Type *base_type, MemManager *mm) {
+// global-variable :: declarator ("=" assign)? ("," declarator ("=" assign)?)* ";"
+static Token *global_variable(Token *tok, Type *base_type, bool is_static, MemManager *mm) {
     bool first = true;
     while (!consume(&tok, tok, ";")) {
         if (!first) {
@@ -697,7 +708,20 @@ static Token *global_variable(Token *tok, Type *base_type, MemManager *mm) {
         first = false;
 
         Type *type = declarator(&tok, tok, base_type, mm);
-        new_gvar(get_ident(type->name, mm), type, mm);
+        Obj *var = new_gvar(get_ident(type->name, mm), type, mm);
+        var->is_static = is_static;
+
+        if (equal(tok, "=")) {
+            Token *start = tok->next;
+            Node *init = assign(&tok, start, mm);
+            add_type(init, mm);
+            if (type->kind == TY_ARRAY) {
+                error_tok(start, "array initializers are not supported");
+            }
+            if (!eval_const(init, &var->init)) {
+                error_tok(start, "initializer is not a constant");
+            }
+        }
     }
     return tok;
 }
@@ -710,19 +734,27 @@ static bool is_function(Token *tok, MemManager *mm) {
     return type->kind == TY_FUNC;
 }
 
-// program :: (function-definition | global-variable)*
-Obj *parse(Token *tok, MemManager *mm) {
-    globals = NULL;
+// program :: ("static"? (function-definition | global-variable))*
+Obj *parse(char *input, MemManager *mm) {
+    cc->globals = NULL;
+    start_lexer(input);
 
+    Token *tok = next_item();
     while (tok->kind != TK_EOF) {
+        bool is_static = consume(&tok, tok, "static");
         Type *base_type = typespec(&tok, tok);
 
         if (is_function(tok, mm)) {
-            tok = function(tok, base_type, mm);
+            tok = function(tok, base_type, is_static, mm);
         } else {
-            tok = global_variable(tok, base_type, mm);
+            tok = global_variable(tok, base_type, is_static, mm);
+        }
+
+        // The end of this item's tokens, not necessarily of the program
+        if (tok->kind == TK_EOF) {
+            tok = next_item();
         }
     }
 
-    return globals;
+    return cc->globals;
 }
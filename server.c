@@ -0,0 +1,361 @@
+#define _POSIX_C_SOURCE 200809L
+#include "charmcc.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+The compile server: charmcc --server=PATH listens on a Unix socket, and
+charmcc --connect=PATH sends it its inputs instead of compiling them.
+
+The server keeps a Compiler with opts.incremental for each input name and
+set of options it has seen, so a file compiled again after an edit only
+regenerates the functions the edit touched (see incremental.c). Only the
+MAX_UNITS most recently used are kept, with all the code they hold. Each
+connection is served on a thread of its own; requests for the same unit
+wait for each other, others run at once.
+
+A connection carries one request and its response, each a 32-bit length
+followed by that many bytes:
+
+    request:  the Options fields as int32s, then target, name and source,
+              each NUL-terminated
+    response: an int32 status, 0 or -1, then the output or the error
+*/
+
+#define MAX_UNITS 64
+
+typedef struct Unit Unit;
+struct Unit {
+    Unit *next;
+    char *key;       // Input name and options
+    char *target;    // Owned copy of opts.target
+    Compiler *compiler;
+    pthread_mutex_t lock;
+    int users;       // Connections using it, under units_lock
+};
+
+// Most recently used first
+static Unit *units;
+static int nunits;
+static pthread_mutex_t units_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The option fields sent with a request, in order
+#define NFIELDS 9
+
+static void get_fields(Options *opts, int32_t *f) {
+    f[0] = opts->debug;
+    f[1] = opts->unroll;
+    f[2] = opts->vectorize;
+    f[3] = opts->inline_limit;
+    f[4] = opts->movt;
+    f[5] = opts->thumb;
+    f[6] = opts->object;
+    f[7] = opts->save_ast;
+    f[8] = opts->jobs;
+}
+
+static void set_fields(Options *opts, int32_t *f) {
+    opts->debug = f[0];
+    opts->unroll = f[1];
+    opts->vectorize = f[2];
+    opts->inline_limit = f[3];
+    opts->movt = f[4];
+    opts->thumb = f[5];
+    opts->object = f[6];
+    opts->save_ast = f[7];
+    opts->jobs = f[8];
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, void *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        // A peer that hung up is an error here, not a SIGPIPE
+        ssize_t n = send(fd, (char *)buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Reads a length and that many bytes into a new NUL-terminated buffer.
+static char *read_message(int fd, uint32_t *len) {
+    if (read_full(fd, len, sizeof(*len)) || *len > (1u << 30)) {
+        return NULL;
+    }
+    char *data = malloc(*len + 1);
+    if (!data || read_full(fd, data, *len)) {
+        free(data);
+        return NULL;
+    }
+    data[*len] = '\0';
+    return data;
+}
+
+static int write_message(int fd, int32_t status, char *data, uint32_t len) {
+    uint32_t total = sizeof(status) + len;
+    if (write_full(fd, &total, sizeof(total)) || write_full(fd, &status, sizeof(status))) {
+        return -1;
+    }
+    return write_full(fd, data, len);
+}
+
+static void free_unit(Unit *unit) {
+    charmcc_free(unit->compiler);
+    pthread_mutex_destroy(&unit->lock);
+    free(unit->target);
+    free(unit->key);
+    free(unit);
+}
+
+// Drops the least recently used units nobody is using, down to MAX_UNITS.
+static void evict_units(void) {
+    while (nunits > MAX_UNITS) {
+        Unit **victim = NULL;
+        for (Unit **u = &units; *u; u = &(*u)->next) {
+            if (!(*u)->users) {
+                victim = u;
+            }
+        }
+        if (!victim) {
+            return;
+        }
+        Unit *unit = *victim;
+        *victim = unit->next;
+        nunits--;
+        free_unit(unit);
+    }
+}
+
+// The unit compiling `name` with `opts`, made on first use. It is kept
+// until the caller gives it back with put_unit().
+static Unit *get_unit(char *name, Options *opts) {
+    int32_t f[NFIELDS];
+    get_fields(opts, f);
+    char *target = opts->target ? opts->target : "";
+    int len = snprintf(NULL, 0, "%s\n%s %d %d %d %d %d %d %d %d %d", name, target,
+                       f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7], f[8]);
+    char *key = malloc(len + 1);
+    snprintf(key, len + 1, "%s\n%s %d %d %d %d %d %d %d %d %d", name, target,
+             f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7], f[8]);
+
+    pthread_mutex_lock(&units_lock);
+    Unit **u = &units;
+    while (*u && strcmp((*u)->key, key)) {
+        u = &(*u)->next;
+    }
+    Unit *unit = *u;
+    if (unit) {
+        free(key);
+        *u = unit->next;
+    } else {
+        unit = calloc(1, sizeof(Unit));
+        unit->key = key;
+        unit->target = opts->target ? strdup(opts->target) : NULL;
+        Options own = *opts;
+        own.target = unit->target;
+        own.incremental = true;
+        unit->compiler = charmcc_new(&own);
+        pthread_mutex_init(&unit->lock, NULL);
+        nunits++;
+    }
+    unit->next = units;
+    units = unit;
+    unit->users++;
+    evict_units();
+    pthread_mutex_unlock(&units_lock);
+    return unit;
+}
+
+static void put_unit(Unit *unit) {
+    pthread_mutex_lock(&units_lock);
+    unit->users--;
+    pthread_mutex_unlock(&units_lock);
+}
+
+static void *serve_connection(void *arg) {
+    int fd = (intptr_t)arg;
+    uint32_t len;
+    char *req = read_message(fd, &len);
+
+    // The fields, then three strings, each ended within the request
+    char *source = NULL;
+    char *end, *target, *name;
+    if (req && len > sizeof(int32_t) * NFIELDS) {
+        end = req + len;
+        target = req + sizeof(int32_t) * NFIELDS;
+        name = target + strlen(target) + 1;
+        source = name < end ? name + strlen(name) + 1 : NULL;
+    }
+    if (!source || source > end) {
+        // Not a request
+        free(req);
+        close(fd);
+        return NULL;
+    }
+
+    Options opts;
+    charmcc_default_options(&opts);
+    int32_t f[NFIELDS];
+    memcpy(f, req, sizeof(f));
+    set_fields(&opts, f);
+    opts.target = *target ? target : NULL;
+
+    Unit *unit = get_unit(name, &opts);
+    Buffer out = {};
+    pthread_mutex_lock(&unit->lock);
+    if (charmcc_compile(unit->compiler, source, &out)) {
+        char *msg = charmcc_error(unit->compiler);
+        write_message(fd, -1, msg, strlen(msg));
+    } else {
+        write_message(fd, 0, out.data, out.len);
+    }
+    pthread_mutex_unlock(&unit->lock);
+    put_unit(unit);
+
+    free(out.data);
+    free(req);
+    close(fd);
+    return NULL;
+}
+
+static int socket_address(char *path, struct sockaddr_un *addr) {
+    *addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int charmcc_serve(char *path) {
+    // The socket is bound under another name and moved to `path` once it
+    // listens, so a client never finds it refusing connections. A socket
+    // left by an earlier server is replaced.
+    int len = strlen(path) + sizeof(".new");
+    char *tmp = malloc(len);
+    snprintf(tmp, len, "%s.new", path);
+    struct sockaddr_un addr;
+    int sock = -1;
+    if (socket_address(tmp, &addr) || (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        free(tmp);
+        return -1;
+    }
+    unlink(tmp);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 64) || rename(tmp, path)) {
+        int saved = errno;
+        close(sock);
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+    free(tmp);
+
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            int saved = errno;
+            close(sock);
+            errno = saved;
+            return -1;
+        }
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_connection, (void *)(intptr_t)fd)) {
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// Formats a failure to reach the server at `path`.
+static char *request_error(char *fmt, char *path, char *reason) {
+    int len = snprintf(NULL, 0, fmt, path, reason);
+    char *msg = malloc(len + 1);
+    snprintf(msg, len + 1, fmt, path, reason);
+    return msg;
+}
+
+int charmcc_request(char *path, Options *opts, char *name, char *source, Buffer *out, char **error) {
+    *error = NULL;
+    struct sockaddr_un addr;
+    int fd = -1;
+    if (socket_address(path, &addr) ||
+        (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        *error = request_error("cannot connect to %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    int32_t f[NFIELDS];
+    get_fields(opts, f);
+    char *target = opts->target ? opts->target : "";
+    int tlen = strlen(target) + 1, nlen = strlen(name) + 1, slen = strlen(source) + 1;
+    uint32_t len = sizeof(f) + tlen + nlen + slen;
+    char *req = malloc(sizeof(len) + len);
+    char *p = req;
+    memcpy(p, &len, sizeof(len));
+    memcpy(p += sizeof(len), f, sizeof(f));
+    memcpy(p += sizeof(f), target, tlen);
+    memcpy(p += tlen, name, nlen);
+    memcpy(p += nlen, source, slen);
+    int sent = write_full(fd, req, sizeof(len) + len);
+    free(req);
+
+    char *resp = sent ? NULL : read_message(fd, &len);
+    close(fd);
+    int32_t status;
+    if (!resp || len < sizeof(status)) {
+        free(resp);
+        *error = request_error("no answer from %s: %s", path, "connection closed");
+        return -1;
+    }
+    memcpy(&status, resp, sizeof(status));
+    char *data = resp + sizeof(status);
+    len -= sizeof(status);
+
+    if (status) {
+        *error = strdup(data);
+    } else {
+        if (out->cap < out->len + len + 1) {
+            out->cap = out->len + len + 1;
+            out->data = realloc(out->data, out->cap);
+        }
+        memcpy(out->data + out->len, data, len);
+        out->len += len;
+        out->data[out->len] = '\0';
+    }
+    free(resp);
+    return status ? -1 : 0;
+}
@@ -1,21 +1,33 @@
 #!/bin/bash
-CC=gcc
+CC=${CC:-gcc}
 
-cat <<EOF | gcc -xc -c -o tmp2.o -
+cat <<EOF | $CC -xc -c -o tmp2.o -
 int ret3() { return 3; }
 int ret5() { return 5; }
 int add(int x, int y) { return x+y; }
 int sub(int x, int y) { return x-y; }
 int add4(int a, int b, int c, int d) { return a+b+c+d; }
+int add6(int a, int b, int c, int d, int e, int f) { return a+b+c+d+e+f; }
 EOF
 
+# sizeof any pointer on the target
+ptr_size=4
+case "$FLAGS" in
+*--target=x86_64*|*--target=aarch64*) ptr_size=8 ;;
+esac
+
 assert() {
     expected="$1"
     input="$2"
 
-    ./charmcc "$input" > tmp.s || exit
-    $CC -o tmp tmp.s tmp2.o || exit
-    ./tmp
+    if [ -n "$OBJ" ]; then
+        ./charmcc $FLAGS -c -o tmp.o "$input" || exit
+        $CC -o tmp tmp.o tmp2.o || exit
+    else
+        ./charmcc $FLAGS -o tmp.s "$input" || exit
+        $CC -o tmp tmp.s tmp2.o || exit
+    fi
+    $RUN ./tmp
     actual="$?"
 
     if [ "$actual" = "$expected" ]; then
@@ -37,6 +49,25 @@ assert() {
     fi
 }
 
+# Checks that compiling `input` fails with the message `expected`.
+assert_error() {
+    expected="$1"
+    input="$2"
+
+    if actual=$(./charmcc $FLAGS -o /dev/null "$input" 2>&1); then
+        echo "$input => compiled, expected an error"
+        exit 1
+    fi
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$input => error"
+    else
+        echo "$input => $actual"
+        echo "expected $expected"
+        exit 1
+    fi
+}
+
 assert 0  'int main() { return 0; }'
 assert 42 'int main() { return 42; }'
 assert 21 'int main() { return 5+20-4; }'
@@ -101,6 +132,22 @@ assert 55 'int main() { int i=0; int j=0; for (i=0; i<=10; i=i+1) j=i+j; return
 assert 3  'int main() { for (;;) {return 3;} return 5; }'
 assert 10 'int main() { int j=0; int i; for (i=2048/2; i>2/2; i=i/2) j=j+1; return j; }'
 
+assert 9  'int main() { int x[4]; int i; for (i=0; i<4; i=i+1) x[i]=i*i; return x[3]; }'
+assert 4  'int main() { int i; for (i=0; i<4; i=i+1) 1; return i; }'
+assert 18 'int main() { int m[3][4]; int i; int j; int s=0; for (i=0; i<3; i=i+1) for (j=0; j<4; j=j+1) m[i][j]=i*j; for (i=0; i<3; i=i+1) for (j=0; j<4; j=j+1) s=s+m[i][j]; return s; }'
+assert 55 'int main() { int i; int j=0; for (i=10; i>0; i=i-1) j=j+i; return j; }'
+assert 45 'int main() { return sum(10); } int sum(int n) { int i; int s=0; for (i=0; i<n; i=i+1) s=s+i; return s; }'
+assert 3  'int main() { return sum(3); } int sum(int n) { int i; int s=0; for (i=0; i<n; i=i+1) s=s+i; return s; }'
+assert 0  'int main() { return sum(0); } int sum(int n) { int i; int s=0; for (i=0; i<n; i=i+1) s=s+i; return s; }'
+assert 42 'int main() { return sum(12); } int sum(int n) { int i; int s=0; for (i=0; i<=n; i=i+2) s=s+i; return s+i-14; }'
+assert 3 'int f(int n) { int s=0; int i; if (n == 0) return f(1); for (i = n - 1; i < n; i = i + 1) s = s + 1; return s; } int g(int n) { int s=0; int i; if (n == 0) return g(1); for (i = n + 1; n < i; i = i - 1) s = s + 2; return s; } int main() { return f(2147483647) + g(-2147483647-1); }'
+
+assert 148 'int main() { int a[8]; int b[8]; int i; int s=0; for (i=0; i<8; i=i+1) b[i]=i; for (i=0; i<8; i=i+1) { a[i]=b[i]*b[i]+1; s=s+a[i]; } return s; }'
+assert 24 'int main() { int a[10]; int b[10]; int i; for (i=0; i<10; i=i+1) b[i]=i; vadd(a, b, b, 10); return a[9]+a[3]; } int vadd(int *x, int *y, int *z, int n) { int i; for (i=0; i<n; i=i+1) x[i]=y[i]+z[i]; return 0; }'
+assert 9  'int main() { int a[10]; int i; for (i=0; i<10; i=i+1) a[i]=0; inc(a+1, a, 9); return a[9]; } int inc(int *x, int *y, int n) { int i; for (i=0; i<n; i=i+1) x[i]=y[i]+1; return 0; }'
+assert 27 'int main() { int a[7]; int i; int s=50; for (i=0; i<7; i=i+1) a[i]=i+1; for (i=0; i<7; i=i+1) s=s-(a[i]*2+-a[i]); return s+i-2; }'
+assert 24 'int main() { int m[2][8]; int i; int j; int s=0; for (j=0; j<2; j=j+1) for (i=0; i<8; i=i+1) m[j][i]=j+1; for (i=0; i<8; i=i+1) s=s+m[0][i]+m[1][i]; return s; }'
+
 assert 10 'int main() { int i=0; while (i<10) { i=i+1; } return i; }'
 assert 1  'int main() { int i=1024; while (i > 2/2) { i=i/2; } return i; }'
 assert 3 'int main() { {1; {2;} return 3;} }'
@@ -157,7 +204,7 @@ assert 5 'int main() { int x[2][3]; int *y=x; y[5]=5; return x[1][2]; }'
 
 assert 4  'int main() { int x; return sizeof(x); }'
 assert 4  'int main() { int x; return sizeof x; }'
-assert 4  'int main() { int *x; return sizeof(x); }'
+assert $ptr_size 'int main() { int *x; return sizeof(x); }'
 assert 16 'int main() { int x[4]; return sizeof(x); }'
 assert 48 'int main() { int x[3][4]; return sizeof(x); }'
 assert 16 'int main() { int x[3][4]; return sizeof(*x); }'
@@ -181,4 +228,224 @@ assert 3 'int x[4]; int main() { x[0]=0; x[1]=1; x[2]=2; x[3]=3; return x[3]; }'
 assert 4  'int x; int main() { return sizeof(x); }'
 assert 16 'int x[4]; int main() { return sizeof(x); }'
 
+assert 11 'int main() { int x=3; int *p=&x; int a = x+1; *p = 10; return x+1; }'
+assert 6 'int g; int main() { g=1; int a = g*2; bump(); return g*2 + a; } int bump() { g = g + 1; return 0; }'
+assert 21 'int main() { int i=2; int a=i*3; if (a) i=5; return i*3 + a; }'
+assert 50 'int main() { int i=0; int s=0; int k=3; while (i<4) { s = s + k*2; i = i + 1; k = k + 1; } return s + k*2; }'
+assert 12 'int main() { int a=2; int b=3; return add(a*b, a*b); }'
+assert 7 'int main() { int x[3][4]; int i=1; int j=2; x[i][j]=5; x[i][j] = x[i][j] + 1; return x[i][j] + (x[i][j] == 6); }'
+
+assert 4 'int main() { int x=3; int y=x+1; int z=7; z=8; return y; }'
+assert 9 'int main() { int a=1; int b=a; a=5; return a+b+b+b+b; }'
+assert 8 'int main() { int x=1; if (x) x=8; else x=2; return x; }'
+assert 6 'int main() { int i=0; int t=0; int s=0; while (i<3) { t=i; s=s+t; t=99; i=i+1; } return s+t-99+3; }'
+assert 3 'int main() { int x=1; int y=2; int dead=x+y; x=y=ret3(); return x; }'
+assert 5 'int main() { int x=0; for (x=1; x<5; x=x+1) 0; return x; }'
+
+assert 3 'int main() { return 3; return 5; }'
+assert 4 'int main() { if (0) return 3; else return 4; return 5; }'
+assert 2 'int main() { int x=2; if (1-1) x=7; while (0) x=9; return x; }'
+assert 6 'int main() { int i=0; for (;;) { i=i+1; if (i==6) return i; } return 0; }'
+assert 7 'static int g; static int dead; static int f() { return g+2; } static int unused() { return dead; } int main() { g=5; return f(); }'
+assert 5 'static int f() { return 5; } int main() { if (1) return f(); return unused(); } static int unused() { return 3; }'
+assert 4 'int unused; int g; int h = 2; int main() { g = 2; return g + h; }'
+
+assert 7 'static int add2(int x, int y) { return x+y; } int main() { int a=3; return add2(a, 4); }'
+assert 5 'int max(int a, int b) { if (a < b) return b; return a; } int main() { return max(2, 5) + max(3, 0) - 3; }'
+assert 12 'int sq(int x) { return x*x; } int quad(int x) { return sq(sq(x)) - sq(x) + x; } int main() { return quad(2) - 2; }'
+assert 30 'int dbl(int x) { int y=x+x; return y; } int main() { int s=0; int i=0; for (i=0; i<5; i=i+1) s = s + dbl(i); return s+10; }'
+assert 9 'int set(int *p, int v) { *p = v; return v; } int main() { int x=1; set(&x, 9); return x; }'
+assert 8 'int even(int n) { if (n == 0) return 1; return odd(n-1); } int odd(int n) { if (n == 0) return 0; return even(n-1); } int main() { return even(10) + 7; }'
+assert 24 'int fact(int n) { if (n <= 1) return 1; return n * fact(n-1); } int main() { return fact(4); }'
+
+assert 16 'int loop(int n, int acc) { if (n == 0) return acc; return loop(n-1, acc+1); } int main() { return loop(65536, 0) / 4096; }'
+assert 11 'int even(int n) { if (n == 0) return 1; return odd(n-1); } int odd(int n) { if (n == 0) return 0; return even(n-1); } int main() { return even(65536) + 10; }'
+assert 21 'int gcd(int a, int b) { if (b == 0) return a; return gcd(b, a - a/b*b); } int main() { return gcd(1071, 462); }'
+assert 13 'int main() { return add4(1, 2, 3, 7); }'
+assert 3 'int f(int *p) { return *p; } int g(int x) { return f(&x); } int main() { return g(3); }'
+
+assert 55 'int sum(int n) { int k=n; if (n==0) return 0; int r=sum(n-1); return k+r; } int main() { return sum(10); }'
+assert 8 'int leaf(int a, int b, int c) { int t=a*b; return t-c; } int main() { int x=2; int y=leaf(x, 5, 4); return x+y+leaf(0, 0, 0); }'
+assert 30 'int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=2; int x[2]; x[0]=h; return a+b+c+d+e+f+g+x[0]; }'
+
+assert 21 'int main() { return add6(1, 2, 3, 4, 5, 6); }'
+assert 33 'int main() { int x=2; return 1 + add6(x, x*2, add(x, 1), 4, add6(1, 1, 1, 1, 1, x), x+10); }'
+assert 6 'int f(int a, int b, int c, int d, int e, int g) { if (a == 0) return e-g; return f(a-1, b, c, d, e+2, g); } int main() { return f(3, 0, 0, 0, 1, 1); }'
+assert 12 'int f(int a, int b, int c, int d, int e) { int x[2]; x[1]=e; return a+b+c+d+x[1]; } int main() { return f(1, 2, 3, 4, 2); }'
+assert 4 'int sub5(int a, int b, int c, int d, int e) { return e-d+c-b+a; } int main() { int a=1; int b=2; return sub5(b, a, b, a, a) + sub5(0, 0, 0, 0, 1); }'
+
+assert 54 'int main() { return add(1,2)*(add(3,4)+add(5,6)*(add(1,1)-add(0,1))); }'
+assert 27 'int main() { int a[3]; a[0]=1; a[1]=2; a[2]=3; return add6(a[0]+a[1], a[2]*a[1], add(a[0], a[2]), a[2], add6(1, 1, 1, 1, a[0], a[1]), 1) + a[2]; }'
+
+assert 10 'int main() { int s=0; if (s == 0) { int a[4]; a[0]=3; a[3]=4; s=a[0]+a[3]; } else { int b[4]; b[1]=9; s=b[1]; } { int c[2]; c[0]=s; c[1]=3; s=c[0]+c[1]; } return s; }'
+assert 7 'int main() { int a[2]; int *p=a; int b[2]; b[0]=5; b[1]=6; a[1]=7; return p[1]; }'
+assert 12 'int main() { int i; int j; int c[2]; int t=0; c[0]=0; for (i=0; i<3; i=i+1) { for (j=0; j<2; j=j+1) { int d[2]; d[0]=c[0]; c[0]=d[0]+2; } t=c[0]; } return t; }'
+assert 45 'int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int k=9; int x[1]; x[0]=0; while (x[0] < 1) { x[0]=x[0]+1; a=a+0; } return a+b+c+d+e+f+g+h+k; }'
+
+assert 17 'int f(int x) { return x - 99990; } int main() { return f(100007); }'
+assert 1 'int f(int x) { return x < -1000; } int main() { return f(-1001) + f(-999)*2; }'
+assert 49 'int f(int x) { return (300 < x) + 2*(x == -1) + 4*(0 - x == 1); } int main() { return f(301) + f(-1)*8; }'
+assert 3 'int f(int x) { return x + 4096*4096; } int main() { return f(-16777216) + 3; }'
+assert 19 'int f(int x) { return x*65537 - 65537*x + 61440/x; } int main() { return f(4096) + 4; }'
+assert 5 'int main() { int a[1100]; a[0]=2; a[1099]=3; return a[0]+a[1099]; }'
+assert 7 'int main() { int a[1100]; int x; int *p=&x; *p=4; a[1099]=3; return x+a[1099]; }'
+
+assert 8 'int a[4]; int b; int c[2]; int main() { b=7; c[0]=9; a[3]=1; a[0]=2; return b + a[3]; }'
+assert 12 'int g = 3*4; int main() { return g; }'
+assert 5 'static int g = -2; int h = 0; int k = 7; int main() { h = h + 1; return g + k + h - 1; }'
+assert 30 'int x = 10; int *p; int main() { p = &x; *p = *p + 20; return x; }'
+assert 97 'int f(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j) { return i*10+j+a-b; } int main() { return f(2,3,4,5,6,7,8,9,9,8); }'
+assert 7 'int main() { int x; int y; y=5; if (y < 3) x = 1; else x = 7; return x; }'
+assert 4 'int main() { int x; int y; x=4; y=0; if (y) x = 0; return x; }'
+
+# The parser takes the program one top-level item at a time. Errors come
+# in source order, and those reported after parsing, from a token kept by
+# the AST, point into the right item after its tokens are reused.
+assert 5 'int f() { return 2; } int g = 3; int main() { return f() + g; }'
+assert_error 'int f() { return 1 é 2; }
+                   ^ invalid token' 'int main() { return 1; }
+int f() { return 1 é 2; }'
+assert_error 'int main() { return 1 }
+                      ^ expected '"';'"'' 'int main() { return 1 }
+int f() { return 1 é 2; }'
+assert_error 'int f(int x) { 3 = x; return x; }
+               ^ not an lvalue' 'int main() { return 0; }
+int f(int x) { 3 = x; return x; }
+int g(int x) { return x + 1 + 2 + 3 + 4 + 5 + 6 + 7 + 8; }'
+
+# --unroll=N sets the unroll factor, and --unroll=0 turns unrolling off
+input='int f(int n) { int s=0; int i; for (i=0; i<n; i=i+1) s=s+i; return s; } int main() { int s=0; int i; for (i=0; i<4; i=i+1) s=s+i; return s + f(10); }'
+FLAGS="$FLAGS --unroll=0" assert 51 "$input"
+FLAGS="$FLAGS --unroll=3" assert 51 "$input"
+./charmcc $FLAGS --unroll=0 --inline=0 --debug "$input" > tmp-u0.txt || exit
+./charmcc $FLAGS --unroll=3 --inline=0 --debug "$input" > tmp-u3.txt || exit
+if [ "$(grep -o '(loop' tmp-u0.txt | wc -l)" != 2 ] || ! grep -q '(- n, 2)' tmp-u3.txt; then
+    echo "--unroll is ignored"
+    exit 1
+fi
+
+# --stats reports the common subexpressions each function lost and its frame
+./charmcc $FLAGS --inline=0 --stats -o /dev/null 'int f(int a, int b) { return a*b + a*b; } int main() { return f(2, 3); }' 2>tmp-stats || exit
+if ! grep -q '^f: 1 common subexpressions eliminated' tmp-stats ||
+   [ "$(grep -c '^\(f\|main\): frame .* bytes$' tmp-stats)" != 2 ]; then
+    echo "--stats is wrong"
+    exit 1
+fi
+
+# Inlining a chain of calls that doubles at each step is bounded by the
+# caller's growth, not only by the size of each callee
+input='int f0(int x) { return x; }'
+for i in $(seq 1 12); do
+    input="$input int f$i(int x) { return f$((i-1))(x) + f$((i-1))(x+1); }"
+done
+input="$input int main() { return f12(1) == 28672; }"
+assert 1 "$input"
+./charmcc $FLAGS --stats -o /dev/null "$input" 2>tmp-stats || exit
+if [ "$(grep '^main: .* calls inlined' tmp-stats | cut -d' ' -f2)" -gt 8 ]; then
+    echo "inlining is unbounded"
+    exit 1
+fi
+
+# With --no-movt, a function too long for one literal pool at its end to be
+# in reach of every load gets more pools inside it
+input='int f(int s) {'
+sum=3
+for i in $(seq 1 600); do
+    input="$input s = s + $((1000003 + i * 4099));"
+    sum=$((sum + 1000003 + i * 4099))
+done
+input="$input return s; } int main() { return f(ret3()) == $sum; }"
+FLAGS="$FLAGS --no-movt" assert 1 "$input"
+
+# -c resolves calls to static functions, but keeps relocations for calls
+# and tail calls to functions other files can see
+if [ -n "$OBJ" ]; then
+    ./charmcc $FLAGS --inline=0 -c -o tmp-r.o 'static int s(int x) { return x*3; } int g(int x) { return s(x) + 1; } int h(int x) { return g(x); } int main() { return h(2) + 1; }' || exit
+    readelf -rW tmp-r.o > tmp-r.txt || exit
+    if ! grep -q 'R_ARM_CALL .* h$' tmp-r.txt || ! grep -q 'R_ARM_JUMP24 .* g$' tmp-r.txt || grep -q ' s$' tmp-r.txt; then
+        echo "-c relocates calls wrongly"
+        exit 1
+    fi
+fi
+
+# A global nothing uses is dropped, static or not, as no other file can see it
+./charmcc $FLAGS -o tmp-g.s 'int unused; int g; int main() { return g; }' || exit
+if grep -q __global_unused tmp-g.s || ! grep -q __global_g: tmp-g.s; then
+    echo "unused global is kept"
+    exit 1
+fi
+
+# Functions generated in parallel come out in the same order as without -j
+input='int f(int x) { if (x) return 1; return 2; } int g(int x) { int i; int s; s=0; for (i=0; i<x; i=i+1) s=s+i; return s; } int h() { return f(0) + g(4); } int main() { return h(); }'
+./charmcc $FLAGS -o tmp-j1.s "$input" || exit
+./charmcc $FLAGS -j4 -o tmp-j4.s "$input" || exit
+if ! cmp -s tmp-j1.s tmp-j4.s; then
+    echo "-j4 output differs"
+    exit 1
+fi
+
+# Several files compile in one run, each to its own output, and one that
+# fails makes the run fail without stopping the others
+echo 'int main() { return 3; }' > tmp-a.c
+echo 'int main() { return x; }' > tmp-b.c
+echo 'int f() { return 4; } int main() { return f(); }' > tmp-c.c
+if ./charmcc $FLAGS -j 2 tmp-a.c tmp-b.c tmp-c.c 2>/dev/null; then
+    echo "batch with an error succeeded"
+    exit 1
+fi
+./charmcc $FLAGS -o tmp-c1.s "$(cat tmp-c.c)" || exit
+if [ ! -f tmp-a.s ] || [ -f tmp-b.s ] || ! cmp -s tmp-c.s tmp-c1.s; then
+    echo "batch output is wrong"
+    exit 1
+fi
+
+# A cached result comes back the same, and other flags do not reuse it;
+# the unroll factor used for that must differ from any $FLAGS sets
+other=--unroll=7
+case "$FLAGS" in
+*--unroll=7*) other=--unroll=5 ;;
+esac
+rm -rf tmp-cache
+./charmcc $FLAGS --cache=tmp-cache -o tmp-c2.s "$(cat tmp-c.c)" || exit
+./charmcc $FLAGS --cache=tmp-cache --stats -o tmp-c3.s "$(cat tmp-c.c)" 2>tmp-stats || exit
+./charmcc $FLAGS --cache=tmp-cache --stats $other -o /dev/null "$(cat tmp-c.c)" 2>>tmp-stats || exit
+if ! cmp -s tmp-c1.s tmp-c3.s || [ "$(grep '^cache:' tmp-stats)" != "cache: 1 hits, 0 misses, 0 evicted
+cache: 0 hits, 1 misses, 0 evicted" ]; then
+    echo "cache is wrong"
+    exit 1
+fi
+
+# A program saved as an AST file compiles the same as its source
+./charmcc $FLAGS --save-ast -o tmp-c.ast tmp-c.c || exit
+./charmcc $FLAGS -o tmp-c4.s tmp-c.ast || exit
+if ! cmp -s tmp-c1.s tmp-c4.s; then
+    echo "AST file compiles differently"
+    exit 1
+fi
+
+# A compile server gives the same result as compiling directly, also after
+# an edit that lets it reuse the code of the functions it left alone
+rm -f tmp-server.sock
+./charmcc --server=tmp-server.sock &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S tmp-server.sock ] && break
+    sleep 0.1
+done
+echo 'int g(int x) { return x * 2; } int f() { return 4; } int main() { return f() + g(3); }' > tmp-d.c
+./charmcc $FLAGS --connect=tmp-server.sock -o tmp-d1.s tmp-d.c
+sed -i 's/return 4/return 5/' tmp-d.c
+./charmcc $FLAGS --connect=tmp-server.sock -o tmp-d2.s tmp-d.c
+if ./charmcc $FLAGS --connect=tmp-server.sock --stats -o /dev/null tmp-d.c 2>/dev/null; then
+    echo "--connect took --stats"
+    kill $server
+    exit 1
+fi
+kill $server
+./charmcc $FLAGS -o tmp-d3.s tmp-d.c || exit
+if [ ! -s tmp-d1.s ] || cmp -s tmp-d1.s tmp-d2.s || ! cmp -s tmp-d2.s tmp-d3.s; then
+    echo "compile server is wrong"
+    exit 1
+fi
+
 echo OK
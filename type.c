@@ -25,7 +25,7 @@ Type *pointer_to(Type *base, MemManager *mm) {
     #endif
 
     type->kind = TY_PTR;
-    type->size = PTR_SIZE;
+    type->size = cc->target->ptr_size;
     type->base = base;
     return type;
 }
@@ -56,6 +56,11 @@ Type *array_of(Type *base, int len, MemManager *mm) {
     return type;
 }
 
+// Alignment of a variable of the type.
+int type_align(Type *type) {
+    return type->kind == TY_ARRAY ? type_align(type->base) : type->size;
+}
+
 void add_type(Node *node, MemManager *mm) {
     if (!node || node->type) {
         return;
@@ -72,6 +77,9 @@ void add_type(Node *node, MemManager *mm) {
     for (Node *n = node->body; n; n = n->next) {
         add_type(n, mm);
     }
+    for (Node *n = node->args; n; n = n->next) {
+        add_type(n, mm);
+    }
 
     switch (node->kind) {
     case ND_ADD:
@@ -93,6 +101,7 @@ void add_type(Node *node, MemManager *mm) {
     case ND_LTE:
     case ND_NUM:
     case ND_FN_CALL:
+    case ND_INLINE:
         node->type = ty_int;
         return;
     case ND_VAR:
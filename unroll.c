@@ -0,0 +1,200 @@
+#include "charmcc.h"
+
+/*
+Loop unrolling.
+
+Only counted loops are considered: `for` loops that step a local `int` by a
+constant and compare it against a bound which does not change inside the loop.
+
+  for (i = 0; i < 4; i = i + 1) x[i] = i;
+
+Loops with a constant trip count that fit the size budget are replaced by one
+copy of the body per iteration, with `i` substituted by its value.
+
+  i = 0; x[0] = 0; x[1] = 1; x[2] = 2; x[3] = 3; i = 4;
+
+Other loops are unrolled by a factor, with the original loop left behind to
+run the remaining iterations. The unrolled loop takes the steps still to go
+off the bound, as adding them to `i` could overflow near INT_MAX, and is
+skipped when taking them off the bound would overflow instead.
+
+  i = 0;
+  if (-2147483645 <= n)
+      for (; i < n - 3; i = i + 1) { body; i = i + 1; body; i = i + 1; body; i = i + 1; body; }
+  for (; i < n; i = i + 1) body;
+*/
+
+// Loops with at most this many iterations may be fully unrolled...
+#define MAX_FULL_TRIP 16
+// ...as long as the unrolled body stays under this many nodes.
+#define FULL_UNROLL_BUDGET 256
+// Partially unrolled bodies are kept under this many nodes.
+#define PARTIAL_UNROLL_BUDGET 96
+#define MAX_UNROLL_FACTOR 4
+
+// Replace every read of `var` with the literal `val`.
+static void subst_var(Node *node, Obj *var, int val) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (is_var(node, var)) {
+        node->kind = ND_NUM;
+        node->var = NULL;
+        node->val = val;
+        return;
+    }
+
+    subst_var(node->lhs, var, val);
+    subst_var(node->rhs, var, val);
+    subst_var(node->condition, var, val);
+    subst_var(node->consequence, var, val);
+    subst_var(node->alternative, var, val);
+    subst_var(node->initialize, var, val);
+    subst_var(node->increment, var, val);
+    for (Node *b = node->body; b; b = b->next) {
+        subst_var(b, var, val);
+    }
+    for (Node *a = node->args; a; a = a->next) {
+        subst_var(a, var, val);
+    }
+}
+
+static void full_unroll(Node *loop, Induction *ind, long trip, MemManager *mm) {
+    Node head = {};
+    Node *cur = &head;
+    Token *repr = loop->repr;
+
+    cur = cur->next = loop->initialize;
+
+    long val = ind->start;
+    for (long i = 0; i < trip; i++) {
+        Node *body = copy_node(loop->consequence, mm);
+        subst_var(body, ind->var, val);
+        cur = cur->next = body;
+        val += ind->step;
+    }
+
+    // The variable is still visible after the loop, so leave it holding the
+    // value the loop would have exited with.
+    if (trip > 0) {
+        Node *assign = new_binary(ND_ASSIGN, new_var(ind->var, repr, mm), new_num(val, repr, mm), repr, mm);
+        cur = cur->next = new_expr_stmt(assign, repr, mm);
+    }
+
+    replace_with_block(loop, head.next);
+}
+
+static void partial_unroll(Node *loop, Induction *ind, int factor, MemManager *mm) {
+    Token *repr = loop->repr;
+
+    // Enter the unrolled loop only while `factor` more iterations remain,
+    // and only if the bound that checks that does not overflow.
+    Node *no_wrap;
+    Node *cond = steps_remain(ind, factor - 1, &no_wrap, repr, mm);
+    if (!cond) {
+        return;
+    }
+
+    Node head = {};
+    Node *cur = &head;
+    for (int i = 0; i < factor; i++) {
+        if (i > 0) {
+            cur = cur->next = new_expr_stmt(copy_node(loop->increment, mm), repr, mm);
+        }
+        cur = cur->next = copy_node(loop->consequence, mm);
+    }
+
+    Node *body = new_node(ND_BLOCK, repr, mm);
+    body->body = head.next;
+
+    Node *unrolled = new_node(ND_LOOP, repr, mm);
+    unrolled->condition = cond;
+    unrolled->consequence = body;
+    unrolled->increment = copy_node(loop->increment, mm);
+
+    Node *guarded = unrolled;
+    if (no_wrap) {
+        guarded = new_node(ND_IF, repr, mm);
+        guarded->condition = no_wrap;
+        guarded->consequence = unrolled;
+    }
+
+    Node *remainder = new_node(ND_LOOP, repr, mm);
+    remainder->condition = loop->condition;
+    remainder->consequence = loop->consequence;
+    remainder->increment = loop->increment;
+
+    Node *init = loop->initialize ? loop->initialize : new_node(ND_BLOCK, repr, mm);
+    init->next = guarded;
+    guarded->next = remainder;
+    replace_with_block(loop, init);
+}
+
+static void unroll_loop(Node *loop, Obj *fn, Options *opts, MemManager *mm) {
+    Induction ind;
+    if (!find_induction(loop, fn, &ind)) {
+        return;
+    }
+
+    int size = count_nodes(loop->consequence) + count_nodes(loop->increment);
+    long trip = trip_count(&ind);
+
+    if (trip >= 0) {
+        bool fits;
+        if (opts->unroll < 0) {
+            fits = trip <= MAX_FULL_TRIP && trip * size <= FULL_UNROLL_BUDGET;
+        } else {
+            fits = trip <= opts->unroll;
+        }
+        if (fits) {
+            full_unroll(loop, &ind, trip, mm);
+            return;
+        }
+    }
+
+    int factor = opts->unroll;
+    if (factor < 0) {
+        factor = MAX_UNROLL_FACTOR;
+        while (factor > 1 && factor * size > PARTIAL_UNROLL_BUDGET) {
+            factor /= 2;
+        }
+    }
+
+    if (factor < 2 || (trip >= 0 && trip < factor)) {
+        return;
+    }
+    partial_unroll(loop, &ind, factor, mm);
+}
+
+static void unroll_stmt(Node *node, Obj *fn, Options *opts, MemManager *mm) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            unroll_stmt(n, fn, opts, mm);
+        }
+        return;
+    case ND_IF:
+        unroll_stmt(node->consequence, fn, opts, mm);
+        unroll_stmt(node->alternative, fn, opts, mm);
+        return;
+    case ND_LOOP:
+        // Inner loops first, so the size of the outer body reflects them.
+        unroll_stmt(node->consequence, fn, opts, mm);
+        unroll_loop(node, fn, opts, mm);
+        return;
+    default:
+        return;
+    }
+}
+
+void unroll_loops(Obj *fn, Options *opts, MemManager *mm) {
+    if (opts->unroll == 0 || opts->unroll == 1) {
+        return;
+    }
+    unroll_stmt(fn->body, fn, opts, mm);
+}
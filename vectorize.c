@@ -0,0 +1,371 @@
+#include "charmcc.h"
+
+/*
+Loop vectorization.
+
+Counted loops stepping an index by one, whose body only does element-wise work
+on `int` arrays, are rewritten to handle four elements per iteration with NEON.
+
+  for (i = 0; i < n; i = i + 1) { a[i] = b[i] + c[i]; s = s + a[i]; }
+
+Every array access in the body has to be `base[i]` with a base that does not
+change inside the loop. Statements either store to such an element or add to
+a local scalar which is not used anywhere else in the body (a reduction).
+
+The vector loop runs while at least four iterations remain, checked as
+`i < n - 3` so that it cannot overflow where `i + 3` could (and skipped if
+`n - 3` would overflow itself), and the original loop runs whatever is left.
+When two bases might point into the same array, the vector loop is guarded
+by a runtime check that they are either identical or at least four elements
+apart, so no lane reads a value another lane of the same iteration was meant
+to write first.
+
+  i = 0;
+  if (overlap checks) vloop (i < n - 3; i = i + 4) { a[i] = b[i] + c[i]; s = s + a[i]; }
+  for (; i < n; i = i + 1) { a[i] = b[i] + c[i]; s = s + a[i]; }
+*/
+
+#define VEC_WIDTH 4
+// q0-q3 and q8-q11 hold temporaries, q12-q15 hold reductions.
+// q4-q7 are callee-saved and left alone.
+#define MAX_VEC_TEMPS 8
+#define MAX_REDUCTIONS 4
+#define MAX_BASES 8
+
+typedef struct VecInfo VecInfo;
+struct VecInfo {
+    Node *loop;
+    Obj *fn;
+    Induction ind;
+
+    // Distinct array bases accessed in the body
+    Node *bases[MAX_BASES];
+    bool written[MAX_BASES];
+    int nbases;
+
+    int nreductions;
+};
+
+// Is `node` the address of an array which stays put for the whole loop?
+static bool is_invariant_base(Node *node, VecInfo *info) {
+    switch (node->kind) {
+    case ND_VAR: {
+        Obj *var = node->var;
+        if (var->type->kind == TY_ARRAY) {
+            return true;
+        }
+        return var->type->kind == TY_PTR
+            && var->is_local
+            && !addr_taken(info->fn->body, var)
+            && !assigns_var(info->loop->consequence, var);
+    }
+    case ND_DEREF:
+        // Indexing into a multidimensional array only computes an address.
+        return node->type->kind == TY_ARRAY && is_invariant_base(node->lhs, info);
+    case ND_ADD:
+    case ND_SUB:
+        return node->lhs->type->base
+            && is_invariant_base(node->lhs, info)
+            && is_invariant(node->rhs, info->loop, info->fn);
+    default:
+        return false;
+    }
+}
+
+// The root variable of an address, for telling distinct arrays apart.
+static Obj *base_var(Node *node) {
+    while (node->kind != ND_VAR) {
+        node = node->lhs;
+    }
+    return node->var;
+}
+
+// Is `node` `base[i]` for an `int` element?
+static bool is_lane_access(Node *node, VecInfo *info, bool write) {
+    if (node->kind != ND_DEREF || node->type->kind != TY_INT) {
+        return false;
+    }
+
+    Node *addr = node->lhs;
+    if (addr->kind != ND_ADD || !addr->lhs->type->base) {
+        return false;
+    }
+
+    Node *idx = addr->rhs;
+    int scale;
+    if (idx->kind != ND_MUL || !is_var(idx->lhs, info->ind.var) ||
+        !eval_const(idx->rhs, &scale) || scale != ty_int->size) {
+        return false;
+    }
+
+    Node *base = addr->lhs;
+    if (!is_invariant_base(base, info)) {
+        return false;
+    }
+
+    for (int i = 0; i < info->nbases; i++) {
+        if (same_expr(info->bases[i], base)) {
+            info->written[i] |= write;
+            return true;
+        }
+    }
+
+    if (info->nbases == MAX_BASES) {
+        return false;
+    }
+    info->bases[info->nbases] = base;
+    info->written[info->nbases] = write;
+    info->nbases++;
+    return true;
+}
+
+// Is `node` computed lane by lane from elements and loop-invariant values?
+static bool is_vec_expr(Node *node, VecInfo *info) {
+    switch (node->kind) {
+    case ND_DEREF:
+        return is_lane_access(node, info, false);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+        return is_integer(node->type)
+            && is_vec_expr(node->lhs, info)
+            && is_vec_expr(node->rhs, info);
+    case ND_NEG:
+        return is_vec_expr(node->lhs, info);
+    default:
+        return is_integer(node->type) && is_invariant(node, info->loop, info->fn);
+    }
+}
+
+// Number of q registers needed to evaluate `node`.
+static int vec_regs(Node *node) {
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL: {
+        int l = vec_regs(node->lhs);
+        int r = vec_regs(node->rhs) + 1;
+        return l > r ? l : r;
+    }
+    case ND_NEG:
+        return vec_regs(node->lhs);
+    default:
+        return 1;
+    }
+}
+
+/*
+Returns the part of a reduction `s = s + e`, `s = e + s` or `s = s - e`
+which is computed lane by lane, or NULL if `assign` is not a reduction.
+*/
+Node *reduction_operand(Node *assign) {
+    if (assign->lhs->kind != ND_VAR) {
+        return NULL;
+    }
+
+    Obj *var = assign->lhs->var;
+    Node *rhs = assign->rhs;
+    if (rhs->kind == ND_ADD && is_var(rhs->lhs, var)) {
+        return rhs->rhs;
+    }
+    if (rhs->kind == ND_ADD && is_var(rhs->rhs, var)) {
+        return rhs->lhs;
+    }
+    if (rhs->kind == ND_SUB && is_var(rhs->lhs, var)) {
+        return rhs->rhs;
+    }
+    return NULL;
+}
+
+static bool is_vec_stmt(Node *stmt, VecInfo *info) {
+    if (stmt->kind != ND_EXPR_STMT || stmt->lhs->kind != ND_ASSIGN) {
+        return false;
+    }
+
+    Node *assign = stmt->lhs;
+    Node *expr;
+    if (assign->lhs->kind == ND_VAR) {
+        Obj *var = assign->lhs->var;
+        expr = reduction_operand(assign);
+        if (!expr || !var->is_local || var->type->kind != TY_INT ||
+            addr_taken(info->fn->body, var) ||
+            count_uses(info->loop->consequence, var) != 2 ||
+            info->nreductions == MAX_REDUCTIONS) {
+            return false;
+        }
+        info->nreductions++;
+    } else {
+        if (!is_lane_access(assign->lhs, info, true)) {
+            return false;
+        }
+        expr = assign->rhs;
+    }
+
+    return is_vec_expr(expr, info) && vec_regs(expr) <= MAX_VEC_TEMPS;
+}
+
+static bool is_vec_body(Node *body, VecInfo *info) {
+    if (body->kind != ND_BLOCK) {
+        return is_vec_stmt(body, info);
+    }
+
+    for (Node *n = body->body; n; n = n->next) {
+        if (!is_vec_stmt(n, info)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+Build a condition which is nonzero when base `a` and base `b` never hand
+overlapping elements to different lanes: they are equal, or at least a full
+vector apart in either direction.
+*/
+static Node *no_overlap(Node *a, Node *b, Token *repr, MemManager *mm) {
+    int width = VEC_WIDTH * ty_int->size;
+
+    Node *dist[3];
+    for (int i = 0; i < 3; i++) {
+        dist[i] = new_binary(ND_SUB, copy_node(a, mm), copy_node(b, mm), repr, mm);
+        dist[i]->type = ty_int; // byte distance, not scaled by the element size
+    }
+
+    Node *same = new_binary(ND_EQ, dist[0], new_num(0, repr, mm), repr, mm);
+    Node *above = new_binary(ND_LTE, new_num(width, repr, mm), dist[1], repr, mm);
+    Node *below = new_binary(ND_LTE, dist[2], new_unary(ND_NEG, new_num(width, repr, mm), repr, mm), repr, mm);
+    Node *node = new_binary(ND_ADD, new_binary(ND_ADD, same, above, repr, mm), below, repr, mm);
+    add_type(node, mm);
+    return node;
+}
+
+// Conjunction of the overlap checks the loop needs, or NULL if it needs none.
+static Node *alias_checks(VecInfo *info, Token *repr, MemManager *mm) {
+    Node *checks = NULL;
+
+    for (int i = 0; i < info->nbases; i++) {
+        for (int j = i + 1; j < info->nbases; j++) {
+            if (!info->written[i] && !info->written[j]) {
+                continue;
+            }
+
+            Obj *a = base_var(info->bases[i]);
+            Obj *b = base_var(info->bases[j]);
+            if (a != b && a->type->kind == TY_ARRAY && b->type->kind == TY_ARRAY) {
+                // distinct arrays never overlap
+                continue;
+            }
+
+            Node *check = no_overlap(info->bases[i], info->bases[j], repr, mm);
+            if (checks) {
+                checks = new_binary(ND_MUL, checks, check, repr, mm);
+                add_type(checks, mm);
+            } else {
+                checks = check;
+            }
+        }
+    }
+
+    return checks;
+}
+
+static void vectorize_loop(Node *loop, Obj *fn, MemManager *mm) {
+    VecInfo info = {};
+    info.loop = loop;
+    info.fn = fn;
+
+    if (!find_induction(loop, fn, &info.ind)) {
+        return;
+    }
+
+    Induction *ind = &info.ind;
+    if (ind->step != 1 || !ind->upward) {
+        return;
+    }
+
+    long trip = trip_count(ind);
+    if (trip >= 0 && trip < VEC_WIDTH) {
+        return;
+    }
+
+    if (!is_vec_body(loop->consequence, &info)) {
+        return;
+    }
+
+    Token *repr = loop->repr;
+
+    // Enter only while VEC_WIDTH more iterations remain.
+    Node *no_wrap;
+    Node *cond = steps_remain(ind, VEC_WIDTH - 1, &no_wrap, repr, mm);
+    if (!cond) {
+        return;
+    }
+
+    Node *step = new_binary(ND_ASSIGN, new_var(ind->var, repr, mm), offset_var(ind->var, VEC_WIDTH, repr, mm), repr, mm);
+    add_type(step, mm);
+
+    Node *vloop = new_node(ND_VEC_LOOP, repr, mm);
+    vloop->condition = cond;
+    vloop->consequence = copy_node(loop->consequence, mm);
+    vloop->increment = step;
+
+    Node *checks = alias_checks(&info, repr, mm);
+    Node *vec = vloop;
+    if (checks) {
+        vec = new_node(ND_IF, repr, mm);
+        vec->condition = checks;
+        vec->consequence = vloop;
+    }
+    if (no_wrap) {
+        Node *guard = new_node(ND_IF, repr, mm);
+        guard->condition = no_wrap;
+        guard->consequence = vec;
+        vec = guard;
+    }
+
+    Node *init = loop->initialize ? loop->initialize : new_node(ND_BLOCK, repr, mm);
+    init->next = vec;
+
+    // Keep the scalar loop for leftover iterations, unless it is known
+    // that there will never be any.
+    if (checks || no_wrap || trip < 0 || trip % VEC_WIDTH != 0) {
+        Node *scalar = new_node(ND_LOOP, repr, mm);
+        scalar->condition = loop->condition;
+        scalar->consequence = loop->consequence;
+        scalar->increment = loop->increment;
+        vec->next = scalar;
+    }
+
+    replace_with_block(loop, init);
+}
+
+static void vectorize_stmt(Node *node, Obj *fn, MemManager *mm) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            vectorize_stmt(n, fn, mm);
+        }
+        return;
+    case ND_IF:
+        vectorize_stmt(node->consequence, fn, mm);
+        vectorize_stmt(node->alternative, fn, mm);
+        return;
+    case ND_LOOP:
+        vectorize_stmt(node->consequence, fn, mm);
+        vectorize_loop(node, fn, mm);
+        return;
+    default:
+        return;
+    }
+}
+
+void vectorize_loops(Obj *fn, Options *opts, MemManager *mm) {
+    if (!opts->vectorize) {
+        return;
+    }
+    vectorize_stmt(fn->body, fn, mm);
+}
@@ -0,0 +1,376 @@
+#include "charmcc.h"
+
+/*
+x86-64 backend, emitting AT&T syntax for the System V calling convention.
+
+This is a plain stack machine: every expression leaves its value in %rax,
+temporaries are pushed, and locals all live in the frame below %rbp. Ints
+are kept sign-extended to 64 bits in registers, so that comparisons and
+pointer arithmetic can use whole registers.
+*/
+
+// State of the function being generated, one per thread
+typedef struct FnContext FnContext;
+struct FnContext {
+    Obj *fn;
+    int depth;
+    // Label at the end of the inlined call being generated, or -1
+    int inline_end;
+    int labels;
+};
+
+static _Thread_local FnContext ctx;
+
+static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
+static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+#define NUM_ARG_REGS 6
+
+static void gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+// Labels are numbered per function, as they are prefixed by its name.
+static int count(void) {
+    return ++ctx.labels;
+}
+
+static void push(void) {
+    emit("  push  %%rax\n");
+    ctx.depth++;
+}
+
+static void pop(char *arg) {
+    emit("  pop   %s\n", arg);
+    ctx.depth--;
+}
+
+static int align_to(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+static void load(Type *type) {
+    if (type->kind == TY_ARRAY) {
+        // references to the array are pointers to the first element
+        return;
+    }
+
+    if (type->size == 4) {
+        emit("  movslq (%%rax), %%rax\n");
+    } else {
+        emit("  mov   (%%rax), %%rax\n");
+    }
+}
+
+// Store %rax at the address on top of the stack.
+static void store(Type *type) {
+    pop("%rdi");
+    if (type->size == 4) {
+        emit("  mov   %%eax, (%%rdi)\n");
+    } else {
+        emit("  mov   %%rax, (%%rdi)\n");
+    }
+}
+
+// Wrap an int result around to 32 bits, as the other targets do.
+static void sign_extend(Type *type) {
+    if (type->kind == TY_INT) {
+        emit("  cltq\n");
+    }
+}
+
+static void gen_addr(Node *node) {
+    switch (node->kind) {
+    case ND_VAR:
+        if (node->var->is_local) {
+            emit("  lea   %d(%%rbp), %%rax\n", -node->var->offset);
+        } else {
+            emit("  lea   __global_%s(%%rip), %%rax\n", node->var->name);
+        }
+        return;
+    case ND_DEREF:
+        gen_expr(node->lhs);
+        return;
+    default:
+        break;
+    }
+
+    error_tok(node->repr, "not an lvalue");
+}
+
+/*
+The first six arguments go in registers, the rest on the stack in order,
+and %rsp must be 16-byte aligned at the call. The stack area is reserved
+first, then the arguments are evaluated in order: the register ones are
+pushed and popped into place at the end, the others stored into their slot.
+*/
+static void gen_call(Node *node) {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+        nargs++;
+    }
+    int nstack = nargs > NUM_ARG_REGS ? nargs - NUM_ARG_REGS : 0;
+    int reserved = nstack + (ctx.depth + nstack) % 2;
+
+    if (reserved) {
+        emit("  sub   $%d, %%rsp\n", 8 * reserved);
+        ctx.depth += reserved;
+    }
+
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next, i++) {
+        gen_expr(arg);
+        if (i < NUM_ARG_REGS) {
+            push();
+        } else {
+            // above the register arguments pushed so far
+            emit("  mov   %%rax, %d(%%rsp)\n", 8 * i);
+        }
+    }
+    for (i = (nargs < NUM_ARG_REGS ? nargs : NUM_ARG_REGS) - 1; i >= 0; i--) {
+        pop(argreg64[i]);
+    }
+
+    emit("  call  %s\n", node->func);
+    if (reserved) {
+        emit("  add   $%d, %%rsp\n", 8 * reserved);
+        ctx.depth -= reserved;
+    }
+    // the callee only sets %eax
+    emit("  cltq\n");
+}
+
+static void gen_expr(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        emit("  mov   $%d, %%rax\n", node->val);
+        return;
+    case ND_NEG:
+        gen_expr(node->lhs);
+        emit("  neg   %%rax\n");
+        sign_extend(node->type);
+        return;
+    case ND_VAR:
+        gen_addr(node);
+        load(node->type);
+        return;
+    case ND_ADDR:
+        gen_addr(node->lhs);
+        return;
+    case ND_DEREF:
+        gen_expr(node->lhs);
+        load(node->type);
+        return;
+    case ND_ASSIGN:
+        gen_addr(node->lhs);
+        push();
+        gen_expr(node->rhs);
+        store(node->type);
+        return;
+    case ND_FN_CALL:
+        gen_call(node);
+        return;
+    case ND_INLINE: {
+        // The returns inside leave their value in %rax, like a call would.
+        int outer = ctx.inline_end;
+        ctx.inline_end = count();
+        for (Node *n = node->body; n; n = n->next) {
+            gen_stmt(n);
+        }
+        emit("%s.inline.end.%d:\n", ctx.fn->name, ctx.inline_end);
+        ctx.inline_end = outer;
+        return;
+    }
+    default:
+        break;
+    }
+
+    gen_expr(node->rhs);
+    push();
+    gen_expr(node->lhs);
+    pop("%rdi");
+
+    switch (node->kind) {
+    case ND_ADD:
+        emit("  add   %%rdi, %%rax\n");
+        sign_extend(node->type);
+        return;
+    case ND_SUB:
+        emit("  sub   %%rdi, %%rax\n");
+        sign_extend(node->type);
+        return;
+    case ND_MUL:
+        emit("  imul  %%rdi, %%rax\n");
+        sign_extend(node->type);
+        return;
+    case ND_DIV:
+        emit("  cqo\n");
+        emit("  idiv  %%rdi\n");
+        return;
+    case ND_EQ:
+    case ND_NEQ:
+    case ND_LT:
+    case ND_LTE:
+        emit("  cmp   %%rdi, %%rax\n");
+        if (node->kind == ND_EQ) {
+            emit("  sete  %%al\n");
+        } else if (node->kind == ND_NEQ) {
+            emit("  setne %%al\n");
+        } else if (node->kind == ND_LT) {
+            emit("  setl  %%al\n");
+        } else {
+            emit("  setle %%al\n");
+        }
+        emit("  movzb %%al, %%rax\n");
+        return;
+    default:
+        break;
+    }
+
+    error_tok(node->repr, "invalid expression");
+}
+
+static void gen_stmt(Node *node) {
+    switch (node->kind) {
+    case ND_IF: {
+        int c = count();
+        gen_expr(node->condition);
+        emit("  cmp   $0, %%rax\n");
+        emit("  je    %s.if.else.%d\n", ctx.fn->name, c);
+        gen_stmt(node->consequence);
+        emit("  jmp   %s.if.end.%d\n", ctx.fn->name, c);
+        emit("%s.if.else.%d:\n", ctx.fn->name, c);
+        if (node->alternative) {
+            gen_stmt(node->alternative);
+        }
+        emit("%s.if.end.%d:\n", ctx.fn->name, c);
+        return;
+    }
+    case ND_LOOP: {
+        int c = count();
+        if (node->initialize) {
+            gen_stmt(node->initialize);
+        }
+        emit("%s.loop.begin.%d:\n", ctx.fn->name, c);
+        if (node->condition) {
+            gen_expr(node->condition);
+            emit("  cmp   $0, %%rax\n");
+            emit("  je    %s.loop.end.%d\n", ctx.fn->name, c);
+        }
+        gen_stmt(node->consequence);
+        if (node->increment) {
+            gen_expr(node->increment);
+        }
+        emit("  jmp   %s.loop.begin.%d\n", ctx.fn->name, c);
+        emit("%s.loop.end.%d:\n", ctx.fn->name, c);
+        return;
+    }
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            gen_stmt(n);
+        }
+        return;
+    case ND_RETURN:
+        gen_expr(node->lhs);
+        if (ctx.inline_end >= 0) {
+            emit("  jmp   %s.inline.end.%d\n", ctx.fn->name, ctx.inline_end);
+        } else {
+            emit("  jmp   %s.return\n", ctx.fn->name);
+        }
+        return;
+    case ND_EXPR_STMT:
+        gen_expr(node->lhs);
+        return;
+    default:
+        break;
+    }
+
+    // including vector loops, which this target does not ask for
+    error_tok(node->repr, "invalid statement");
+}
+
+// Index of `var` among the parameters of `fn`, or -1.
+static int param_index(Obj *fn, Obj *var) {
+    int i = 0;
+    for (Obj *param = fn->params; param; param = param->next, i++) {
+        if (param == var) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Locals are below %rbp in declaration order, so that pointer arithmetic
+from one to the next works as on the other targets. Parameters passed on
+the stack are above the return address. The frame is a multiple of 16
+bytes, so %rsp is aligned in the body while nothing is pushed.
+*/
+static void layout_frame(Obj *fn, Options *opts) {
+    int offset = 0;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        int i = param_index(fn, var);
+        if (i >= NUM_ARG_REGS) {
+            var->offset = -(16 + 8 * (i - NUM_ARG_REGS));
+            continue;
+        }
+        offset = align_to(offset + var->type->size, type_align(var->type));
+        var->offset = offset;
+    }
+    fn->stack_size = align_to(offset, 16);
+
+    if (opts->stats) {
+        fprintf(stderr, "%s: frame %d bytes\n", fn->name, fn->stack_size);
+    }
+}
+
+static void emit_function(Obj *fn) {
+    ctx = (FnContext){.fn = fn, .inline_end = -1};
+
+    emit("%s:\n", fn->name);
+    emit("  push  %%rbp\n");
+    emit("  mov   %%rsp, %%rbp\n");
+    if (fn->stack_size) {
+        emit("  sub   $%d, %%rsp\n", fn->stack_size);
+    }
+
+    // Save passed-by-register arguments to the stack
+    int i = 0;
+    for (Obj *var = fn->params; var && i < NUM_ARG_REGS; var = var->next, i++) {
+        char **regs = var->type->size == 4 ? argreg32 : argreg64;
+        emit("  mov   %s, %d(%%rbp)\n", regs[i], -var->offset);
+    }
+
+    gen_stmt(fn->body);
+    assert(ctx.depth == 0);
+
+    emit("%s.return:\n", fn->name);
+    emit("  mov   %%rbp, %%rsp\n");
+    emit("  pop   %%rbp\n");
+    emit("  ret\n\n");
+}
+
+static void emit_header(Obj *prog, Options *opts) {
+    // the stack need not be executable
+    emit(".section .note.GNU-stack,\"\",@progbits\n");
+    emit(".text\n");
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (obj->is_function && !obj->is_static) {
+            emit(".globl %s\n", obj->name);
+        }
+    }
+    emit("\n");
+}
+
+static char *data_directive(int size) {
+    return size == 4 ? ".long" : ".quad";
+}
+
+Target target_x86_64 = {
+    .name = "x86_64",
+    .ptr_size = 8,
+    .vectors = false,
+    .layout_frame = layout_frame,
+    .data_directive = data_directive,
+    .emit_header = emit_header,
+    .emit_function = emit_function,
+    // division is a single instruction, so no runtime
+};